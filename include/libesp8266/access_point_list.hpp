@@ -0,0 +1,289 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#include "http_response_parser.hpp"
+
+namespace embed {
+
+/**
+ * @brief Access points found by a scan with AT+CWLAP and the credentials of
+ * the networks that may be joined. When roaming, the strongest access point
+ * of a known network is chosen. A scan that finds more access points than
+ * fit keeps the strongest.
+ *
+ * The list also holds the roaming state of the driver it is given to: the
+ * signal of the access point joined, the one chosen to move to and the line
+ * of an answer being read, so a driver that does not roam does not pay for
+ * them.
+ *
+ */
+class access_point_list
+{
+public:
+  /**
+   * @brief When to move to a stronger access point, see
+   * esp8266::set_roaming()
+   *
+   */
+  struct roaming_options
+  {
+    /// Signal strength in dBm below which a stronger access point is looked
+    /// for
+    int8_t rssi_threshold = -75;
+    /// How much stronger in dB another access point has to be to move to it
+    uint8_t hysteresis = 8;
+    /// How often the signal is checked with AT+CWJAP_CUR?, zero to only scan
+    /// when scan() is called. Needs a clock given to set_clock().
+    std::chrono::milliseconds check_interval{ 30000 };
+    /// Listing the access points in range with AT+CWLAP
+    std::chrono::milliseconds scan{ 10000 };
+  };
+
+  /// Longest line of an answer that is read, the rest of a line is dropped
+  static constexpr size_t maximum_line_length = 96;
+
+  /// A network that may be joined
+  struct credentials
+  {
+    std::string_view ssid;
+    std::string_view password;
+  };
+
+  struct access_point
+  {
+    field_value<32> ssid;
+    /// MAC address, such as "aa:bb:cc:dd:ee:ff"
+    field_value<17> bssid;
+    /// Signal strength in dBm
+    int8_t rssi = 0;
+    uint8_t channel = 0;
+  };
+
+  /**
+   * @param p_known networks that may be joined, must outlive the list
+   * @param p_found holds the access points found by a scan
+   */
+  access_point_list(std::span<const credentials> p_known,
+                    std::span<access_point> p_found)
+    : m_known{ p_known }
+    , m_found{ p_found }
+  {}
+
+  /// Forget the access points found, done as a scan begins
+  void clear() { m_count = 0; }
+
+  /// Keep p_access_point, in place of the weakest one kept if full
+  void add(const access_point& p_access_point)
+  {
+    if (m_count < m_found.size()) {
+      m_found[m_count++] = p_access_point;
+      return;
+    }
+    auto weakest = std::min_element(
+      m_found.begin(),
+      m_found.end(),
+      [](const auto& p_left, const auto& p_right) {
+        return p_left.rssi < p_right.rssi;
+      });
+    if (weakest != m_found.end() && weakest->rssi < p_access_point.rssi) {
+      *weakest = p_access_point;
+    }
+  }
+
+  /// @return access points found by the last scan
+  std::span<const access_point> found() const
+  {
+    return std::span<const access_point>(m_found).first(m_count);
+  }
+
+  /// @return credentials for p_ssid, null if it is not a known network
+  const credentials* known(std::string_view p_ssid) const
+  {
+    for (const auto& network : m_known) {
+      if (network.ssid == p_ssid) {
+        return &network;
+      }
+    }
+    return nullptr;
+  }
+
+  /// @return strongest access point found of a known network, null if none
+  const access_point* strongest_known() const
+  {
+    const access_point* strongest = nullptr;
+    for (const auto& found_ap : found()) {
+      if (known(found_ap.ssid.view()) != nullptr &&
+          (strongest == nullptr || found_ap.rssi > strongest->rssi)) {
+        strongest = &found_ap;
+      }
+    }
+    return strongest;
+  }
+
+  /**
+   * @brief Read an entry of AT+CWLAP, the part after "+CWLAP:", such as
+   * `(3,"ssid",-67,"aa:bb:cc:dd:ee:ff",6,...)`
+   *
+   * @return false if p_entry is not a valid entry
+   */
+  static bool parse(std::string_view p_entry, access_point& p_access_point)
+  {
+    size_t ssid_start = p_entry.find('"');
+    size_t ssid_end = p_entry.find("\",", ssid_start + 1);
+    if (ssid_start == std::string_view::npos ||
+        ssid_end == std::string_view::npos) {
+      return false;
+    }
+    auto rest = p_entry.substr(ssid_end + 2);
+    int rssi = 0;
+    size_t bssid_start = rest.find('"');
+    size_t bssid_end = rest.find("\",", bssid_start + 1);
+    if (!from_decimal(rest, rssi) || bssid_start == std::string_view::npos ||
+        bssid_end == std::string_view::npos) {
+      return false;
+    }
+    p_access_point.ssid.assign(
+      p_entry.substr(ssid_start + 1, ssid_end - ssid_start - 1));
+    p_access_point.bssid.assign(
+      rest.substr(bssid_start + 1, bssid_end - bssid_start - 1));
+    p_access_point.rssi = static_cast<int8_t>(std::clamp(rssi, -128, 0));
+    p_access_point.channel = 0;
+    from_decimal(rest.substr(bssid_end + 2), p_access_point.channel);
+    return true;
+  }
+
+  void set_options(const roaming_options& p_options) { m_options = p_options; }
+  const roaming_options& options() const { return m_options; }
+
+  /**
+   * @brief Read the answer to AT+CWJAP_CUR?, the part after "+CWJAP_CUR:",
+   * such as `"ssid","aa:bb:cc:dd:ee:ff",6,-67` followed by more fields on
+   * newer firmware
+   *
+   * @return false if p_answer is not valid, the signal is left as it was
+   */
+  bool read_signal(std::string_view p_answer)
+  {
+    size_t bssid_start = p_answer.find("\",\"");
+    size_t bssid_end = p_answer.find("\",", bssid_start + 3);
+    size_t rssi_start = p_answer.find(',', bssid_end + 2);
+    int rssi = 0;
+    if (bssid_start == std::string_view::npos ||
+        bssid_end == std::string_view::npos ||
+        rssi_start == std::string_view::npos ||
+        !from_decimal(p_answer.substr(rssi_start + 1), rssi)) {
+      return false;
+    }
+    m_joined_bssid.assign(
+      p_answer.substr(bssid_start + 3, bssid_end - bssid_start - 3));
+    m_rssi = static_cast<int8_t>(std::clamp(rssi, -128, 0));
+    return true;
+  }
+
+  /// @return signal strength in dBm of the access point joined, 0 if unknown
+  int8_t rssi() const { return m_rssi; }
+
+  /// The signal is unknown until it is read again, such as after a rejoin
+  void forget_signal() { m_rssi = 0; }
+
+  /// @return true if the signal of the access point joined is known and
+  /// below the threshold
+  bool signal_weak() const
+  {
+    return m_rssi != 0 && m_rssi < m_options.rssi_threshold;
+  }
+
+  /**
+   * @return true if the signal of the access point joined is weak and
+   * p_access_point is another one, stronger by at least the hysteresis
+   */
+  bool worth_moving_to(const access_point& p_access_point) const
+  {
+    return signal_weak() &&
+           p_access_point.bssid.view() != m_joined_bssid.view() &&
+           p_access_point.rssi >= m_rssi + m_options.hysteresis;
+  }
+
+  /**
+   * @brief Keep the BSSID of p_access_point to join it by
+   *
+   * @return the BSSID kept, valid until the next access point is chosen
+   */
+  std::string_view choose(const access_point& p_access_point)
+  {
+    m_chosen_bssid = p_access_point.bssid;
+    m_rssi = 0;
+    return m_chosen_bssid.view();
+  }
+
+  /// @return BSSID of the access point chosen last, empty if none
+  std::string_view chosen_bssid() const { return m_chosen_bssid.view(); }
+
+  /// @param p_now uptime at which the signal was checked or a scan started
+  void checked(std::chrono::milliseconds p_now) { m_checked = p_now; }
+  std::chrono::milliseconds last_checked() const { return m_checked; }
+
+  /// Start over reading a line of an answer
+  void start_line() { m_line_length = 0; }
+
+  /**
+   * @brief Add p_character to the line being read, '\r' is left out
+   *
+   * @return true once p_character ends the line
+   */
+  bool add_to_line(char p_character)
+  {
+    if (p_character == '\n') {
+      return true;
+    }
+    if (p_character != '\r' && m_line_length < m_line.size()) {
+      m_line[m_line_length++] = p_character;
+    }
+    return false;
+  }
+
+  /// @return the line read
+  std::string_view line() const
+  {
+    return std::string_view(m_line.data(), m_line_length);
+  }
+
+private:
+  std::span<const credentials> m_known;
+  std::span<access_point> m_found;
+  size_t m_count = 0;
+  roaming_options m_options{};
+  /// BSSID and signal strength last read with AT+CWJAP_CUR?
+  field_value<17> m_joined_bssid;
+  int8_t m_rssi = 0;
+  field_value<17> m_chosen_bssid;
+  std::chrono::milliseconds m_checked{ 0 };
+  std::array<char, maximum_line_length> m_line{};
+  size_t m_line_length = 0;
+};
+
+/**
+ * @brief access_point_list that owns its storage
+ *
+ * @tparam Capacity most access points kept from a scan
+ */
+template<size_t Capacity = 8>
+class static_access_point_list : public access_point_list
+{
+public:
+  /// @param p_known networks that may be joined, must outlive the list
+  explicit static_access_point_list(std::span<const credentials> p_known)
+    : access_point_list(p_known, m_storage)
+  {}
+
+private:
+  std::array<access_point, Capacity> m_storage{};
+};
+} // namespace embed
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+
+namespace embed {
+
+/**
+ * @brief Ring buffer of datagrams received on a UDP link. Each datagram is
+ * kept behind a two byte length so datagrams of any size share the buffer and
+ * are read back whole, oldest first. A datagram that does not fit is dropped.
+ *
+ */
+class datagram_ring
+{
+public:
+  /// Bytes in front of each datagram holding its length
+  static constexpr size_t length_size = 2;
+
+  /// @param p_storage memory shared by the datagrams and their lengths
+  explicit datagram_ring(std::span<std::byte> p_storage)
+    : m_storage{ p_storage }
+  {}
+
+  /**
+   * @brief Make room for a datagram of p_length bytes, it is only added to
+   * the ring by commit()
+   *
+   * @return where its bytes go, the second part is used when the datagram
+   * wraps around the end of the storage. Both are empty if it does not fit.
+   */
+  std::array<std::span<std::byte>, 2> prepare(size_t p_length)
+  {
+    size_t needed = length_size + p_length;
+    if (p_length > std::numeric_limits<uint16_t>::max() ||
+        needed > m_storage.size() - m_used) {
+      m_dropped++;
+      m_pending = 0;
+      return {};
+    }
+    size_t end = m_front + m_used;
+    at(end) = static_cast<std::byte>(p_length & 0xFF);
+    at(end + 1) = static_cast<std::byte>(p_length >> 8);
+    size_t begin = (end + length_size) % m_storage.size();
+    size_t first = std::min(p_length, m_storage.size() - begin);
+    m_pending = needed;
+    return { m_storage.subspan(begin, first),
+             m_storage.first(p_length - first) };
+  }
+
+  /// Add the datagram given to the last prepare() to the ring
+  void commit()
+  {
+    m_used += m_pending;
+    m_count += (m_pending != 0) ? 1 : 0;
+    m_pending = 0;
+  }
+
+  /**
+   * @brief Take the oldest datagram out of the ring
+   *
+   * @param p_destination where to copy it, a longer datagram is cut off
+   * @return std::span<std::byte> the part of p_destination holding the
+   * datagram, empty if there is none
+   */
+  std::span<std::byte> receive(std::span<std::byte> p_destination)
+  {
+    if (m_count == 0) {
+      return {};
+    }
+    size_t length = next_size();
+    size_t copied = std::min(length, p_destination.size());
+    for (size_t i = 0; i < copied; i++) {
+      p_destination[i] = at(m_front + length_size + i);
+    }
+    m_front = (m_front + length_size + length) % m_storage.size();
+    m_used -= length_size + length;
+    m_count--;
+    return p_destination.first(copied);
+  }
+
+  /// @return length of the oldest datagram, 0 if there is none
+  size_t next_size() const
+  {
+    if (m_count == 0) {
+      return 0;
+    }
+    return std::to_integer<size_t>(at(m_front)) |
+           (std::to_integer<size_t>(at(m_front + 1)) << 8);
+  }
+
+  /// @return number of datagrams in the ring
+  size_t size() const { return m_count; }
+  bool empty() const { return m_count == 0; }
+  /// @return datagrams dropped as there was no room, wrapping around
+  uint32_t dropped() const { return m_dropped; }
+
+private:
+  std::byte& at(size_t p_index) const
+  {
+    return m_storage[p_index % m_storage.size()];
+  }
+
+  std::span<std::byte> m_storage;
+  size_t m_front = 0;
+  size_t m_used = 0;
+  size_t m_count = 0;
+  size_t m_pending = 0;
+  uint32_t m_dropped = 0;
+};
+
+/**
+ * @brief datagram_ring that owns its storage
+ *
+ * @tparam Size bytes shared by the datagrams, each also takes two bytes for
+ * its length
+ */
+template<size_t Size = 512>
+class static_datagram_ring : public datagram_ring
+{
+public:
+  static_datagram_ring()
+    : datagram_ring(m_storage)
+  {}
+
+private:
+  std::array<std::byte, Size> m_storage{};
+};
+} // namespace embed
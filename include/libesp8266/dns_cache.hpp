@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+namespace embed {
+
+/**
+ * @brief Remembers the IPv4 address each domain resolved to, so that
+ * connecting to the same server again skips the DNS lookup. The least recently
+ * used entry makes room for a new one and entries expire after a fixed
+ * lifetime, as the AT firmware does not report the TTL of a lookup.
+ *
+ */
+class dns_cache
+{
+public:
+  /// Longest domain that can be cached
+  static constexpr size_t maximum_domain_length = 64;
+
+  using address_t = std::array<uint8_t, 4>;
+
+  struct entry
+  {
+    std::array<char, maximum_domain_length> domain{};
+    uint8_t domain_length = 0;
+    address_t address{};
+    std::chrono::milliseconds resolved_at{ 0 };
+    /// Ordering of uses for finding the least recently used entry, 0 if empty
+    uint32_t last_used = 0;
+  };
+
+  /**
+   * @param p_entries storage for the cached addresses
+   * @param p_lifetime how long an address is used before the domain is looked
+   * up again. Only enforced with a clock given to the driver.
+   */
+  dns_cache(std::span<entry> p_entries,
+            std::chrono::milliseconds p_lifetime = std::chrono::minutes(5))
+    : m_entries{ p_entries }
+    , m_lifetime{ p_lifetime }
+  {}
+
+  /**
+   * @param p_domain domain to look for
+   * @param p_now current uptime
+   * @return const address_t* cached address of p_domain, null if there is
+   * none or it has expired
+   */
+  const address_t* find(std::string_view p_domain,
+                        std::chrono::milliseconds p_now)
+  {
+    auto* cached = lookup(p_domain);
+    if (cached == nullptr) {
+      return nullptr;
+    }
+    if (p_now - cached->resolved_at >= m_lifetime) {
+      cached->last_used = 0;
+      return nullptr;
+    }
+    cached->last_used = ++m_uses;
+    return &cached->address;
+  }
+
+  /// Remember that p_domain resolved to p_address at p_now
+  void insert(std::string_view p_domain,
+              const address_t& p_address,
+              std::chrono::milliseconds p_now)
+  {
+    if (p_domain.size() > maximum_domain_length || m_entries.empty()) {
+      return;
+    }
+    auto* slot = lookup(p_domain);
+    if (slot == nullptr) {
+      slot = &*std::min_element(
+        m_entries.begin(), m_entries.end(), [](const auto& a, const auto& b) {
+          return a.last_used < b.last_used;
+        });
+    }
+    std::copy(p_domain.begin(), p_domain.end(), slot->domain.begin());
+    slot->domain_length = static_cast<uint8_t>(p_domain.size());
+    slot->address = p_address;
+    slot->resolved_at = p_now;
+    slot->last_used = ++m_uses;
+  }
+
+  /// Forget p_domain, for example after connecting to its address failed
+  void erase(std::string_view p_domain)
+  {
+    if (auto* cached = lookup(p_domain)) {
+      cached->last_used = 0;
+    }
+  }
+
+private:
+  entry* lookup(std::string_view p_domain)
+  {
+    for (auto& cached : m_entries) {
+      if (cached.last_used != 0 &&
+          std::string_view(cached.domain.data(), cached.domain_length) ==
+            p_domain) {
+        return &cached;
+      }
+    }
+    return nullptr;
+  }
+
+  std::span<entry> m_entries;
+  std::chrono::milliseconds m_lifetime;
+  uint32_t m_uses = 0;
+};
+
+/**
+ * @brief dns_cache that owns its entries
+ *
+ * @tparam Capacity number of domains remembered
+ */
+template<size_t Capacity = 4>
+class static_dns_cache : public dns_cache
+{
+public:
+  explicit static_dns_cache(
+    std::chrono::milliseconds p_lifetime = std::chrono::minutes(5))
+    : dns_cache(m_storage, p_lifetime)
+  {}
+
+private:
+  std::array<entry, Capacity> m_storage{};
+};
+} // namespace embed
@@ -3,19 +3,360 @@
 #include <algorithm>
 #include <array>
 #include <cctype>
+#include <charconv>
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <limits>
 #include <span>
 #include <string_view>
+#include <utility>
 
 #include <libembeddedhal/driver.hpp>
 #include <libembeddedhal/serial/serial.hpp>
 
+#include "access_point_list.hpp"
+#include "datagram_ring.hpp"
+#include "dns_cache.hpp"
+#include "http_response_parser.hpp"
+#include "inflate.hpp"
+#include "receive_ring.hpp"
+#include "response_cache.hpp"
+
 namespace embed {
 
-class read_into_buffer
+/**
+ * @brief Reads from a serial port a chunk at a time and lets a reader hand back
+ * the bytes it pulled in but did not consume, so that the next reader sees them
+ * before any new data from the serial port.
+ *
+ */
+class serial_reader
+{
+public:
+  /// Maximum number of bytes pulled from the serial port per fetch()
+  static constexpr size_t chunk_size = 64;
+
+  serial_reader(embed::serial& p_serial)
+    : m_serial{ p_serial }
+    , m_chunk{}
+    , m_unread{}
+  {}
+
+  /**
+   * @return size_t number of bytes that can be read without waiting
+   */
+  size_t bytes_available()
+  {
+    if (m_ring != nullptr) {
+      return m_ring->size() - m_held;
+    }
+    return m_unread.size() + m_serial.bytes_available();
+  }
+
+  /**
+   * @brief Read from p_ring, filled by the receive interrupt, rather than from
+   * the serial port. Fetched spans then point into the ring, which keeps them
+   * until the next fetch() or read().
+   *
+   * @param p_ring ring to read from, null to read from the serial port again
+   */
+  void use_ring(receive_ring* p_ring)
+  {
+    m_ring = p_ring;
+    m_held = 0;
+    m_unread = {};
+  }
+
+  /**
+   * @brief Get the next run of received bytes. Bytes handed back with
+   * `unread()` are returned first, otherwise up to `chunk_size` bytes are read
+   * from the serial port into an internal chunk.
+   *
+   * @param p_limit return at most this many bytes
+   * @return std::span<const std::byte> received bytes, empty if there are none.
+   * The span is only valid until the next call to fetch() or read().
+   */
+  std::span<const std::byte> fetch(size_t p_limit = chunk_size)
+  {
+    if (m_ring != nullptr) {
+      release();
+      auto run = m_ring->readable();
+      run = run.first(std::min(p_limit, run.size()));
+      m_held = run.size();
+      return run;
+    }
+
+    if (!m_unread.empty()) {
+      auto run = m_unread.first(std::min(p_limit, m_unread.size()));
+      m_unread = m_unread.subspan(run.size());
+      return run;
+    }
+
+    if (m_serial.bytes_available() == 0U) {
+      return {};
+    }
+
+    auto chunk = m_serial.read(std::span{ m_chunk }.first(
+      std::min(p_limit, m_chunk.size())));
+    m_bytes_read += chunk.size();
+    return chunk;
+  }
+
+  /**
+   * @brief Hand back the tail end of the last fetched span so that the next
+   * call to fetch() or read() returns it.
+   *
+   * @param p_tail unconsumed bytes from the span returned by fetch()
+   */
+  void unread(std::span<const std::byte> p_tail)
+  {
+    if (m_ring != nullptr) {
+      // The tail stays in the ring for the next reader
+      m_held -= p_tail.size();
+      return;
+    }
+    // A limited fetch() of unread bytes leaves the rest of them directly
+    // after p_tail in the chunk, so the two join back together.
+    m_unread = std::span{ p_tail.data(), p_tail.size() + m_unread.size() };
+  }
+
+  /**
+   * @brief Read bytes into p_data, draining unread bytes before reading from
+   * the serial port.
+   *
+   * @param p_data buffer to fill
+   * @return std::span<const std::byte> the portion of p_data that was filled
+   */
+  std::span<const std::byte> read(std::span<std::byte> p_data)
+  {
+    if (m_ring != nullptr) {
+      release();
+      size_t count = 0;
+      // Twice at most, for bytes that wrap around the end of the ring
+      for (auto run = m_ring->readable(); count < p_data.size() && !run.empty();
+           run = m_ring->readable()) {
+        size_t length = std::min(run.size(), p_data.size() - count);
+        std::copy_n(run.begin(), length, p_data.begin() + count);
+        m_ring->consume(length);
+        m_bytes_read += length;
+        count += length;
+      }
+      return p_data.first(count);
+    }
+
+    if (!m_unread.empty()) {
+      size_t count = std::min(p_data.size(), m_unread.size());
+      std::copy_n(m_unread.begin(), count, p_data.begin());
+      m_unread = m_unread.subspan(count);
+      return p_data.first(count);
+    }
+
+    auto received = m_serial.read(p_data);
+    m_bytes_read += received.size();
+    return received;
+  }
+
+  /// Discard unread bytes as well as everything buffered by the serial port
+  void flush()
+  {
+    m_unread = {};
+    if (m_ring != nullptr) {
+      m_held = 0;
+      m_ring->clear();
+    }
+    m_serial.flush();
+  }
+
+  /// @return size_t total bytes read from the serial port, wrapping around
+  size_t bytes_read() const { return m_bytes_read; }
+
+private:
+  /// Free the bytes of the last span fetched from the ring
+  void release()
+  {
+    m_ring->consume(m_held);
+    m_bytes_read += m_held;
+    m_held = 0;
+  }
+
+  embed::serial& m_serial;
+  std::array<std::byte, chunk_size> m_chunk;
+  std::span<const std::byte> m_unread;
+  receive_ring* m_ring = nullptr;
+  /// Bytes of the last span fetched from the ring that are still in use
+  size_t m_held = 0;
+  size_t m_bytes_read = 0;
+};
+
+/**
+ * @brief Queues writes to a serial port and starts each one as soon as the port
+ * is no longer busy, so the writer never waits for a transmission to finish.
+ *
+ * Spans given to write() are transmitted in place and must stay valid until
+ * they have been sent. Spans given to write_copy() are copied into a small
+ * internal buffer first. A write that does not fit in the queue or the copy
+ * buffer is refused rather than waited for, the writer tries again once done()
+ * returns true. The esp8266 driver only starts a command then, and no command
+ * takes more than the queue holds.
+ *
+ */
+class transmit_queue
 {
 public:
-  read_into_buffer(embed::serial& p_serial)
+  /// Number of writes that can be queued
+  static constexpr size_t maximum_writes = 12;
+  /// Bytes of copied writes that can be queued
+  static constexpr size_t copy_capacity = 64;
+
+  transmit_queue(embed::serial& p_serial)
     : m_serial{ p_serial }
+    , m_writes{}
+    , m_copies{}
+  {}
+
+  /**
+   * @param p_data bytes to transmit, must stay valid until done() returns true
+   * @return false if the queue is full, nothing is queued then
+   */
+  bool write(std::span<const std::byte> p_data)
+  {
+    if (!p_data.empty() && m_count == m_writes.size() &&
+        !continues_last(p_data, false)) {
+      return false;
+    }
+    push(p_data, false);
+    return true;
+  }
+
+  /**
+   * @param p_data bytes to transmit, copied so they need not outlive the call
+   * @return false if the queue or the copy buffer is full, nothing is queued
+   * then
+   */
+  bool write_copy(std::span<const std::byte> p_data)
+  {
+    // Copies are freed in the order they were made, so the copy buffer is used
+    // as a ring and a copy that would wrap around is split in two.
+    size_t head = (m_copies_begin + m_copies_used) % m_copies.size();
+    size_t pieces = (p_data.size() > m_copies.size() - head) ? 2 : 1;
+    if (!p_data.empty() && (p_data.size() > m_copies.size() - m_copies_used ||
+                            m_count + pieces > m_writes.size())) {
+      return false;
+    }
+    while (!p_data.empty()) {
+      head = (m_copies_begin + m_copies_used) % m_copies.size();
+      size_t count = std::min(p_data.size(), m_copies.size() - head);
+      auto copy = std::span{ m_copies }.subspan(head, count);
+      std::copy_n(p_data.begin(), count, copy.begin());
+      m_copies_used += count;
+      p_data = p_data.subspan(count);
+      push(copy, true);
+    }
+    return true;
+  }
+
+  /**
+   * @brief Start the next queued writes while the serial port is not busy
+   *
+   * @return true once everything queued has been transmitted
+   */
+  bool done()
+  {
+    while (!m_serial.busy()) {
+      // Whatever was being transmitted has gone out
+      release(std::exchange(m_copy_in_flight, 0));
+      if (m_count == 0) {
+        return true;
+      }
+      auto next = m_writes[m_first];
+      m_first = (m_first + 1) % m_writes.size();
+      m_count--;
+      if (next.copy) {
+        m_copy_in_flight = next.data.size();
+      }
+      m_bytes_written += next.data.size();
+      m_serial.write(next.data);
+    }
+    return false;
+  }
+
+  /// @return true if there are writes that have not been started yet
+  bool queued() const { return m_count > 0; }
+
+  /// @return size_t total bytes handed to the serial port, wrapping around
+  size_t bytes_written() const { return m_bytes_written; }
+
+  /// Drop every write that has not been started yet
+  void clear()
+  {
+    m_first = 0;
+    m_count = 0;
+    m_copies_begin = 0;
+    m_copies_used = 0;
+    m_copy_in_flight = 0;
+  }
+
+private:
+  struct queued_write
+  {
+    std::span<const std::byte> data;
+    /// data lives in the copy buffer
+    bool copy = false;
+  };
+
+  /// @return true if p_data continues the last queued write in memory
+  bool continues_last(std::span<const std::byte> p_data, bool p_copy) const
+  {
+    if (m_count == 0) {
+      return false;
+    }
+    const auto& last = m_writes[(m_first + m_count - 1) % m_writes.size()];
+    return last.copy == p_copy &&
+           last.data.data() + last.data.size() == p_data.data();
+  }
+
+  void push(std::span<const std::byte> p_data, bool p_copy)
+  {
+    if (p_data.empty()) {
+      return;
+    }
+    if (continues_last(p_data, p_copy)) {
+      // Writes that continue each other in memory, such as copies made one
+      // after the other, become a single write to the serial port
+      auto& last = m_writes[(m_first + m_count - 1) % m_writes.size()];
+      last.data =
+        std::span{ last.data.data(), last.data.size() + p_data.size() };
+      done();
+      return;
+    }
+    m_writes[(m_first + m_count) % m_writes.size()] = { p_data, p_copy };
+    m_count++;
+    done();
+  }
+
+  void release(size_t p_copied_bytes)
+  {
+    m_copies_begin = (m_copies_begin + p_copied_bytes) % m_copies.size();
+    m_copies_used -= p_copied_bytes;
+  }
+
+  embed::serial& m_serial;
+  std::array<queued_write, maximum_writes> m_writes;
+  std::array<std::byte, copy_capacity> m_copies;
+  size_t m_first = 0;
+  size_t m_count = 0;
+  size_t m_copies_begin = 0;
+  size_t m_copies_used = 0;
+  size_t m_copy_in_flight = 0;
+  size_t m_bytes_written = 0;
+};
+
+class read_into_buffer
+{
+public:
+  read_into_buffer(serial_reader& p_reader)
+    : m_reader{ p_reader }
     , m_memory{}
   {}
 
@@ -27,78 +368,287 @@ public:
 
   bool done()
   {
-    if (m_read_index == m_memory.size()) {
-      return true;
-    } else {
-      m_read_index += m_serial.read(m_memory.subspan(m_read_index)).size();
+    while (m_read_index < m_memory.size() && m_reader.bytes_available() > 0U) {
+      m_read_index += m_reader.read(m_memory.subspan(m_read_index)).size();
     }
 
-    return false;
+    return m_read_index == m_memory.size();
   }
 
 private:
-  embed::serial& m_serial;
+  serial_reader& m_reader;
   std::span<std::byte> m_memory;
-  int m_read_index = 0;
+  size_t m_read_index = 0;
 };
 
+/**
+ * @brief Destination for the body of an http response. Each piece of the body
+ * is passed to write() as soon as it has been received, so the body never has
+ * to fit in memory all at once.
+ *
+ */
+class body_sink
+{
+public:
+  /**
+   * @brief Consume the next piece of the response body
+   *
+   * @param p_data bytes of the body, only valid for the duration of the call
+   */
+  virtual void write(std::span<const std::byte> p_data) = 0;
+  virtual ~body_sink() = default;
+};
+
+/**
+ * @brief Monotonic time source used by the esp8266 driver to wait out the
+ * guard times required by the AT firmware and to enforce timeouts.
+ *
+ */
+class uptime_clock
+{
+public:
+  /**
+   * @return std::chrono::milliseconds time since an arbitrary fixed point, must
+   * never go backwards
+   */
+  virtual std::chrono::milliseconds uptime() = 0;
+  virtual ~uptime_clock() = default;
+};
+
+/**
+ * @brief Incrementally matches a byte sequence using a precomputed failure
+ * table (Knuth-Morris-Pratt), so a mismatching byte can still be the start of
+ * the next match.
+ *
+ */
+class sequence_matcher
+{
+public:
+  /// Longest sequence that can be matched
+  static constexpr size_t maximum_sequence_length = 32;
+
+  sequence_matcher()
+    : m_sequence{}
+    , m_failure{}
+  {}
+
+  /// @return true if p_sequence is short enough to be matched
+  static constexpr bool fits(std::string_view p_sequence)
+  {
+    return p_sequence.size() <= maximum_sequence_length;
+  }
+
+  /**
+   * @param p_sequence sequence to match from now on, empty to match nothing
+   * @return false if p_sequence is longer than maximum_sequence_length. It is
+   * not matched then, rather than a part of it, and the matcher is empty.
+   */
+  bool new_sequence(std::span<const std::byte> p_sequence)
+  {
+    m_index = 0;
+    if (p_sequence.size() > maximum_sequence_length) {
+      m_sequence = {};
+      return false;
+    }
+    m_sequence = p_sequence;
+
+    // m_failure[i] holds the length of the longest proper prefix of
+    // m_sequence[0..i] that is also a suffix of it.
+    size_t prefix_length = 0;
+    for (size_t i = 1; i < m_sequence.size(); i++) {
+      while (prefix_length > 0 && m_sequence[i] != m_sequence[prefix_length]) {
+        prefix_length = m_failure[prefix_length - 1];
+      }
+      if (m_sequence[i] == m_sequence[prefix_length]) {
+        prefix_length++;
+      }
+      m_failure[i] = static_cast<uint8_t>(prefix_length);
+    }
+    return true;
+  }
+
+  /// Forget any partial match
+  void reset() { m_index = 0; }
+
+  /// @return true if there is no sequence to match
+  bool empty() const { return m_sequence.empty(); }
+
+  /// @return true if the whole sequence has been matched
+  bool matched() const { return !empty() && m_index == m_sequence.size(); }
+
+  /**
+   * @brief Advance the match by one received byte
+   *
+   * @param p_byte the next received byte
+   * @return true if p_byte completed the sequence
+   */
+  bool feed(std::byte p_byte)
+  {
+    if (empty()) {
+      return false;
+    }
+    if (m_index == m_sequence.size()) {
+      m_index = m_failure[m_index - 1];
+    }
+    while (m_index > 0 && p_byte != m_sequence[m_index]) {
+      m_index = m_failure[m_index - 1];
+    }
+    if (p_byte == m_sequence[m_index]) {
+      m_index++;
+    }
+    return m_index == m_sequence.size();
+  }
+
+private:
+  size_t m_index = 0;
+  std::span<const std::byte> m_sequence;
+  std::array<uint8_t, maximum_sequence_length> m_failure;
+};
+
+/**
+ * @brief Sends a command and then scans the received bytes for a sequence.
+ * Bytes received after the sequence are handed back to the serial_reader for
+ * the next reader.
+ *
+ * "Interrupt" sequences can be watched for at the same time, each in its own
+ * slot. When one appears, done() returns true with interrupt() set to its slot
+ * and the bytes after it are handed back, so the caller can deal with them and
+ * then resume the search by calling done() again.
+ *
+ * A search can also be given a limit on the number of bytes to scan, after
+ * which done() returns true with exhausted() set.
+ *
+ */
 class command_and_find_response
 {
 public:
-  command_and_find_response(embed::serial& p_serial)
-    : m_serial(p_serial)
-    , m_command{}
-    , m_sequence{}
+  /// Number of interrupt slots, enough for +IPD, ERROR, a close notice per
+  /// link, WIFI DISCONNECT and busy p...
+  static constexpr size_t maximum_interrupts = 9;
+  /// Value of interrupt() when the search was not interrupted
+  static constexpr size_t no_interrupt = maximum_interrupts;
+
+  command_and_find_response(transmit_queue& p_transmitter,
+                            serial_reader& p_reader)
+    : m_transmitter(p_transmitter)
+    , m_reader(p_reader)
   {}
 
+  /**
+   * @param p_command bytes to send before searching, must stay valid until
+   * they have been transmitted
+   * @param p_sequence sequence to search for. If empty, only an interrupt
+   * sequence can end the search.
+   * @param p_byte_limit give up after scanning this many bytes
+   */
   void new_search(std::span<const std::byte> p_command,
-                  std::span<const std::byte> p_sequence)
+                  std::span<const std::byte> p_sequence,
+                  size_t p_byte_limit = std::numeric_limits<size_t>::max())
   {
-    m_search_index = 0;
-    m_sent_command = false;
-    m_command = p_command;
-    m_sequence = p_sequence;
+    m_interrupt = no_interrupt;
+    m_byte_limit = p_byte_limit;
+    m_bytes_scanned = 0;
+    m_transmitter.write(p_command);
+    m_match.new_sequence(p_sequence);
+    reset_interrupts();
   }
 
-  bool done()
+  /**
+   * @param p_slot slot to watch p_interrupt in, less than maximum_interrupts
+   * @param p_interrupt sequence that interrupts the search, empty to disable
+   * the slot
+   */
+  void watch_for(size_t p_slot, std::span<const std::byte> p_interrupt)
   {
-    std::array<std::byte, 1> buffer;
+    m_interrupts[p_slot].new_sequence(p_interrupt);
+    if (!p_interrupt.empty()) {
+      m_slots_in_use = std::max(m_slots_in_use, p_slot + 1);
+    }
+  }
 
-    if (m_search_index == m_sequence.size()) {
-      return true;
+  /// Stop watching for every interrupt sequence
+  void stop_watching()
+  {
+    for (auto& interrupt : m_interrupts) {
+      interrupt.new_sequence(std::span<const std::byte>{});
     }
+    m_slots_in_use = 0;
+  }
 
-    if (!m_sent_command) {
-      m_serial.write(m_command);
-      while (m_serial.busy()) {
-        continue;
-      }
-      m_sent_command = true;
+  bool done()
+  {
+    m_interrupt = no_interrupt;
+
+    if (m_match.matched() || exhausted()) {
+      return true;
     }
 
-    if (m_serial.bytes_available() >= 1U) {
-      auto received_byte = m_serial.read(buffer);
-      if (m_sequence[m_search_index++] != received_byte[0]) {
-        m_search_index = 0;
+    for (auto chunk = m_reader.fetch(); !chunk.empty();
+         chunk = m_reader.fetch()) {
+      for (size_t i = 0; i < chunk.size(); i++) {
+        if (++m_bytes_scanned > m_byte_limit) {
+          m_reader.unread(chunk.subspan(i));
+          return true;
+        }
+        for (size_t slot = 0; slot < m_slots_in_use; slot++) {
+          if (m_interrupts[slot].feed(chunk[i])) {
+            m_interrupt = slot;
+          }
+        }
+        if (m_interrupt != no_interrupt) {
+          reset_interrupts();
+          m_reader.unread(chunk.subspan(i + 1));
+          return true;
+        }
+        if (m_match.feed(chunk[i])) {
+          m_reader.unread(chunk.subspan(i + 1));
+          return true;
+        }
       }
     }
 
     return false;
   }
 
+  /// @return true if the last call to done() stopped on an interrupt sequence
+  bool interrupted() const { return m_interrupt != no_interrupt; }
+
+  /// @return size_t slot of the interrupt sequence that stopped the last call
+  /// to done(), no_interrupt if it was not interrupted
+  size_t interrupt() const { return m_interrupt; }
+
+  /// @return true if the byte limit was reached without finding the sequence
+  bool exhausted() const { return m_bytes_scanned > m_byte_limit; }
+
+  /// @return size_t times the matchers were reset, by a new search or after
+  /// an interrupt, wrapping around
+  size_t resets() const { return m_resets; }
+
 private:
-  size_t m_search_index = 0;
-  bool m_sent_command = false;
-  embed::serial& m_serial;
-  std::span<const std::byte> m_command;
-  std::span<const std::byte> m_sequence;
+  void reset_interrupts()
+  {
+    for (auto& interrupt : m_interrupts) {
+      interrupt.reset();
+    }
+    m_resets++;
+  }
+
+  size_t m_interrupt = no_interrupt;
+  size_t m_resets = 0;
+  size_t m_slots_in_use = 0;
+  size_t m_byte_limit = std::numeric_limits<size_t>::max();
+  size_t m_bytes_scanned = 0;
+  transmit_queue& m_transmitter;
+  serial_reader& m_reader;
+  sequence_matcher m_match;
+  std::array<sequence_matcher, maximum_interrupts> m_interrupts;
 };
 
 class read_integer
 {
 public:
-  read_integer(embed::serial& p_serial)
-    : m_serial(p_serial)
+  read_integer(serial_reader& p_reader)
+    : m_reader(p_reader)
   {}
 
   void restart()
@@ -110,24 +660,26 @@ public:
 
   bool done()
   {
-    std::array<std::byte, 1> buffer;
-
     if (m_finished) {
       return true;
     }
 
-    if (m_serial.bytes_available() >= 1U) {
-      auto received_byte = m_serial.read(buffer);
-      if (isdigit(std::to_integer<char>(received_byte[0]))) {
-        m_integer *= 10;
-        m_integer += std::to_integer<int>(received_byte[0]) - '0';
-        m_found_digit = true;
-      } else if (m_found_digit) {
-        m_finished = true;
+    for (auto chunk = m_reader.fetch(); !chunk.empty();
+         chunk = m_reader.fetch()) {
+      for (size_t i = 0; i < chunk.size(); i++) {
+        if (isdigit(std::to_integer<char>(chunk[i]))) {
+          m_integer *= 10;
+          m_integer += std::to_integer<int>(chunk[i]) - '0';
+          m_found_digit = true;
+        } else if (m_found_digit) {
+          m_finished = true;
+          m_reader.unread(chunk.subspan(i + 1));
+          return true;
+        }
       }
     }
 
-    return m_finished;
+    return false;
   }
 
   auto get() { return m_integer; }
@@ -136,61 +688,225 @@ private:
   bool m_finished = true;
   bool m_found_digit = false;
   uint32_t m_integer = 0;
-  embed::serial& m_serial;
+  serial_reader& m_reader;
 };
 
-std::string_view to_string_view(std::span<std::byte> byte_sequence)
+inline std::string_view to_string_view(std::span<std::byte> byte_sequence)
 {
   return std::string_view{ reinterpret_cast<const char*>(byte_sequence.data()),
                            reinterpret_cast<const char*>(
                              byte_sequence.data() + byte_sequence.size()) };
 }
 
-auto to_bytes(std::string_view byte_sequence)
+inline auto to_bytes(std::string_view byte_sequence)
 {
   return std::as_bytes(std::span{ byte_sequence });
 }
 
 /**
- * @brief esp8266 AT command driver for connecting to WiFi Access points and
- * connecting to web servers.
+ * @brief Formats text and decimal integers into a caller provided buffer
+ * without allocating memory. Text does not need to be null terminated. Once
+ * something does not fit, it and everything appended after it is dropped and
+ * overflowed() returns true.
  *
  */
-class esp8266 : public embed::driver<>
+class buffer_writer
 {
 public:
-  /// Default baud rate for the esp8266 AT commands
-  static constexpr uint32_t default_baud_rate = 115200;
-  /// Confirmation response
-  static constexpr char ok_response[] = "OK\r\n";
-  /// Confirmation response after a wifi successfully connected
-  static constexpr char wifi_connected[] = "WIFI GOT IP\r\n\r\nOK\r\n";
-  /// Confirmation response after a reset complets
-  static constexpr char reset_complete[] = "ready\r\n";
-  /// End of header
-  static constexpr std::string_view end_of_header = "\r\n\r\n";
-  /// The maximum packet size for esp8266 AT commands
-  static constexpr size_t maximum_response_packet_size = 1460;
-  static constexpr size_t maximum_transmit_packet_size = 2048;
+  constexpr explicit buffer_writer(std::span<std::byte> p_buffer)
+    : m_buffer{ p_buffer }
+  {}
 
-  /// The type of password security used for the access point.
-  enum class access_point_security
+  constexpr buffer_writer& append(std::string_view p_text)
   {
-    open,
-    wep,
-    wpa_psk,
-    wpa2_psk,
-    wpa_wpa2_psk,
-  };
+    if (m_overflowed || p_text.size() > m_buffer.size() - m_length) {
+      m_overflowed = true;
+      return *this;
+    }
+    for (char character : p_text) {
+      m_buffer[m_length++] = static_cast<std::byte>(character);
+    }
+    return *this;
+  }
 
-  enum class http_method
+  template<std::integral Integer>
+  buffer_writer& append(Integer p_integer)
   {
-    /// The GET method requests a representation of the specified resource.
-    /// Requests using GET should only retrieve data.
-    GET,
-    /// The HEAD method asks for a response identical to a GET request, but
-    /// without the response body.
-    HEAD,
+    std::array<char, std::numeric_limits<Integer>::digits10 + 2> digits;
+    auto result = std::to_chars(digits.begin(), digits.end(), p_integer);
+    return append(std::string_view(digits.begin(), result.ptr));
+  }
+
+  /// @return std::span<std::byte> the part of the buffer written so far
+  constexpr std::span<std::byte> written() const
+  {
+    return m_buffer.first(m_length);
+  }
+
+  /// @return size_t the number of bytes written so far
+  constexpr size_t size() const { return m_length; }
+
+  /// @return true if something did not fit in the buffer
+  constexpr bool overflowed() const { return m_overflowed; }
+
+private:
+  std::span<std::byte> m_buffer;
+  size_t m_length = 0;
+  bool m_overflowed = false;
+};
+
+/**
+ * @brief String literal usable as a template parameter
+ *
+ * @tparam Length size of the literal including its null terminator
+ */
+template<size_t Length>
+struct fixed_string
+{
+  constexpr fixed_string(const char (&p_text)[Length])
+  {
+    std::copy_n(p_text, Length, text.begin());
+  }
+
+  constexpr size_t size() const { return Length - 1; }
+  constexpr bool empty() const { return size() == 0; }
+  constexpr std::string_view view() const
+  {
+    return std::string_view(text.data(), size());
+  }
+
+  std::array<char, Length> text{};
+};
+
+/**
+ * @brief An AT command put together from its parts at compile time, so it can
+ * be sent with a single write and needs no formatting at runtime.
+ *
+ * @tparam Parts pieces of the command, concatenated in order
+ */
+template<fixed_string... Parts>
+struct at_command
+{
+  static constexpr size_t size = (Parts.size() + ... + 0);
+  static constexpr std::array<char, size> text = [] {
+    std::array<char, size> command{};
+    auto end = command.begin();
+    ((end = std::copy_n(Parts.text.begin(), Parts.size(), end)), ...);
+    return command;
+  }();
+
+  static constexpr std::string_view view()
+  {
+    return std::string_view(text.data(), text.size());
+  }
+};
+
+/**
+ * @brief esp8266 AT command driver for connecting to WiFi Access points and
+ * connecting to web servers.
+ *
+ */
+class esp8266 : public embed::driver<>
+{
+public:
+  /// Default baud rate for the esp8266 AT commands
+  static constexpr uint32_t default_baud_rate = 115200;
+  /// Confirmation response
+  static constexpr char ok_response[] = "OK\r\n";
+  /// Response to a command that could not be carried out
+  static constexpr char error_response[] = "ERROR\r\n";
+  /// Bytes of response to the baud rate probe before it is considered garbled
+  static constexpr size_t baud_rate_probe_limit = 32;
+  /// End of the response to AT+CWJAP_CUR when the access point was not joined
+  static constexpr char join_failed[] = "FAIL\r\n";
+  /// Confirmation response after a wifi successfully connected
+  static constexpr char wifi_connected[] = "WIFI GOT IP\r\n\r\nOK\r\n";
+  /// Confirmation response after a reset complets
+  static constexpr char reset_complete[] = "ready\r\n";
+  /// End of header
+  static constexpr std::string_view end_of_header = "\r\n\r\n";
+  /// The maximum packet size for esp8266 AT commands
+  static constexpr size_t maximum_response_packet_size = 1460;
+  static constexpr size_t maximum_transmit_packet_size = 2048;
+  /// Prompt for the data to send after AT+CIPSEND
+  static constexpr char send_prompt[] = ">";
+  /// Confirmation that data given to AT+CIPSEND was sent
+  static constexpr char send_ok[] = "SEND OK\r\n";
+  /// Start of the station status in the response to AT+CIPSTATUS
+  static constexpr char station_status_prefix[] = "STATUS:";
+  /// Start of the address in the response to AT+CIPDOMAIN
+  static constexpr char domain_address_prefix[] = "+CIPDOMAIN:";
+  /// Start of a frame of data received from a server
+  static constexpr char ipd_prefix[] = "+IPD,";
+  /// Sent when the connection closes
+  static constexpr char closed_notice[] = "CLOSED\r\n";
+  /// Start of each access point listed by AT+CWLAP
+  static constexpr char scan_entry_prefix[] = "+CWLAP:";
+  /// Start of the answer to AT+CWJAP_CUR? while joined to an access point
+  static constexpr char join_status_prefix[] = "+CWJAP_CUR:";
+  /// Sent when the access point connection drops
+  static constexpr char disconnect_notice[] = "WIFI DISCONNECT\r\n";
+  /// Sent instead of a response when a command arrives while the esp8266 is
+  /// still processing the one before it, the command is dropped
+  static constexpr char busy_notice[] = "busy p...";
+  /// Wait before resending a command the esp8266 was too busy for
+  static constexpr std::chrono::milliseconds busy_retry_delay{ 100 };
+  /// Wait for the answer to each AT probe sent to wake the esp8266
+  static constexpr std::chrono::milliseconds wake_probe_interval{ 50 };
+  /// AT probes sent to wake the esp8266 before it is initialized again
+  static constexpr uint8_t wake_probe_limit = 20;
+  /// Longest "domain:port" remembered for reusing a kept alive connection
+  static constexpr size_t maximum_host_length = 64;
+  /// Maximum number of simultaneous connections with AT+CIPMUX=1
+  static constexpr size_t maximum_links = 5;
+  /// Sent when the connection of a link closes while multiplexing
+  static constexpr std::array<std::string_view, maximum_links>
+    link_closed_notices{
+      "0,CLOSED\r\n", "1,CLOSED\r\n", "2,CLOSED\r\n",
+      "3,CLOSED\r\n", "4,CLOSED\r\n",
+    };
+  static_assert(std::ranges::all_of(std::array<std::string_view, 13>{
+                                      ok_response,
+                                      error_response,
+                                      join_failed,
+                                      send_prompt,
+                                      send_ok,
+                                      station_status_prefix,
+                                      domain_address_prefix,
+                                      ipd_prefix,
+                                      closed_notice,
+                                      scan_entry_prefix,
+                                      join_status_prefix,
+                                      disconnect_notice,
+                                      busy_notice,
+                                    },
+                                    sequence_matcher::fits) &&
+                  std::ranges::all_of(link_closed_notices,
+                                      sequence_matcher::fits),
+                "Every sequence searched for must fit in a sequence_matcher");
+  /// Time to wait after "+++" before the esp8266 accepts AT commands again
+  static constexpr std::chrono::milliseconds passthrough_guard_time{ 1000 };
+  /// Most steps get_status() takes before returning to the caller
+  static constexpr size_t maximum_steps_per_status = 32;
+
+  /// The type of password security used for the access point.
+  enum class access_point_security
+  {
+    open,
+    wep,
+    wpa_psk,
+    wpa2_psk,
+    wpa_wpa2_psk,
+  };
+
+  enum class http_method
+  {
+    /// The GET method requests a representation of the specified resource.
+    /// Requests using GET should only retrieve data.
+    GET,
+    /// The HEAD method asks for a response identical to a GET request, but
+    /// without the response body.
+    HEAD,
     /// The POST method submits an entity to the specified resource, often
     /// causing a change in state or side effects on the server.
     POST,
@@ -240,6 +956,11 @@ public:
      * ignored if the method choosen is HEAD or GET. Set this to an empty span
      * if there is no data to be sent.
      *
+     * The data is sent straight from this span, after the header, in as many
+     * AT+CIPSEND segments as needed, so it can be larger than
+     * `maximum_transmit_packet_size`. It must stay valid until the request
+     * has reached `receiving_header`.
+     *
      */
     std::span<const std::byte> send_data = {};
     /**
@@ -247,420 +968,3207 @@ public:
      *
      */
     std::string_view port = "80";
+    /**
+     * @brief keep the connection to the server open after the response has
+     * been received. A following request to the same domain and port will
+     * reuse the connection and skip connecting to the server. The connection
+     * is closed once a request is made to a different server, a request is
+     * aborted or the server responds with "Connection: close".
+     *
+     */
+    bool keep_alive = false;
+    /**
+     * @brief use transparent transmission (AT+CIPMODE=1) for this request. The
+     * response is read as raw bytes rather than in +IPD frames, which is
+     * faster for large transfers. Afterwards the driver leaves transparent
+     * transmission with "+++", which takes `passthrough_guard_time`. Only used
+     * when not multiplexing and once a clock has been given with set_clock().
+     * The response must give a Content-Length or be chunked, as the end of a
+     * body that runs until the connection closes cannot be seen in this mode.
+     *
+     */
+    bool passthrough = false;
+    /**
+     * @brief connect with TLS (AT+CIPSTART="SSL") for an https server, usually
+     * on port "443". The handshake takes around a second, so use keep_alive to
+     * have following requests reuse the secure connection. The esp8266 only
+     * holds one TLS connection at a time, also when multiplexing.
+     *
+     */
+    bool secure = false;
+    /**
+     * @brief ask for a compressed body with "Accept-Encoding: gzip, deflate".
+     * A gzip or deflate body is inflated before it reaches the response or
+     * the body sink, by the inflater given to set_inflater() for the link.
+     * Ignored on links without one.
+     *
+     */
+    bool compressed = false;
+    /**
+     * @brief validators of the copy of the resource already held, sent as
+     * If-None-Match and If-Modified-Since so that an unchanged resource is
+     * answered with "304 Not Modified" and no body. Taken from the response
+     * cache given to set_response_cache() when both are empty.
+     *
+     */
+    std::string_view if_none_match = {};
+    std::string_view if_modified_since = {};
   };
 
-  struct header_t
+  /**
+   * @brief Remote end of a UDP link
+   *
+   */
+  struct datagram_link_t
   {
-    uint32_t status_code = 0;
-    size_t content_length = 0;
-    size_t header_length = 0;
-    bool is_valid()
-    {
-      return status_code != 0 && content_length != 0 && header_length != 0;
-    }
+    /// Domain or IPv4 address to send datagrams to
+    std::string_view domain;
+    /// Port to send datagrams to
+    std::string_view port;
+    /// Port to receive datagrams on, chosen by the esp8266 if empty
+    std::string_view local_port = {};
+  };
+
+  /**
+   * @brief Limits on how long each phase may take before it is given up on.
+   * Only enforced once a clock has been given with set_clock(). A limit of
+   * zero disables it.
+   *
+   */
+  struct timeouts_t
+  {
+    /// Response to a configuration or AT+CIPCLOSE command
+    std::chrono::milliseconds command{ 2000 };
+    /// Joining the access point with AT+CWJAP_CUR
+    std::chrono::milliseconds join{ 20000 };
+    /// Looking up and connecting to the server with AT+CIPSTART
+    std::chrono::milliseconds connect{ 10000 };
+    /// The ">" prompt and "SEND OK" of each segment of the request
+    std::chrono::milliseconds send{ 5000 };
+    /// From sending the request until the first byte of the response
+    std::chrono::milliseconds first_byte{ 10000 };
+    /// Longest gap between pieces of the response after the first byte
+    std::chrono::milliseconds body{ 5000 };
+    /// A kept alive connection idle for longer than this is not reused, as
+    /// the server has likely closed it
+    std::chrono::milliseconds keep_alive_idle{ 30000 };
+    /// Times joining the access point or connecting to a server is retried
+    uint8_t retries = 3;
+    /// Wait before the first retry, doubled for each retry after it
+    std::chrono::milliseconds backoff{ 500 };
+  };
+
+  /**
+   * @brief How the access point is joined
+   *
+   */
+  struct join_options_t
+  {
+    /// MAC address of the access point, such as "aa:bb:cc:dd:ee:ff", to join
+    /// that access point directly. Empty to join any with the ssid.
+    std::string_view bssid = {};
+    /// Check with AT+CIPSTATUS whether the esp8266 still has a connection and
+    /// an IP address, such as when only the microcontroller slept, and skip
+    /// joining the access point if it does
+    bool reuse_connection = false;
+    /// Join with AT+CWJAP_DEF, so the esp8266 stores the access point in its
+    /// flash and rejoins it by itself after it resets or wakes up
+    bool persist = false;
   };
 
+  /// When to move to a stronger access point, see set_roaming()
+  using roaming_options_t = access_point_list::roaming_options;
+
+  using header_t = http_header;
+
   enum class state
   {
     // Phase 1: Connecting to Wifi access point
     reset,
+    changing_baud_rate,
+    probing_baud_rate,
+    restoring_baud_rate,
     disable_echo,
     configure_as_http_client,
+    configure_multiplexing,
+    configure_dns,
+    configure_ssl,
+    checking_ap_connection,
     attempting_ap_connection,
+    // Commands issued between requests, entered from connected_to_ap
+    entering_sleep,
+    waking_up,
+    leaving_sleep,
+    checking_signal,
+    scanning_access_points,
+    choosing_access_point,
     connected_to_ap,
     // Phase 2: HTTP request
+    closing_previous_connection,
+    resolving_domain,
     connecting_to_server,
     preparing_request,
+    preparing_segment,
+    entering_passthrough,
     sending_request,
-    get_first_packet_length,
-    reading_first_packet,
-    parsing_header,
-    get_packet_length,
-    read_packet_into_response,
-    get_next_packet,
+    receiving_header,
+    receiving_body,
+    exiting_passthrough,
+    leaving_passthrough,
     close_connection,
     close_connection_failure,
     complete,
     failure,
+    timeout,
   };
 
   enum class read_state
   {
     until_sequence,
-    into_buffer,
-    integer,
+    raw_response,
+    delay,
+    address,
+    station_status,
+    access_point,
+    frame_link_id,
+    frame_length,
+    frame_payload,
+    datagram_payload,
     complete,
   };
 
+  /**
+   * @brief A connection (link ID) to a server along with the request being
+   * made over it and the response being received from it. When multiplexing,
+   * each link is an independent connection with its own response buffer.
+   *
+   */
+  class link_t
+  {
+  public:
+    /**
+     * @param p_response_span buffer used to build requests and to hold the
+     * body of responses for this link
+     */
+    link_t(std::span<std::byte> p_response_span = {})
+      : m_response{ p_response_span }
+      , m_connected_host{}
+    {}
+
+    /// @return state the progress of the request on this link
+    state status() const { return m_state; }
+
+    /**
+     * @return std::span<const std::byte> body of the response received so far,
+     * empty if the body was streamed to a body_sink.
+     */
+    std::span<const std::byte> response() const
+    {
+      if (m_sink != nullptr) {
+        return {};
+      }
+      return std::span<const std::byte>(m_response)
+        .first(std::min(m_response_position, m_response.size()));
+    }
+
+    /// @return header_t header of the last response received on this link
+    header_t header() const { return m_parser.header(); }
+
+  private:
+    friend class esp8266;
+
+    std::span<std::byte> m_response;
+    request_t m_request;
+    body_sink* m_sink = nullptr;
+    http_response_parser m_parser;
+    size_t m_response_position = 0;
+    /// Decodes compressed bodies, null if they are kept as received
+    inflater* m_inflater = nullptr;
+    /// Cached response that a 304 is answered with
+    response_cache::entry* m_cached = nullptr;
+    /// Cache entry the body of the response is stored in
+    response_cache::entry* m_cache_fill = nullptr;
+    std::array<char, maximum_host_length> m_connected_host;
+    size_t m_connected_host_length = 0;
+    /// The open connection is a TLS connection
+    bool m_connected_secure = false;
+    bool m_connection_open = false;
+    /// The body of the response is being passed through m_inflater
+    bool m_inflating = false;
+    bool m_finish_reported = true;
+    /// The request is the one at the front of the request queue
+    bool m_queued = false;
+    /// Responses expected after this one, for requests sent along with it
+    uint8_t m_pipelined = 0;
+    /// Where datagrams received on a UDP link go, null for http links
+    datagram_ring* m_datagrams = nullptr;
+    /// Port a UDP link receives on, chosen by the esp8266 if empty
+    std::string_view m_local_port;
+    /// Connection attempts that have failed for the current request
+    uint8_t m_attempts = 0;
+    /// When the next connection attempt may be made
+    std::chrono::milliseconds m_retry_at{ 0 };
+    /// When the request was sent or response bytes were last received
+    std::chrono::milliseconds m_last_activity{ 0 };
+    state m_state = state::connected_to_ap;
+    /// Last state given to the instrumentation
+    state m_observed_state = state::connected_to_ap;
+  };
+
+  /**
+   * @brief Notified when a request finishes, so an application does not have
+   * to check the state of every link after each call to get_status().
+   *
+   */
+  class completion_handler
+  {
+  public:
+    /**
+     * @brief Called from get_status() once the request on p_link reaches
+     * `complete`, `failure` or `timeout`. A new request may be started from
+     * here.
+     *
+     * @param p_link link ID of the request, 0 when not multiplexing
+     * @param p_state `complete`, `failure` or `timeout`
+     */
+    virtual void finished(size_t p_link, state p_state) = 0;
+    virtual ~completion_handler() = default;
+  };
+
+  /// Messages the esp8266 sends on its own rather than in response to a
+  /// command
+  enum class event
+  {
+    /// WIFI DISCONNECT, the driver rejoins the access point and the requests
+    /// in progress fail
+    wifi_disconnected,
+    /// The connection of a link was closed, by the server or the esp8266
+    connection_closed,
+    /// busy p..., the command was dropped and is sent again
+    busy,
+    /// A scan of the access points in range finished, see set_roaming()
+    scan_complete,
+  };
+
+  /// Power saving of the esp8266 while no request is in progress, the values
+  /// are those of AT+SLEEP
+  enum class sleep_mode : uint8_t
+  {
+    /// Stay awake
+    none,
+    /// Suspend the CPU along with the radio, the esp8266 may miss the first
+    /// bytes sent while it wakes up
+    light,
+    /// Turn the radio off between beacons of the access point, connections
+    /// stay open and the esp8266 keeps answering on the serial port
+    modem,
+  };
+
+  /**
+   * @brief Notified of unsolicited messages from the esp8266 as soon as they
+   * are received, such as to react to a lost access point without waiting
+   * for a request to time out.
+   *
+   */
+  class event_handler
+  {
+  public:
+    /**
+     * @brief Called from get_status() after the driver has handled p_event
+     *
+     * @param p_event the message received
+     * @param p_link link ID for connection_closed, 0 otherwise
+     */
+    virtual void received(event p_event, size_t p_link) = 0;
+    virtual ~event_handler() = default;
+  };
+
+  /**
+   * @brief Fixed capacity ring of requests waiting to be made on link 0, one
+   * after another. Requests to the same server are sent together and their
+   * responses received one after another over the same connection.
+   *
+   */
+  class request_queue
+  {
+  public:
+    struct entry
+    {
+      request_t request;
+      body_sink* sink = nullptr;
+    };
+
+    /// @param p_entries storage for the queued requests
+    explicit request_queue(std::span<entry> p_entries)
+      : m_entries{ p_entries }
+    {}
+
+    /// @return false if the queue is full
+    bool push(const request_t& p_request, body_sink* p_sink)
+    {
+      if (full()) {
+        return false;
+      }
+      m_entries[(m_front + m_count) % m_entries.size()] = { p_request, p_sink };
+      m_count++;
+      return true;
+    }
+
+    /// Remove the request at the front
+    void pop()
+    {
+      if (!empty()) {
+        m_front = (m_front + 1) % m_entries.size();
+        m_count--;
+      }
+    }
+
+    /// @return the request p_index places from the front
+    const entry& operator[](size_t p_index) const
+    {
+      return m_entries[(m_front + p_index) % m_entries.size()];
+    }
+
+    size_t size() const { return m_count; }
+    bool empty() const { return m_count == 0; }
+    bool full() const { return m_count == m_entries.size(); }
+
+  private:
+    std::span<entry> m_entries;
+    size_t m_front = 0;
+    size_t m_count = 0;
+  };
+
+  /**
+   * @brief Observes the driver for telemetry, such as to find whether slow
+   * requests spend their time joining the access point, connecting to the
+   * server, waiting for the first byte or receiving the body. Without
+   * instrumentation the driver only keeps a few running counters.
+   *
+   */
+  class instrumentation
+  {
+  public:
+    /**
+     * @brief The driver entered a phase 1 state or a link entered a phase 2
+     * state. States passed through within one step share a time.
+     *
+     * @param p_link link ID for phase 2 states, 0 for phase 1 states
+     * @param p_state the state entered
+     * @param p_time uptime from the clock given to set_clock(), 0 without one
+     */
+    virtual void state_entered(size_t p_link,
+                               state p_state,
+                               std::chrono::milliseconds p_time) = 0;
+    /**
+     * @brief Bytes were read from or written to the serial port in one step
+     *
+     * @param p_state state the bytes were transferred in. The payload of a
+     * +IPD frame counts towards the state of the link receiving it.
+     * @param p_received bytes read from the serial port
+     * @param p_sent bytes handed to the serial port
+     */
+    virtual void bytes_transferred(state p_state,
+                                   size_t p_received,
+                                   size_t p_sent) = 0;
+    /**
+     * @brief Joining the access point or connecting to a server failed and is
+     * being retried
+     *
+     * @param p_link link ID when connecting to a server, 0 otherwise
+     * @param p_state `attempting_ap_connection` or `connecting_to_server`
+     * @param p_attempt number of the retry, starting at 1
+     */
+    virtual void retried(size_t p_link, state p_state, uint8_t p_attempt) = 0;
+    /**
+     * @brief The response matchers of command_and_find_response were reset,
+     * once for each command issued and each +IPD frame or notice received
+     *
+     * @param p_state state the resets happened in
+     * @param p_count number of resets in one step
+     */
+    virtual void matchers_reset(state p_state, size_t p_count) = 0;
+    /**
+     * @brief The esp8266 answered the AT probes sent to wake it from the sleep
+     * mode given to set_sleep_mode(), before a command was issued for a link
+     *
+     * @param p_latency time from the first probe until the esp8266 answered,
+     * 0 without a clock
+     * @param p_probes number of probes sent
+     */
+    virtual void woke(std::chrono::milliseconds p_latency,
+                      uint8_t p_probes) = 0;
+    virtual ~instrumentation() = default;
+  };
+
   static std::string_view to_string(http_method p_method);
 
+  /**
+   * @brief Serialize the http request (request line and header) that the
+   * driver sends for p_request.
+   *
+   * @param p_request the request to serialize
+   * @param p_buffer buffer to write the request into
+   * @return std::span<std::byte> the portion of p_buffer that holds the
+   * request, empty if it did not fit.
+   */
+  static std::span<std::byte> serialize_request(const request_t& p_request,
+                                                std::span<std::byte> p_buffer);
+
   /**
    * @param p_serial the serial port connected to the esp8266
-   * @param p_baud_rate the operating baud rate for the esp8266
+   * @param p_ssid name of the access point
+   * @param p_password the password for the access point
+   * @param p_response_span buffer used to build requests and to hold the body
+   * of responses
+   * @param p_baud_rate the operating baud rate for the esp8266. The driver
+   * starts at default_baud_rate and switches to this rate with AT+UART_CUR,
+   * falling back to default_baud_rate if the esp8266 rejects it or does not
+   * respond properly at the new rate.
    *
    */
   esp8266(embed::serial& p_serial,
           std::string_view p_ssid,
           std::string_view p_password,
-          std::span<std::byte> p_response_span)
-    : m_serial{ p_serial }
-    , m_response{ p_response_span }
-    , m_ssid{ p_ssid }
-    , m_password{ p_password }
-    , m_commander{ m_serial }
-    , m_integer_reader{ m_serial }
-    , m_reader{ m_serial }
-    , m_packet{}
-  {}
+          std::span<std::byte> p_response_span,
+          uint32_t p_baud_rate = default_baud_rate)
+    : esp8266(p_serial, p_ssid, p_password, p_baud_rate)
+  {
+    m_single_link = link_t(p_response_span);
+    m_links = std::span{ &m_single_link, 1 };
+  }
 
-  bool driver_initialize() override;
   /**
-   * @brief Change the access point to connect to. Running get_status() after
-   * calling this will disconnect from the previous access point and attempt to
-   * connect to the new one.
+   * @brief Construct a multiplexed driver (AT+CIPMUX=1) where each link is a
+   * separate connection, allowing requests to several servers to be in flight
+   * at the same time. The index of a link within p_links is its link ID.
    *
+   * @param p_serial the serial port connected to the esp8266
    * @param p_ssid name of the access point
    * @param p_password the password for the access point
+   * @param p_links the links to use, only the first `maximum_links` are used.
+   * Must outlive the driver.
+   * @param p_baud_rate the operating baud rate for the esp8266
    */
-  void change_access_point(std::string_view p_ssid,
-                           std::string_view p_password);
+  esp8266(embed::serial& p_serial,
+          std::string_view p_ssid,
+          std::string_view p_password,
+          std::span<link_t> p_links,
+          uint32_t p_baud_rate = default_baud_rate)
+    : esp8266(p_serial, p_ssid, p_password, p_baud_rate)
+  {
+    m_links = p_links.first(std::min(p_links.size(), maximum_links));
+    m_multiplexed = true;
+  }
+
+  bool driver_initialize() override;
   /**
-   * @brief checks the connection state to an access point.
+   * @brief Give the driver a time source. Requests can only use transparent
+   * transmission, and timeouts and retry backoff are only applied, once a
+   * clock has been given.
    *
-   * @return true is connected to access point
-   * @return false is NOT connected access point
+   * @param p_clock monotonic time source, must outlive the driver
    */
-  bool connected();
+  void set_clock(uptime_clock& p_clock) { m_clock = &p_clock; }
   /**
-   * @brief Starts a http request. This function will issue a command to connect
-   * with a server and will return immediately. This function will also abort
-   * any ongoing requests if they are in progress. This function is non-blocking
-   * and as such, to progress the request further the `progress()` function must
-   * be called, until it returns "complete" or an error condition has occurred.
-   *
-   * @note Only currently support GET requests
+   * @brief Change the limits on how long each phase may take. A request that
+   * runs out of time ends in `timeout`. Joining the access point and
+   * connecting to a server are retried `retries` times first, after which the
+   * driver re-initializes the esp8266 or the request ends in `timeout`.
    *
-   * @param true if the request is valid and can be transmitted
-   * @param false if the request is invalid and cannot be transmitted. This
-   * typically occurs if the packet size if greater than 2048 bytes.
+   * @param p_timeouts the new limits
    */
-  void request(request_t p_request);
+  void set_timeouts(const timeouts_t& p_timeouts) { m_timeouts = p_timeouts; }
   /**
-   * @brief After issuing a request, this function must be called in order to
-   * progress the http request. This function manages, connecting to the server,
-   * sending the request to server and receiving data from the server.
+   * @brief Put the esp8266 to sleep with AT+SLEEP whenever no request is in
+   * progress or queued, and wake it with AT probes followed by AT+SLEEP=0
+   * before the next command. Firmware that rejects AT+SLEEP is left awake.
    *
-   * @return state is the state of the current transaction. This value
-   * can be checked to determine if a certain stage is taking too long.
+   * Waking from light sleep needs a clock given to set_clock(), as probes
+   * the esp8266 missed are only sent again once they time out.
+   *
+   * @param p_mode power saving to use while idle
    */
-  state get_status();
+  void set_sleep_mode(sleep_mode p_mode) { m_sleep_mode = p_mode; }
   /**
-   * @brief Returns a const reference to the response buffer. This function
-   * should not be called unless the progress() function returns "completed",
-   * otherwise the contents of the buffer are undefined.
+   * @brief Move between the access points of the networks in p_list. The
+   * signal of the access point joined is checked periodically, and once it
+   * is weaker than the threshold the access points in range are scanned with
+   * AT+CWLAP. The strongest one of a known network is joined by its BSSID if
+   * it is stronger by the hysteresis. When joining fails after every retry,
+   * the strongest one in range is joined instead.
    *
-   * @return std::span<std::byte> a span that points to p_response_buffer with a
-   * size equal to the number of bytes retrieved from the response buffer.
+   * Checks and scans wait until no request is in progress, so they never
+   * hold one up. Joining another access point overrides the bssid of the
+   * join options.
+   *
+   * @param p_list known networks and where scans are kept, must outlive the
+   * driver
+   * @param p_options when to move to a stronger access point
    */
-  std::span<const std::byte> response() { return m_response; }
-
-private:
-  void write(std::string_view p_string)
+  void set_roaming(access_point_list& p_list,
+                   const roaming_options_t& p_options)
   {
-    m_serial.flush();
-    m_serial.write(std::as_bytes(std::span{ p_string }));
-    while (m_serial.busy()) {
-      continue;
-    }
+    m_access_points = &p_list;
+    p_list.set_options(p_options);
   }
-
-  void transition_state();
-
-  header_t response_header_from_string(std::span<std::byte> p_header_info)
+  /// Roam between the networks in p_list with the default roaming_options_t
+  void set_roaming(access_point_list& p_list)
   {
-    std::string_view header_info = to_string_view(p_header_info);
-
-    constexpr header_t failure_header{};
-
-    header_t new_header;
-    size_t index = 0;
-    int count = 0;
-
-    index = header_info.find("HTTP/1.1 ");
-    if (index == std::string_view::npos) {
-      return failure_header;
-    }
-
-    count = sscanf(
-      &header_info[index], "HTTP/1.1 %" PRIu32 " OK", &new_header.status_code);
-    if (count != 1) {
-      return failure_header;
+    set_roaming(p_list, roaming_options_t{});
+  }
+  /**
+   * @brief Scan the access points in range into the list given to
+   * set_roaming() once no request is in progress, moving to a stronger one
+   * if the signal is weak. Notifies `scan_complete` when done.
+   */
+  void scan() { m_scan_requested = m_access_points != nullptr; }
+  /**
+   * @return signal strength in dBm of the access point joined when it was
+   * last checked while roaming, 0 if unknown
+   */
+  int8_t rssi() const
+  {
+    return m_access_points != nullptr ? m_access_points->rssi() : 0;
+  }
+  /**
+   * @brief Change how the access point is joined, takes effect the next time
+   * it is joined
+   *
+   * @param p_options join options, the bssid must outlive the driver
+   */
+  void set_join_options(const join_options_t& p_options)
+  {
+    m_join_options = p_options;
+  }
+  /**
+   * @brief Read received bytes from p_ring rather than from the serial port.
+   * The application fills the ring from the receive interrupt or DMA
+   * callbacks, so bytes arriving at high baud rates are kept while
+   * get_status() is not being called. The serial port is still used to
+   * transmit.
+   *
+   * @param p_ring filled with the bytes received from the esp8266, must
+   * outlive the driver
+   */
+  void set_receive_ring(receive_ring& p_ring)
+  {
+    m_serial_reader.use_ring(&p_ring);
+  }
+  /**
+   * @brief Set the TLS buffer size with AT+CIPSSLSIZE while initializing, for
+   * servers that send records larger than the default of 2048 bytes
+   *
+   * @param p_size buffer size from 2048 to 4096, 0 to keep the default
+   */
+  void set_ssl_buffer_size(uint16_t p_size) { m_ssl_buffer_size = p_size; }
+  /**
+   * @brief Look domains up with AT+CIPDOMAIN and connect to the cached
+   * address, rather than having AT+CIPSTART look the domain up every time.
+   *
+   * @param p_cache where addresses are kept, must outlive the driver
+   */
+  void set_dns_cache(dns_cache& p_cache) { m_dns_cache = &p_cache; }
+  /**
+   * @brief Keep the validators and bodies of GET responses in p_cache and
+   * send them along when requesting the same resource again. A "304 Not
+   * Modified" response is then completed with the cached body, header() still
+   * gives the 304 status.
+   *
+   * @param p_cache where responses are kept, must outlive the driver
+   */
+  void set_response_cache(response_cache& p_cache)
+  {
+    m_response_cache = &p_cache;
+  }
+  /**
+   * @brief Inflate gzip and deflate compressed bodies received on p_link,
+   * for requests with `compressed` set. Links without an inflater do not ask
+   * for compressed bodies.
+   *
+   * @param p_inflater decoder and window, must outlive the driver
+   * @param p_link link ID, 0 when not multiplexing
+   * @return false if p_link is not a valid link ID
+   */
+  bool set_inflater(inflater& p_inflater, size_t p_link = 0)
+  {
+    if (p_link >= m_links.size()) {
+      return false;
+    }
+    m_links[p_link].m_inflater = &p_inflater;
+    return true;
+  }
+  /**
+   * @brief Keep every header field of the responses received on p_link in
+   * p_index, so fields that header() does not hold can be looked up. The
+   * fields stay until the next response on the link begins.
+   *
+   * @param p_index where fields are kept, must outlive the driver
+   * @param p_link link ID, 0 when not multiplexing
+   * @return false if p_link is not a valid link ID
+   */
+  bool set_header_index(header_index& p_index, size_t p_link = 0)
+  {
+    if (p_link >= m_links.size()) {
+      return false;
+    }
+    m_links[p_link].m_parser.set_header_index(&p_index);
+    return true;
+  }
+  /**
+   * @brief Use these DNS servers, set with AT+CIPDNS_CUR while initializing.
+   * Skipped if the firmware does not support the command.
+   *
+   * @param p_primary IPv4 address of the primary DNS server
+   * @param p_secondary IPv4 address of the secondary DNS server, if any. Both
+   * must outlive the driver.
+   */
+  void set_dns_servers(std::string_view p_primary,
+                       std::string_view p_secondary = {})
+  {
+    m_dns_primary = p_primary;
+    m_dns_secondary = p_secondary;
+  }
+  /**
+   * @brief Make the requests given to queue_request() from p_queue
+   *
+   * @param p_queue holds the waiting requests, must outlive the driver
+   */
+  void set_request_queue(request_queue& p_queue) { m_request_queue = &p_queue; }
+  /**
+   * @param p_handler notified whenever a request finishes, must outlive the
+   * driver
+   */
+  void on_completion(completion_handler& p_handler)
+  {
+    m_completion_handler = &p_handler;
+  }
+  /**
+   * @param p_handler notified of unsolicited messages from the esp8266, must
+   * outlive the driver
+   */
+  void on_event(event_handler& p_handler) { m_event_handler = &p_handler; }
+  /**
+   * @param p_instrumentation notified of state changes, bytes transferred and
+   * retries from get_status(), must outlive the driver
+   */
+  void set_instrumentation(instrumentation& p_instrumentation)
+  {
+    m_instrumentation = &p_instrumentation;
+  }
+  /**
+   * @return uint32_t the baud rate currently used to talk to the esp8266
+   */
+  uint32_t baud_rate() { return m_serial.settings().baud_rate; }
+  /**
+   * @brief Change the access point to connect to. Running get_status() after
+   * calling this will disconnect from the previous access point and attempt to
+   * connect to the new one.
+   *
+   * @param p_ssid name of the access point
+   * @param p_password the password for the access point
+   */
+  void change_access_point(std::string_view p_ssid,
+                           std::string_view p_password);
+  /**
+   * @brief checks the connection state to an access point.
+   *
+   * @return true is connected to access point
+   * @return false is NOT connected access point
+   */
+  bool connected();
+  /**
+   * @brief Starts a http request. This function will issue a command to connect
+   * with a server and will return immediately. This function will also abort
+   * any ongoing requests if they are in progress. This function is non-blocking
+   * and as such, to progress the request further the `progress()` function must
+   * be called, until it returns "complete" or an error condition has occurred.
+   *
+   * The request ends in `failure` if its header does not fit in the response
+   * buffer.
+   *
+   * @param p_request the request to issue
+   */
+  void request(request_t p_request);
+  /**
+   * @brief Starts a http request whose body is streamed to p_sink rather than
+   * stored in the response buffer. Each piece of the body is passed to the sink
+   * as soon as it is received, so the body may be larger than the response
+   * buffer. The response buffer is still used to build the request.
+   *
+   * @param p_request the request to issue
+   * @param p_sink receives the body of the response, must outlive the request
+   */
+  void request(request_t p_request, body_sink& p_sink);
+  /**
+   * @brief Starts a http request on a specific link. Requests on different
+   * links progress at the same time. Aborts any ongoing request on that link.
+   *
+   * @param p_link link ID to make the request on
+   * @param p_request the request to issue
+   * @return true if the request was started
+   * @return false if p_link is not a valid link ID
+   */
+  bool request(size_t p_link, request_t p_request);
+  /**
+   * @brief Starts a http request on a specific link whose body is streamed to
+   * p_sink.
+   *
+   * @param p_link link ID to make the request on
+   * @param p_request the request to issue
+   * @param p_sink receives the body of the response, must outlive the request
+   * @return true if the request was started
+   * @return false if p_link is not a valid link ID
+   */
+  bool request(size_t p_link, request_t p_request, body_sink& p_sink);
+  /**
+   * @brief Open a UDP link, for small messages that do not need the
+   * connection setup and header of a http request. Aborts any ongoing request
+   * on the link. The link reaches `complete` once open.
+   *
+   * Datagrams received on the link are added to p_received. The link is
+   * listened on in between other work until close_datagram() is called.
+   *
+   * @param p_link link ID to open, 0 when not multiplexing
+   * @param p_datagram_link where datagrams are sent to and received on
+   * @param p_received receives incoming datagrams, must outlive the link
+   * @return false if p_link is not a valid link ID
+   */
+  bool open_datagram(size_t p_link,
+                     datagram_link_t p_datagram_link,
+                     datagram_ring& p_received);
+  bool open_datagram(datagram_link_t p_datagram_link,
+                     datagram_ring& p_received)
+  {
+    return open_datagram(0, p_datagram_link, p_received);
+  }
+  /**
+   * @brief Send a datagram over a UDP link with a single AT+CIPSEND. The link
+   * reaches `complete` once the esp8266 has sent it, reopening the link first
+   * if it was closed.
+   *
+   * @param p_link link ID opened with open_datagram()
+   * @param p_datagram bytes to send, must stay valid until the link reaches
+   * `complete`. At most `maximum_transmit_packet_size` bytes.
+   * @return false if p_link is not an open UDP link, it is still busy or the
+   * datagram is empty or too large
+   */
+  bool send_to(size_t p_link, std::span<const std::byte> p_datagram);
+  bool send_to(std::span<const std::byte> p_datagram)
+  {
+    return send_to(0, p_datagram);
+  }
+  /**
+   * @brief Close a UDP link, it reaches `complete` once closed
+   *
+   * @return false if p_link is not a UDP link or it is still busy
+   */
+  bool close_datagram(size_t p_link = 0);
+  /**
+   * @brief Queue a http request to be made on link 0 once the requests queued
+   * before it have finished, rather than aborting them.
+   *
+   * Queued requests to the same domain and port that together fit in one
+   * AT+CIPSEND are sent back to back (pipelined) over one connection, which is
+   * kept open between them. Each response is split off by its Content-Length
+   * or chunked encoding and reported to the completion handler on its own, the
+   * body is only in the response buffer until the handler returns. If a
+   * response fails, the requests sent along with it are reported as
+   * `failure`. Starting a request on link 0 with request() drops the queued
+   * request being made and those sent along with it.
+   *
+   * @param p_request the request to queue
+   * @return false if there is no request queue or it is full
+   */
+  bool queue_request(request_t p_request);
+  /**
+   * @brief Queue a http request whose body is streamed to p_sink
+   *
+   * @param p_request the request to queue
+   * @param p_sink receives the body of the response, must outlive the request
+   * @return false if there is no request queue or it is full
+   */
+  bool queue_request(request_t p_request, body_sink& p_sink);
+  /**
+   * @brief After issuing a request, this function must be called in order to
+   * progress the http request. This function manages, connecting to the server,
+   * sending the request to server and receiving data from the server.
+   *
+   * Commands are queued and handed to the serial port whenever it is not
+   * busy, so this never waits for a transmission to finish. Each call makes
+   * as much progress as the received bytes allow, up to
+   * `maximum_steps_per_status` steps, so it only needs to be called again
+   * once waiting() is false.
+   *
+   * When multiplexing, this progresses the requests on every link and returns
+   * `connected_to_ap` while busy with phase 2. Use `get_status(link)` for the
+   * state of a request on a particular link.
+   *
+   * @return state is the state of the current transaction. This value
+   * can be checked to determine if a certain stage is taking too long.
+   */
+  state get_status();
+  /**
+   * @brief Whether get_status() has nothing to do until something happens on
+   * the serial port. An application can sleep (for example with WFI) while
+   * this is true and call get_status() when a serial interrupt wakes it.
+   *
+   * While a clock is given, timeouts and retries are only noticed from
+   * get_status(), so also wake up periodically (a timer tick is enough).
+   *
+   * @return true if get_status() cannot make progress until bytes are
+   * received, the serial port finishes transmitting, or the passthrough guard
+   * time or a retry backoff has passed
+   */
+  bool waiting() { return !can_progress(); }
+  /**
+   * @param p_link link ID
+   * @return state the state of the request on p_link, `failure` if p_link is
+   * not a valid link ID. Does not progress the request.
+   */
+  state get_status(size_t p_link)
+  {
+    if (p_link >= m_links.size()) {
+      return state::failure;
+    }
+    return m_links[p_link].status();
+  }
+  /// @return number of links, 1 unless multiplexing
+  size_t link_count() const { return m_links.size(); }
+  /**
+   * @brief Returns a const reference to the response buffer. This function
+   * should not be called unless the progress() function returns "completed",
+   * otherwise the contents of the buffer are undefined.
+   *
+   * @return std::span<std::byte> a span that points to p_response_buffer with a
+   * size equal to the number of bytes retrieved from the response buffer. The
+   * span is empty if the body was streamed to a body_sink.
+   */
+  std::span<const std::byte> response() { return response(0); }
+  /**
+   * @param p_link link ID
+   * @return std::span<const std::byte> body of the response on p_link
+   */
+  std::span<const std::byte> response(size_t p_link)
+  {
+    if (p_link >= m_links.size()) {
+      return {};
+    }
+    return m_links[p_link].response();
+  }
+  /**
+   * @brief Returns the header of the last response. Only valid once the
+   * request has progressed past the `receiving_header` state.
+   *
+   * @return header_t status code, content length and header length
+   */
+  header_t header() { return header(0); }
+  /**
+   * @param p_link link ID
+   * @return header_t header of the last response on p_link
+   */
+  header_t header(size_t p_link)
+  {
+    if (p_link >= m_links.size()) {
+      return {};
+    }
+    return m_links[p_link].header();
+  }
+
+protected:
+  /**
+   * @brief A command composed at compile time along with the two arguments it
+   * was composed with, so it is only used when those arguments are in use.
+   *
+   */
+  struct precomposed_command
+  {
+    std::string_view command;
+    std::string_view first_argument;
+    std::string_view second_argument;
+  };
+
+  /**
+   * @param p_command AT+CWJAP_CUR command to send, in one write, when joining
+   * the access point with the ssid and password of p_command. Must outlive the
+   * driver.
+   */
+  void precomposed_join(const precomposed_command& p_command)
+  {
+    m_precomposed_join = &p_command;
+  }
+
+  /**
+   * @param p_command AT+CIPSTART command to send, in one write, when not
+   * multiplexing and connecting to the domain and port of p_command. Must
+   * outlive the driver.
+   */
+  void precomposed_connect(const precomposed_command& p_command)
+  {
+    m_precomposed_connect = &p_command;
+  }
+
+private:
+  /// Interrupt slots used once connected, close notices use the slots after
+  /// closed_interrupt
+  static constexpr size_t ipd_interrupt = 0;
+  static constexpr size_t error_interrupt = 1;
+  static constexpr size_t closed_interrupt = 2;
+  static constexpr size_t disconnect_interrupt =
+    closed_interrupt + maximum_links;
+  /// Watched in every state
+  static constexpr size_t busy_interrupt = disconnect_interrupt + 1;
+
+  esp8266(embed::serial& p_serial,
+          std::string_view p_ssid,
+          std::string_view p_password,
+          uint32_t p_baud_rate)
+    : m_serial{ p_serial }
+    , m_ssid{ p_ssid }
+    , m_password{ p_password }
+    , m_target_baud_rate{ p_baud_rate }
+    , m_serial_reader{ m_serial }
+    , m_transmitter{ m_serial }
+    , m_commander{ m_transmitter, m_serial_reader }
+    , m_integer_reader{ m_serial_reader }
+    , m_buffer_reader{ m_serial_reader }
+    , m_links{}
+  {}
+
+  /// Queue p_data for transmission, it must stay valid until it has been sent
+  void write(std::span<const std::byte> p_data) { m_transmitter.write(p_data); }
+
+  void write(std::string_view p_string) { write(to_bytes(p_string)); }
+
+  /// Write "<link ID>," when multiplexing
+  void write_link_id(bool p_trailing_comma)
+  {
+    if (m_multiplexed) {
+      const std::array<char, 2> id{ static_cast<char>('0' + m_active_link),
+                                    ',' };
+      m_transmitter.write_copy(
+        to_bytes(std::string_view(id.data(), p_trailing_comma ? 2 : 1)));
+    }
+  }
+
+  /// Close the connection of the active link then go to p_next_state
+  void close_active_link(state p_next_state)
+  {
+    active_link().m_connection_open = false;
+    write(m_multiplexed ? "AT+CIPCLOSE=" : "AT+CIPCLOSE");
+    write_link_id(false);
+    m_commander.new_search(to_bytes("\r\n"), to_bytes(ok_response));
+    m_next_state = p_next_state;
+    m_read_state = read_state::until_sequence;
+  }
+
+  void step();
+  void instrumented_step();
+  void observe_transition();
+  void observe_link(size_t p_link);
+  state current_phase();
+  bool can_progress();
+  void report_finished_links();
+  void transition_state();
+  void schedule();
+  bool start_request(size_t p_link, request_t p_request, body_sink* p_sink);
+  bool enqueue(request_t p_request, body_sink* p_sink);
+  void start_queued_request();
+  void finish_queued_request(link_t& p_link);
+  void drop_queued_requests(link_t& p_link);
+  void batch_queued_requests(link_t& p_link);
+  void start_datagram(link_t& p_link);
+  void watch_for_link_events();
+  void finish_frame();
+  size_t receive_response(link_t* p_link, size_t p_limit);
+  void link_closed(size_t p_link);
+  void command_failed();
+  void command_dropped();
+  void read_access_point(std::string_view p_line);
+  /// @return true once a whole line has been read into the access point list
+  bool read_access_point_line();
+  void choose_access_point();
+  void wifi_disconnected();
+  void notify(event p_event, size_t p_link = 0)
+  {
+    if (m_event_handler != nullptr) {
+      m_event_handler->received(p_event, p_link);
+    }
+  }
+  void check_timeouts();
+  void command_timed_out();
+  void phase_one_failed();
+  void retry_connect(link_t& p_link, state p_give_up);
+  std::chrono::milliseconds command_limit(state p_state) const;
+
+  link_t& active_link() { return m_links[m_active_link]; }
+
+  std::chrono::milliseconds now()
+  {
+    return (m_clock != nullptr) ? m_clock->uptime()
+                                : std::chrono::milliseconds{ 0 };
+  }
+
+  /// @return true if more than p_limit has passed since p_start
+  bool expired(std::chrono::milliseconds p_start,
+               std::chrono::milliseconds p_limit)
+  {
+    return m_clock != nullptr && p_limit.count() != 0 &&
+           m_clock->uptime() - p_start >= p_limit;
+  }
+
+  /// @return the wait before retry number p_attempt, counting from 0
+  std::chrono::milliseconds backoff(uint8_t p_attempt) const
+  {
+    return m_timeouts.backoff * (1U << std::min<uint8_t>(p_attempt, 10));
+  }
+
+  /// Go to m_next_state once the queued writes were sent and p_length passed
+  void delay(std::chrono::milliseconds p_length)
+  {
+    if (m_clock == nullptr) {
+      m_read_state = read_state::complete;
+      return;
+    }
+    // The clock counts whole milliseconds, one more makes sure that at least
+    // p_length passes
+    m_delay = p_length + std::chrono::milliseconds{ 1 };
+    m_delay_end = m_clock->uptime() + m_delay;
+    m_read_state = read_state::delay;
+  }
+
+  /// @return true if any link needs a command sent
+  bool link_ready()
+  {
+    return std::any_of(
+      m_links.begin(), m_links.end(), [this](const auto& p_link) {
+        return ready_for_command(p_link);
+      });
+  }
+
+  /// @return true if no request is in progress, queued or unreported
+  bool links_idle() const
+  {
+    if (m_request_queue != nullptr && !m_request_queue->empty()) {
+      return false;
+    }
+    return std::all_of(m_links.begin(), m_links.end(), [](const auto& p_link) {
+      return (finished(p_link.m_state) ||
+              p_link.m_state == state::connected_to_ap) &&
+             p_link.m_finish_reported && p_link.m_pipelined == 0 &&
+             p_link.m_datagrams == nullptr;
+    });
+  }
+
+  /// @return true if the esp8266 is to be put to sleep as nothing is going on
+  bool should_sleep() const
+  {
+    return m_sleep_mode != sleep_mode::none && !m_asleep && links_idle();
+  }
+
+  /// @return true if a scan was asked for or the signal is to be checked
+  bool roaming_check_due()
+  {
+    return m_access_points != nullptr &&
+           (m_scan_requested ||
+            expired(m_access_points->last_checked(),
+                    m_access_points->options().check_interval)) &&
+           links_idle();
+  }
+
+  /// @return true if a command is to be issued while no link needs one
+  bool idle_command_due() { return roaming_check_due() || should_sleep(); }
+
+  /// @return true if p_link needs a command sent and is not backing off
+  bool ready_for_command(const link_t& p_link)
+  {
+    if (p_link.m_state == state::connecting_to_server &&
+        p_link.m_attempts != 0 && m_clock != nullptr) {
+      return m_clock->uptime() >= p_link.m_retry_at;
+    }
+    return needs_command(p_link.m_state) ||
+           p_link.m_state == state::preparing_request;
+  }
+
+  /**
+   * @brief Bytes p_begin up to p_end of the active request, which is the
+   * serialized header in the response buffer followed by send_data
+   *
+   * @return the part of the range within the header and the part within
+   * send_data, either may be empty
+   */
+  std::array<std::span<const std::byte>, 2> request_bytes(size_t p_begin,
+                                                          size_t p_end)
+  {
+    std::span<const std::byte> header =
+      active_link().m_response.first(m_request_length);
+    auto body = m_send_data;
+    size_t header_begin = std::min(p_begin, header.size());
+    size_t header_end = std::min(p_end, header.size());
+    size_t body_begin = std::max(p_begin, header.size()) - header.size();
+    size_t body_end = std::max(p_end, header.size()) - header.size();
+    return { header.subspan(header_begin, header_end - header_begin),
+             body.subspan(body_begin, body_end - body_begin) };
+  }
+
+  /// @return true if the state is one where a link needs a command sent
+  static bool needs_command(state p_state)
+  {
+    return p_state == state::closing_previous_connection ||
+           p_state == state::connecting_to_server ||
+           p_state == state::close_connection ||
+           p_state == state::close_connection_failure;
+  }
+
+  /// @return true if the state issues a command between requests, these keep
+  /// listening for link events like connected_to_ap
+  static bool idle_command(state p_state)
+  {
+    return p_state >= state::entering_sleep &&
+           p_state <= state::choosing_access_point;
+  }
+
+  /// @return true if the request of a link with this state has ended
+  static bool finished(state p_state)
+  {
+    return p_state == state::complete || p_state == state::failure ||
+           p_state == state::timeout;
+  }
+
+  /// @return true if p_domain is already an IPv4 address
+  static bool is_address(std::string_view p_domain)
+  {
+    return !p_domain.empty() &&
+           std::all_of(p_domain.begin(), p_domain.end(), [](char p_char) {
+             return p_char == '.' || (p_char >= '0' && p_char <= '9');
+           });
+  }
+
+  /// @return true if the state is one where a link is receiving a response
+  static bool receiving(state p_state)
+  {
+    return p_state == state::receiving_header ||
+           p_state == state::receiving_body;
+  }
+
+  /// @return true if the next pipelined response for p_link is held back
+  /// until the one before it has been reported
+  static bool awaiting_report(const link_t& p_link)
+  {
+    return p_link.m_pipelined != 0 && !p_link.m_finish_reported &&
+           finished(p_link.m_state);
+  }
+
+  /// @return true if the open connection is to the server of p_request
+  static bool connected_to(const link_t& p_link, const request_t& p_request)
+  {
+    std::string_view host(p_link.m_connected_host.data(),
+                          p_link.m_connected_host_length);
+    return p_link.m_connection_open &&
+           p_link.m_connected_secure == p_request.secure &&
+           host.size() == p_request.domain.size() + 1 + p_request.port.size() &&
+           host.starts_with(p_request.domain) &&
+           host[p_request.domain.size()] == ':' &&
+           host.ends_with(p_request.port);
+  }
+
+  static void remember_host(link_t& p_link)
+  {
+    const auto& request = p_link.m_request;
+    p_link.m_connected_secure = request.secure;
+    size_t length = request.domain.size() + 1 + request.port.size();
+    if (length > p_link.m_connected_host.size()) {
+      // Too long to remember, the connection will never be reused
+      p_link.m_connected_host_length = 0;
+      return;
+    }
+    auto end = std::copy(request.domain.begin(),
+                         request.domain.end(),
+                         p_link.m_connected_host.begin());
+    *end++ = ':';
+    std::copy(request.port.begin(), request.port.end(), end);
+    p_link.m_connected_host_length = length;
+  }
+
+  /// @return the state to go to once the whole response has been received
+  static state response_received_state(const link_t& p_link)
+  {
+    if (!p_link.m_connection_open ||
+        ((p_link.m_request.keep_alive || p_link.m_pipelined != 0) &&
+         !p_link.m_parser.header().connection_close)) {
+      return state::complete;
+    }
+    return state::close_connection;
+  }
+
+  /// @return true if the response to p_request can be cached
+  bool cacheable(const request_t& p_request) const
+  {
+    return m_response_cache != nullptr &&
+           p_request.method == http_method::GET && p_request.send_data.empty();
+  }
+
+  /// Ask for the resource only if it changed since the cached response
+  void add_validators(request_t& p_request)
+  {
+    if (!cacheable(p_request) || !p_request.if_none_match.empty() ||
+        !p_request.if_modified_since.empty()) {
+      return;
+    }
+    if (auto* cached = m_response_cache->find(
+          p_request.domain, p_request.port, p_request.path)) {
+      p_request.if_none_match = cached->etag.view();
+      p_request.if_modified_since = cached->last_modified.view();
+    }
+  }
+
+  /// Get p_link ready for the response to its request
+  void begin_response(link_t& p_link)
+  {
+    const auto& request = p_link.m_request;
+    p_link.m_parser.reset(request.method != http_method::HEAD);
+    p_link.m_response_position = 0;
+    p_link.m_inflating = false;
+    p_link.m_cache_fill = nullptr;
+    p_link.m_cached = nullptr;
+    // Validators given by the application are for its own copy
+    if (cacheable(request) && request.if_none_match.empty() &&
+        request.if_modified_since.empty()) {
+      p_link.m_cached =
+        m_response_cache->find(request.domain, request.port, request.path);
+    }
+  }
+
+  /// Store the response about to be received on p_link if it can be cached
+  void start_caching(link_t& p_link)
+  {
+    const auto& header = p_link.m_parser.header();
+    const auto& request = p_link.m_request;
+    if (header.status_code != 200 || !cacheable(request)) {
+      return;
+    }
+    if (header.etag.empty() && header.last_modified.empty()) {
+      m_response_cache->erase(request.domain, request.port, request.path);
+      return;
+    }
+    p_link.m_cache_fill =
+      m_response_cache->claim(request.domain, request.port, request.path);
+  }
+
+  /**
+   * @brief Complete a 304 response with the cached body, or keep the
+   * validators of a response whose body has been stored
+   *
+   * @return false if the cached body does not fit in the response buffer
+   */
+  bool finish_response(link_t& p_link)
+  {
+    const auto& header = p_link.m_parser.header();
+    const auto& request = p_link.m_request;
+    auto* cached = std::exchange(p_link.m_cached, nullptr);
+    auto* fill = std::exchange(p_link.m_cache_fill, nullptr);
+    if (header.status_code == 304 && cached != nullptr &&
+        cached->last_used != 0 &&
+        response_cache::matches(
+          *cached, request.domain, request.port, request.path)) {
+      return store_body(p_link, cached->cached_body());
+    }
+    if (fill != nullptr) {
+      m_response_cache->commit(*fill, header);
+    }
+    return true;
+  }
+
+  /// Move p_link along once its response parser has made progress
+  void update_link(link_t& p_link)
+  {
+    if (!receiving(p_link.m_state)) {
+      return;
+    }
+
+    const auto& parser = p_link.m_parser;
+    const auto& header = parser.header();
+    if (p_link.m_state == state::receiving_header &&
+        parser.header_complete() &&
+        parser.current_stage() != http_response_parser::stage::failure) {
+      start_caching(p_link);
+    }
+    if (parser.current_stage() == http_response_parser::stage::failure) {
+      fail_link(p_link);
+    } else if (parser.current_stage() ==
+               http_response_parser::stage::complete) {
+      if ((p_link.m_inflating && p_link.m_inflater->current_status() !=
+                                   inflater::status::finished) ||
+          !finish_response(p_link)) {
+        // The compressed body was cut short, or the cached body did not fit
+        fail_link(p_link);
+      } else {
+        p_link.m_state = response_received_state(p_link);
+      }
+    } else if (parser.header_complete()) {
+      // Only checked once a body is known to follow, as the Content-Length of
+      // a HEAD response or a 304 describes a body that is never sent
+      if (p_link.m_sink == nullptr && header.has_content_length &&
+          header.content_length > p_link.m_response.size()) {
+        fail_link(p_link);
+        return;
+      }
+      if (p_link.m_state == state::receiving_header) {
+        start_body(p_link);
+      }
+      p_link.m_state = state::receiving_body;
+    }
+  }
+
+  /// Inflate the body of p_link if it is compressed and there is an inflater
+  static void start_body(link_t& p_link)
+  {
+    auto coding = p_link.m_parser.header().content_encoding.view();
+    p_link.m_inflating = false;
+    if (p_link.m_inflater == nullptr || coding.empty()) {
+      return;
+    }
+    if (equal_ignoring_case(coding, "gzip") ||
+        equal_ignoring_case(coding, "x-gzip")) {
+      p_link.m_inflater->reset(inflater::format::gzip);
+    } else if (equal_ignoring_case(coding, "deflate")) {
+      p_link.m_inflater->reset(inflater::format::deflate);
+    } else {
+      // Passed on as received
+      return;
+    }
+    p_link.m_inflating = true;
+  }
+
+  static void fail_link(link_t& p_link)
+  {
+    p_link.m_state = p_link.m_connection_open ? state::close_connection_failure
+                                              : state::failure;
+  }
+
+  /**
+   * @return std::span<std::byte> where up to p_length body bytes for p_link
+   * can be read straight from the serial port, empty if the response buffer is
+   * full. Bodies for a sink pass through the response buffer, whose request
+   * has been sent by the time the response arrives. Compressed bodies are
+   * fetched instead, to be inflated.
+   */
+  static std::span<std::byte> body_destination(link_t& p_link,
+                                               size_t p_length)
+  {
+    if (p_link.m_inflating) {
+      return {};
+    }
+    if (p_link.m_sink != nullptr) {
+      return p_link.m_response.first(
+        std::min(p_length, p_link.m_response.size()));
+    }
+    auto space = p_link.m_response.subspan(p_link.m_response_position);
+    return space.first(std::min(p_length, space.size()));
+  }
+
+  /**
+   * @brief Pass received body bytes, inflated if compressed, to the sink or
+   * append them to the response
+   *
+   * @return false if the bytes did not fit in the response buffer or could
+   * not be inflated
+   */
+  static bool write_body(link_t& p_link, std::span<const std::byte> p_body)
+  {
+    if (!p_link.m_inflating) {
+      return store_body(p_link, p_body);
+    }
+    bool stored = true;
+    auto status = p_link.m_inflater->feed(
+      p_body, [&p_link, &stored](std::span<const std::byte> p_inflated) {
+        stored = store_body(p_link, p_inflated) && stored;
+      });
+    return stored && status != inflater::status::failure;
+  }
+
+  static bool store_body(link_t& p_link, std::span<const std::byte> p_body)
+  {
+    cache_body(p_link, p_body);
+    if (p_link.m_sink != nullptr) {
+      p_link.m_sink->write(p_body);
+    } else if (p_link.m_response_position + p_body.size() <=
+               p_link.m_response.size()) {
+      std::copy(p_body.begin(),
+                p_body.end(),
+                p_link.m_response.begin() + p_link.m_response_position);
+    } else {
+      return false;
+    }
+    p_link.m_response_position += p_body.size();
+    return true;
+  }
+
+  /// Add body bytes of p_link to the cache entry being filled
+  static void cache_body(link_t& p_link, std::span<const std::byte> p_body)
+  {
+    auto* fill = p_link.m_cache_fill;
+    if (fill == nullptr) {
+      return;
+    }
+    if (fill->body_length + p_body.size() <= fill->body.size()) {
+      std::copy(
+        p_body.begin(), p_body.end(), fill->body.begin() + fill->body_length);
+      fill->body_length += p_body.size();
+    } else if (!fill->body.empty()) {
+      // Too large to cache, the claimed entry stays empty
+      p_link.m_cache_fill = nullptr;
+    }
+  }
+
+  serial& m_serial;
+  std::string_view m_ssid;
+  std::string_view m_password;
+  uint32_t m_target_baud_rate;
+  serial_reader m_serial_reader;
+  transmit_queue m_transmitter;
+  command_and_find_response m_commander;
+  read_integer m_integer_reader;
+  read_into_buffer m_buffer_reader;
+  /// Part of the ring the datagram being received wraps around into
+  std::span<std::byte> m_datagram_tail;
+  uptime_clock* m_clock = nullptr;
+  completion_handler* m_completion_handler = nullptr;
+  event_handler* m_event_handler = nullptr;
+  request_queue* m_request_queue = nullptr;
+  instrumentation* m_instrumentation = nullptr;
+  const precomposed_command* m_precomposed_join = nullptr;
+  join_options_t m_join_options{};
+  dns_cache* m_dns_cache = nullptr;
+  response_cache* m_response_cache = nullptr;
+  access_point_list* m_access_points = nullptr;
+  bool m_scan_requested = false;
+  /// The scan was started as joining the access point kept failing
+  bool m_scan_for_join = false;
+  uint16_t m_ssl_buffer_size = 0;
+  std::string_view m_dns_primary;
+  std::string_view m_dns_secondary;
+  /// Address being read from the response to AT+CIPDOMAIN
+  dns_cache::address_t m_address{};
+  uint8_t m_address_octets = 0;
+  /// The command has been answered and the value in its answer is read next
+  bool m_reading_answer = false;
+  /// AT+UART_CUR with the default baud rate is queued and the rate of the
+  /// serial port changes once it has gone out
+  bool m_restoring_sent = false;
+  /// The domain of the active link has just been looked up
+  bool m_looked_up = false;
+  const precomposed_command* m_precomposed_connect = nullptr;
+  /// Last phase 1 state given to the instrumentation
+  state m_observed_state = state::failure;
+  timeouts_t m_timeouts{};
+  /// When the command being waited on was issued and how long it may take
+  std::chrono::milliseconds m_command_start{ 0 };
+  std::chrono::milliseconds m_command_limit{ 0 };
+  /// Length and end of the wait of read_state::delay
+  std::chrono::milliseconds m_delay{ 0 };
+  std::chrono::milliseconds m_delay_end{ 0 };
+  /// Failed attempts at joining the access point
+  uint8_t m_join_attempts = 0;
+  /// Times in a row the esp8266 was too busy for the command
+  uint8_t m_busy_retries = 0;
+  sleep_mode m_sleep_mode = sleep_mode::none;
+  /// AT+SLEEP was sent and the esp8266 has not been woken since
+  bool m_asleep = false;
+  /// AT probes sent to wake the esp8266 and when the first one was sent
+  uint8_t m_wake_probes = 0;
+  std::chrono::milliseconds m_wake_start{ 0 };
+  bool m_passthrough = false;
+  state m_passthrough_outcome = state::failure;
+  link_t m_single_link;
+  std::span<link_t> m_links;
+  bool m_multiplexed = false;
+  size_t m_active_link = 0;
+  size_t m_frame_link = 0;
+  /// Bytes of the +IPD frame being received that have not been read yet
+  size_t m_frame_length = 0;
+  state m_state = state::reset;
+  state m_next_state = state::reset;
+  /// Where phase 1 goes if a command responds with an error
+  state m_failure_state = state::reset;
+  read_state m_read_state = read_state::complete;
+  /// Length of the serialized header at the start of the response buffer
+  size_t m_request_length = 0;
+  /// Sent after the header, empty if it was copied into the response buffer
+  std::span<const std::byte> m_send_data;
+  /// Bytes of the header and send_data of the active request already sent
+  size_t m_send_offset = 0;
+};
+
+/**
+ * @brief esp8266 driver that owns its response buffer. The access point and a
+ * server that are known at compile time can be given as template parameters,
+ * their AT+CWJAP_CUR and AT+CIPSTART commands are then composed at compile
+ * time and each sent in a single write.
+ *
+ * @tparam ResponseBufferSize size of the response buffer
+ * @tparam Ssid name of the access point, empty if only known at runtime
+ * @tparam Password password of the access point
+ * @tparam Host domain of the server most requests are made to, if any
+ * @tparam Port port of that server
+ */
+template<size_t ResponseBufferSize = esp8266::maximum_response_packet_size,
+         fixed_string Ssid = "",
+         fixed_string Password = "",
+         fixed_string Host = "",
+         fixed_string Port = "80">
+class static_esp8266 : public esp8266
+{
+public:
+  static_esp8266(embed::serial& p_serial,
+                 std::string_view p_ssid,
+                 std::string_view p_password,
+                 uint32_t p_baud_rate = esp8266::default_baud_rate)
+    : esp8266(p_serial, p_ssid, p_password, m_response_buffer, p_baud_rate)
+  {
+    if constexpr (!Ssid.empty()) {
+      precomposed_join(join_command);
+    }
+    if constexpr (!Host.empty()) {
+      precomposed_connect(connect_command);
+    }
+  }
+
+  /// Join the access point given by the Ssid and Password template parameters
+  explicit static_esp8266(embed::serial& p_serial,
+                          uint32_t p_baud_rate = esp8266::default_baud_rate)
+    requires(!Ssid.empty())
+    : static_esp8266(p_serial, Ssid.view(), Password.view(), p_baud_rate)
+  {}
+
+private:
+  static constexpr precomposed_command join_command{
+    at_command<"AT+CWJAP_CUR=\"", Ssid, "\",\"", Password, "\"\r\n">::view(),
+    Ssid.view(),
+    Password.view(),
+  };
+  static constexpr precomposed_command connect_command{
+    at_command<"AT+CIPSTART=\"TCP\",\"", Host, "\",", Port, "\r\n">::view(),
+    Host.view(),
+    Port.view(),
+  };
+
+  std::array<std::byte, ResponseBufferSize> m_response_buffer;
+};
+
+/**
+ * @brief Request queue that owns its entries
+ *
+ * @tparam Capacity most requests waiting at once
+ */
+template<size_t Capacity = 4>
+class static_request_queue : public esp8266::request_queue
+{
+public:
+  static_request_queue()
+    : esp8266::request_queue(m_storage)
+  {}
+
+private:
+  std::array<entry, Capacity> m_storage{};
+};
+
+/**
+ * @brief Multiplexed esp8266 driver that owns its links along with a response
+ * buffer for each of them.
+ *
+ * @tparam LinkCount number of links, at most esp8266::maximum_links
+ * @tparam ResponseBufferSize size of the response buffer of each link
+ */
+template<size_t LinkCount = esp8266::maximum_links,
+         size_t ResponseBufferSize = esp8266::maximum_response_packet_size>
+class static_multiplexed_esp8266 : public esp8266
+{
+public:
+  static_assert(LinkCount <= esp8266::maximum_links,
+                "The esp8266 supports at most 5 links");
+
+  static_multiplexed_esp8266(embed::serial& p_serial,
+                             std::string_view p_ssid,
+                             std::string_view p_password,
+                             uint32_t p_baud_rate = esp8266::default_baud_rate)
+    : esp8266(p_serial,
+              p_ssid,
+              p_password,
+              std::span{ m_link_storage },
+              p_baud_rate)
+  {
+    for (size_t i = 0; i < LinkCount; i++) {
+      m_link_storage[i] = link_t(m_response_buffers[i]);
+    }
+  }
+
+private:
+  std::array<link_t, LinkCount> m_link_storage;
+  std::array<std::array<std::byte, ResponseBufferSize>, LinkCount>
+    m_response_buffers;
+};
+} // namespace embed
+
+namespace embed {
+inline bool esp8266::driver_initialize()
+{
+  m_serial.settings().baud_rate = default_baud_rate;
+  m_serial.settings().frame_size = 8;
+  m_serial.settings().parity = serial_settings::parity::none;
+  m_serial.settings().stop = serial_settings::stop_bits::one;
+  if (!m_serial.initialize()) {
+    return false;
+  }
+  m_serial_reader.flush();
+  m_transmitter.clear();
+  m_restoring_sent = false;
+  m_state = state::reset;
+  return true;
+}
+inline void esp8266::change_access_point(std::string_view p_ssid,
+                                         std::string_view p_password)
+{
+  m_ssid = p_ssid;
+  m_password = p_password;
+  m_join_attempts = 0;
+  m_next_state = state::attempting_ap_connection;
+  if (m_state == state::connected_to_ap &&
+      m_read_state == read_state::until_sequence) {
+    // Stop listening so the join starts
+    m_read_state = read_state::complete;
+  }
+}
+inline bool esp8266::connected()
+{
+  return m_state >= state::connected_to_ap ||
+         (idle_command(m_state) && !m_scan_for_join);
+}
+inline void esp8266::request(request_t p_request)
+{
+  start_request(0, p_request, nullptr);
+}
+inline void esp8266::request(request_t p_request, body_sink& p_sink)
+{
+  start_request(0, p_request, &p_sink);
+}
+inline bool esp8266::request(size_t p_link, request_t p_request)
+{
+  return start_request(p_link, p_request, nullptr);
+}
+inline bool esp8266::request(size_t p_link,
+                             request_t p_request,
+                             body_sink& p_sink)
+{
+  return start_request(p_link, p_request, &p_sink);
+}
+inline bool esp8266::start_request(size_t p_link,
+                                   request_t p_request,
+                                   body_sink* p_sink)
+{
+  if (p_link >= m_links.size()) {
+    return false;
+  }
+
+  auto& link = m_links[p_link];
+  p_request.compressed = p_request.compressed && link.m_inflater != nullptr;
+  // Responses to requests sent along with the queued one are still to come
+  bool answering = link.m_pipelined != 0;
+  if (link.m_queued) {
+    drop_queued_requests(link);
+  }
+  bool in_flight =
+    !finished(link.m_state) && link.m_state > state::connected_to_ap;
+  bool leaving_passthrough = p_link == m_active_link &&
+                             (m_state == state::exiting_passthrough ||
+                              m_state == state::leaving_passthrough);
+
+  if (leaving_passthrough) {
+    // The response has been received, the esp8266 still has to leave
+    // transparent transmission before this request can start
+    in_flight = !finished(m_passthrough_outcome);
+  } else if (in_flight && p_link == m_active_link &&
+             m_state > state::connected_to_ap &&
+             m_read_state == read_state::until_sequence) {
+    // Abort the command being issued for the ongoing request
+    m_read_state = read_state::complete;
+    m_next_state = state::connected_to_ap;
+  }
+
+  // After a timeout the connection is in an unknown state, and one that was
+  // idle for too long has likely been closed by the server
+  bool reusable = connected_to(link, p_request) && !answering &&
+                  link.m_datagrams == nullptr &&
+                  link.m_state != state::timeout &&
+                  !expired(link.m_last_activity, m_timeouts.keep_alive_idle);
+
+  if (link.m_connection_open && (in_flight || !reusable)) {
+    link.m_state = state::closing_previous_connection;
+  } else if (link.m_connection_open) {
+    link.m_state = state::preparing_request;
+  } else {
+    link.m_state = state::connecting_to_server;
+  }
+
+  if (leaving_passthrough) {
+    m_passthrough_outcome = link.m_state;
+    if (m_state == state::leaving_passthrough) {
+      m_next_state = link.m_state;
+    }
+  }
+
+  link.m_request = p_request;
+  link.m_sink = p_sink;
+  link.m_datagrams = nullptr;
+  link.m_finish_reported = false;
+  link.m_attempts = 0;
+  return true;
+}
+
+inline bool esp8266::open_datagram(size_t p_link,
+                                   datagram_link_t p_datagram_link,
+                                   datagram_ring& p_received)
+{
+  if (!start_request(
+        p_link,
+        { .domain = p_datagram_link.domain, .port = p_datagram_link.port },
+        nullptr)) {
+    return false;
+  }
+  auto& link = m_links[p_link];
+  link.m_datagrams = &p_received;
+  link.m_local_port = p_datagram_link.local_port;
+  return true;
+}
+
+inline bool esp8266::send_to(size_t p_link,
+                             std::span<const std::byte> p_datagram)
+{
+  if (p_link >= m_links.size() || p_datagram.size() == 0 ||
+      p_datagram.size() > maximum_transmit_packet_size) {
+    return false;
+  }
+  auto& link = m_links[p_link];
+  if (link.m_datagrams == nullptr ||
+      !(finished(link.m_state) || link.m_state == state::connected_to_ap)) {
+    return false;
+  }
+  link.m_request.send_data = p_datagram;
+  link.m_state = link.m_connection_open ? state::preparing_request
+                                        : state::connecting_to_server;
+  link.m_finish_reported = false;
+  link.m_attempts = 0;
+  return true;
+}
+
+inline bool esp8266::close_datagram(size_t p_link)
+{
+  if (p_link >= m_links.size() || m_links[p_link].m_datagrams == nullptr) {
+    return false;
+  }
+  auto& link = m_links[p_link];
+  if (!(finished(link.m_state) || link.m_state == state::connected_to_ap)) {
+    return false;
+  }
+  link.m_datagrams = nullptr;
+  link.m_state =
+    link.m_connection_open ? state::close_connection : state::complete;
+  link.m_finish_reported = false;
+  return true;
+}
+
+/// Make room in the ring of p_link for the datagram whose frame has started
+inline void esp8266::start_datagram(link_t& p_link)
+{
+  auto parts = p_link.m_datagrams->prepare(m_frame_length);
+  if (parts[0].size() + parts[1].size() != m_frame_length) {
+    // No room, the frame is discarded
+    return;
+  }
+  m_buffer_reader.new_buffer(parts[0]);
+  m_datagram_tail = parts[1];
+  m_read_state = read_state::datagram_payload;
+}
+
+inline bool esp8266::queue_request(request_t p_request)
+{
+  return enqueue(p_request, nullptr);
+}
+inline bool esp8266::queue_request(request_t p_request, body_sink& p_sink)
+{
+  return enqueue(p_request, &p_sink);
+}
+
+inline bool esp8266::enqueue(request_t p_request, body_sink* p_sink)
+{
+  p_request.compressed =
+    p_request.compressed && m_links[0].m_inflater != nullptr;
+  if (m_request_queue == nullptr || !m_request_queue->push(p_request, p_sink)) {
+    return false;
+  }
+  start_queued_request();
+  return true;
+}
+
+/// Start the request at the front of the queue once link 0 is free
+inline void esp8266::start_queued_request()
+{
+  auto& link = m_links[0];
+  bool idle =
+    link.m_finish_reported &&
+    (finished(link.m_state) || link.m_state == state::connected_to_ap);
+  if (m_request_queue == nullptr || m_request_queue->empty() || !idle) {
+    return;
+  }
+  const auto& next = (*m_request_queue)[0];
+  start_request(0, next.request, next.sink);
+  link.m_queued = true;
+}
+
+/// The queued request on p_link has been reported, move on to the next one
+inline void esp8266::finish_queued_request(link_t& p_link)
+{
+  p_link.m_queued = false;
+  m_request_queue->pop();
+  if (p_link.m_pipelined == 0) {
+    return;
+  }
+
+  if (p_link.m_state == state::complete && p_link.m_connection_open) {
+    // The response to the next request of the batch follows on the connection
+    const auto& next = (*m_request_queue)[0];
+    p_link.m_pipelined--;
+    p_link.m_queued = true;
+    p_link.m_request = next.request;
+    p_link.m_sink = next.sink;
+    begin_response(p_link);
+    p_link.m_finish_reported = false;
+    p_link.m_last_activity = now();
+    p_link.m_state = state::receiving_header;
+    return;
+  }
+
+  // The rest of the batch will not be answered
+  size_t unanswered = p_link.m_pipelined;
+  p_link.m_pipelined = 0;
+  for (size_t i = 0; i < unanswered; i++) {
+    m_request_queue->pop();
+  }
+  for (size_t i = 0; i < unanswered && m_completion_handler != nullptr; i++) {
+    m_completion_handler->finished(0, state::failure);
+  }
+}
+
+/// Remove the queued request of p_link, and those sent along with it
+inline void esp8266::drop_queued_requests(link_t& p_link)
+{
+  for (size_t i = 0; i <= p_link.m_pipelined; i++) {
+    m_request_queue->pop();
+  }
+  p_link.m_queued = false;
+  p_link.m_pipelined = 0;
+}
+
+/**
+ * @brief Append the queued requests after the one serialized for p_link that
+ * go to the same server, as long as all of them fit in a single AT+CIPSEND.
+ * Their send_data is copied into the response buffer along with them, which
+ * is only overwritten by the first response once everything has been sent.
+ */
+inline void esp8266::batch_queued_requests(link_t& p_link)
+{
+  const auto& first = p_link.m_request;
+  auto batch = p_link.m_response.first(
+    std::min(p_link.m_response.size(), maximum_transmit_packet_size));
+  size_t length = m_request_length + m_send_data.size();
+  if (first.passthrough || length > batch.size()) {
+    return;
+  }
+  std::copy(
+    m_send_data.begin(), m_send_data.end(), batch.begin() + m_request_length);
+
+  for (size_t i = 1; i < m_request_queue->size(); i++) {
+    auto next = (*m_request_queue)[i].request;
+    add_validators(next);
+    if (next.domain != first.domain || next.port != first.port ||
+        next.passthrough ||
+        p_link.m_pipelined == std::numeric_limits<uint8_t>::max()) {
+      break;
+    }
+    auto header = serialize_request(next, batch.subspan(length));
+    if (header.empty() ||
+        length + header.size() + next.send_data.size() > batch.size()) {
+      break;
+    }
+    std::copy(next.send_data.begin(),
+              next.send_data.end(),
+              batch.begin() + length + header.size());
+    length += header.size() + next.send_data.size();
+    p_link.m_pipelined++;
+  }
+
+  if (p_link.m_pipelined != 0) {
+    m_request_length = length;
+    m_send_data = {};
+  }
+}
+
+inline auto esp8266::get_status() -> state
+{
+  // The limit keeps a steady stream of bytes from holding up the caller
+  for (size_t i = 0; i < maximum_steps_per_status; i++) {
+    if (m_instrumentation != nullptr) {
+      instrumented_step();
+    } else {
+      step();
+    }
+    if (!can_progress()) {
+      break;
+    }
+  }
+
+  report_finished_links();
+
+  if (!m_multiplexed && connected()) {
+    return m_links[0].status();
+  }
+  return m_state;
+}
+
+inline bool esp8266::can_progress()
+{
+  if (m_transmitter.queued() && !m_serial.busy()) {
+    return true;
+  }
+
+  switch (m_read_state) {
+    case read_state::complete:
+      if (m_serial.busy()) {
+        // The next command waits for the last one to go out
+        return false;
+      }
+      if (m_state != state::connected_to_ap ||
+          m_next_state != state::connected_to_ap) {
+        return true;
+      }
+      // Idle, unless a request was started since the last schedule()
+      return link_ready() || idle_command_due();
+    case read_state::until_sequence:
+      return m_serial_reader.bytes_available() > 0U ||
+             (m_state == state::connected_to_ap &&
+              (link_ready() || idle_command_due()));
+    case read_state::delay:
+      return !m_transmitter.queued() && m_clock->uptime() >= m_delay_end;
+    case read_state::frame_payload:
+      if (m_frame_link < m_links.size() &&
+          awaiting_report(m_links[m_frame_link])) {
+        return false;
+      }
+      return m_serial_reader.bytes_available() > 0U;
+    default:
+      return m_serial_reader.bytes_available() > 0U;
+  }
+}
+
+inline void esp8266::report_finished_links()
+{
+  for (size_t i = 0; i < m_links.size(); i++) {
+    auto& link = m_links[i];
+    if (!link.m_finish_reported && finished(link.m_state)) {
+      link.m_finish_reported = true;
+      if (m_completion_handler != nullptr) {
+        m_completion_handler->finished(i, link.m_state);
+      }
+      if (link.m_queued) {
+        finish_queued_request(link);
+      }
+    }
+  }
+
+  start_queued_request();
+}
+
+inline void esp8266::step()
+{
+  // Start any queued writes, received bytes are handled in the meantime
+  m_transmitter.done();
+
+  if (m_state == state::reset) {
+    transition_state();
+  }
+
+  check_timeouts();
+
+  switch (m_read_state) {
+    case read_state::until_sequence:
+      if (m_commander.done()) {
+        if (m_commander.interrupt() == busy_interrupt) {
+          command_dropped();
+        } else if (m_commander.interrupt() == disconnect_interrupt) {
+          wifi_disconnected();
+        } else if (m_state == state::scanning_access_points &&
+                   m_commander.interrupt() == error_interrupt) {
+          // An access point is listed, read it then resume the search
+          m_access_points->start_line();
+          m_read_state = read_state::access_point;
+        } else if (m_state < state::connected_to_ap &&
+                   !idle_command(m_state) &&
+                   (m_commander.interrupted() || m_commander.exhausted())) {
+          m_read_state = read_state::complete;
+          phase_one_failed();
+        } else if (m_commander.interrupt() == ipd_interrupt) {
+          // A +IPD frame arrived, receive it then resume the search
+          m_integer_reader.restart();
+          m_read_state = m_multiplexed ? read_state::frame_link_id
+                                       : read_state::frame_length;
+        } else if (m_commander.interrupt() == error_interrupt) {
+          command_failed();
+        } else if (m_commander.interrupted()) {
+          link_closed(m_commander.interrupt() - closed_interrupt);
+          if (m_state == state::connected_to_ap) {
+            // Closed while idle, check whether a link now needs a command
+            m_read_state = read_state::complete;
+          }
+        } else {
+          // Issue the next command right away to keep the serial port busy
+          m_busy_retries = 0;
+          m_read_state = read_state::complete;
+          m_state = m_next_state;
+          transition_state();
+        }
+      } else if (m_state == state::connected_to_ap &&
+                 (link_ready() || idle_command_due())) {
+        // Stop listening to issue the command a link needs or one between
+        // requests
+        m_read_state = read_state::complete;
+      }
+      break;
+    case read_state::raw_response:
+      receive_response(&active_link(), std::numeric_limits<size_t>::max());
+      if (!receiving(active_link().m_state)) {
+        // Leave right away so the link never shows the outcome before the
+        // esp8266 is back in command mode
+        m_passthrough_outcome = active_link().m_state;
+        m_state = state::exiting_passthrough;
+        transition_state();
+      }
+      break;
+    case read_state::delay:
+      if (!m_transmitter.done()) {
+        // The wait (such as the guard time after "+++") starts once the
+        // queued writes have been transmitted
+        m_delay_end = m_clock->uptime() + m_delay;
+      } else if (m_clock->uptime() >= m_delay_end) {
+        m_read_state = read_state::complete;
+      }
+      break;
+    case read_state::address:
+      while (m_integer_reader.done()) {
+        auto octet = m_integer_reader.get();
+        m_integer_reader.restart();
+        m_address[m_address_octets++] = static_cast<uint8_t>(octet);
+        if (octet > 255) {
+          // Not an address, connect with the domain instead
+          m_address_octets = 0;
+          m_read_state = read_state::until_sequence;
+        } else if (m_address_octets == m_address.size()) {
+          m_dns_cache->insert(active_link().m_request.domain, m_address, now());
+          m_read_state = read_state::until_sequence;
+        }
+        if (m_read_state == read_state::until_sequence) {
+          m_looked_up = true;
+          m_commander.new_search(std::span<const std::byte>{},
+                                 to_bytes(ok_response));
+          m_next_state = state::connecting_to_server;
+          break;
+        }
+      }
+      break;
+    case read_state::station_status:
+      if (m_integer_reader.done()) {
+        // 2: has an IP address, 3: has connections, 4: connections closed,
+        // 5: not connected to an access point
+        auto status = m_integer_reader.get();
+        m_next_state = (status >= 2 && status <= 4)
+                         ? state::connected_to_ap
+                         : state::attempting_ap_connection;
+        m_commander.new_search(std::span<const std::byte>{},
+                               to_bytes(ok_response));
+        m_read_state = read_state::until_sequence;
+      }
+      break;
+    case read_state::access_point:
+      if (read_access_point_line()) {
+        read_access_point(m_access_points->line());
+      }
+      break;
+    case read_state::frame_link_id:
+      if (m_integer_reader.done()) {
+        m_frame_link = m_integer_reader.get();
+        m_integer_reader.restart();
+        m_read_state = read_state::frame_length;
+      }
+      break;
+    case read_state::frame_length:
+      if (m_integer_reader.done()) {
+        if (!m_multiplexed) {
+          m_frame_link = 0;
+        }
+        m_frame_length = m_integer_reader.get();
+        m_read_state = read_state::frame_payload;
+        if (m_frame_link < m_links.size() &&
+            m_links[m_frame_link].m_datagrams != nullptr) {
+          start_datagram(m_links[m_frame_link]);
+        }
+      }
+      break;
+    case read_state::datagram_payload:
+      if (m_buffer_reader.done() && !m_datagram_tail.empty()) {
+        // The rest of the datagram wraps around to the start of the ring
+        m_buffer_reader.new_buffer(m_datagram_tail);
+        m_datagram_tail = {};
+      }
+      if (m_datagram_tail.empty() && m_buffer_reader.done()) {
+        m_links[m_frame_link].m_datagrams->commit();
+        m_frame_length = 0;
+        finish_frame();
+      }
+      break;
+    case read_state::frame_payload: {
+      link_t* link =
+        (m_frame_link < m_links.size()) ? &m_links[m_frame_link] : nullptr;
+      m_frame_length -= receive_response(link, m_frame_length);
+      if (m_frame_length == 0) {
+        finish_frame();
+      }
+      break;
+    }
+    case read_state::complete:
+      m_state = m_next_state;
+      transition_state();
+      break;
+  }
+}
+
+inline void esp8266::instrumented_step()
+{
+  state phase = current_phase();
+  size_t received = m_serial_reader.bytes_read();
+  size_t sent = m_transmitter.bytes_written();
+  size_t resets = m_commander.resets();
+
+  step();
+
+  for (size_t i = 0; i < m_links.size(); i++) {
+    observe_link(i);
+  }
+  // Unsigned subtraction stays correct when the counters wrap around
+  received = m_serial_reader.bytes_read() - received;
+  sent = m_transmitter.bytes_written() - sent;
+  resets = m_commander.resets() - resets;
+  if (received != 0 || sent != 0) {
+    m_instrumentation->bytes_transferred(phase, received, sent);
+  }
+  if (resets != 0) {
+    m_instrumentation->matchers_reset(phase, resets);
+  }
+}
+
+inline void esp8266::observe_transition()
+{
+  if (m_state > state::connected_to_ap) {
+    observe_link(m_active_link);
+  } else if (m_state != m_observed_state) {
+    m_observed_state = m_state;
+    m_instrumentation->state_entered(0, m_state, now());
+  }
+}
+
+inline void esp8266::observe_link(size_t p_link)
+{
+  auto& link = m_links[p_link];
+  if (link.m_state != link.m_observed_state) {
+    link.m_observed_state = link.m_state;
+    m_instrumentation->state_entered(p_link, link.m_state, now());
+  }
+}
+
+/// @return the state that bytes received in the current read state belong to
+inline auto esp8266::current_phase() -> state
+{
+  if (m_read_state == read_state::frame_payload &&
+      m_frame_link < m_links.size()) {
+    return m_links[m_frame_link].m_state;
+  }
+  if (m_read_state == read_state::raw_response) {
+    return active_link().m_state;
+  }
+  return m_state;
+}
+
+inline void esp8266::watch_for_link_events()
+{
+  m_commander.watch_for(ipd_interrupt, to_bytes(ipd_prefix));
+  m_commander.watch_for(error_interrupt, to_bytes(error_response));
+  m_commander.watch_for(disconnect_interrupt, to_bytes(disconnect_notice));
+  if (!m_multiplexed) {
+    m_commander.watch_for(closed_interrupt, to_bytes(closed_notice));
+    return;
+  }
+  for (size_t i = 0; i < m_links.size(); i++) {
+    m_commander.watch_for(closed_interrupt + i,
+                          to_bytes(link_closed_notices[i]));
+  }
+}
+
+inline void esp8266::finish_frame()
+{
+  if (m_state == state::connected_to_ap) {
+    // Frame arrived while idle, check whether a link now needs a command
+    m_read_state = read_state::complete;
+  } else {
+    m_read_state = read_state::until_sequence;
+  }
+}
+
+/**
+ * @brief Feed received bytes to the response parser of p_link. Body bytes are
+ * read straight into the response buffer, which the body for a sink also
+ * passes through, and only the header and chunk framing are fetched a chunk at
+ * a time.
+ *
+ * @param p_link link whose response is arriving, bytes are discarded if null
+ * or if the link is not receiving
+ * @param p_limit consume at most this many bytes
+ * @return size_t number of bytes consumed
+ */
+inline size_t esp8266::receive_response(link_t* p_link, size_t p_limit)
+{
+  size_t consumed = 0;
+
+  while (consumed < p_limit && m_serial_reader.bytes_available() > 0U) {
+    size_t limit = p_limit - consumed;
+
+    if (p_link != nullptr && awaiting_report(*p_link)) {
+      // The rest belongs to the next pipelined response
+      break;
+    }
+    if (p_link == nullptr || !receiving(p_link->m_state)) {
+      if (m_passthrough) {
+        // Whatever follows the response is not part of any frame
+        break;
+      }
+      consumed += m_serial_reader.fetch(limit).size();
+      continue;
+    }
+
+    auto& parser = p_link->m_parser;
+    auto destination = body_destination(
+      *p_link, std::min(limit, parser.body_bytes_expected()));
+
+    if (!destination.empty()) {
+      auto received = m_serial_reader.read(destination);
+      consumed += received.size();
+      parser.skip_body(received.size());
+      cache_body(*p_link, received);
+      if (p_link->m_sink != nullptr) {
+        p_link->m_sink->write(received);
+      }
+      p_link->m_response_position += received.size();
+    } else {
+      auto chunk = m_serial_reader.fetch(limit);
+      consumed += chunk.size();
+      while (!chunk.empty() && receiving(p_link->m_state)) {
+        if (!write_body(*p_link, parser.parse(chunk))) {
+          fail_link(*p_link);
+        }
+        update_link(*p_link);
+      }
+      if (awaiting_report(*p_link)) {
+        m_serial_reader.unread(chunk);
+        consumed -= chunk.size();
+      }
+    }
+
+    update_link(*p_link);
+  }
+
+  if (consumed != 0 && p_link != nullptr) {
+    p_link->m_last_activity = now();
+  }
+  return consumed;
+}
+
+inline void esp8266::command_failed()
+{
+  if (m_state == state::connected_to_ap) {
+    // Not issuing a command, resume listening
+    return;
+  }
+
+  m_read_state = read_state::complete;
+  if (idle_command(m_state)) {
+    if (m_state == state::entering_sleep) {
+      // The firmware has no AT+SLEEP, stay awake from now on
+      m_sleep_mode = sleep_mode::none;
+      m_asleep = false;
+    }
+    phase_one_failed();
+    return;
+  }
+  auto& link = active_link();
+  if (m_state == state::resolving_domain ||
+      m_state == state::connecting_to_server) {
+    retry_connect(link, state::failure);
+    return;
+  }
+  if (needs_command(m_state)) {
+    // AT+CIPCLOSE fails if the server already closed the connection
+    link.m_connection_open = false;
+    return;
+  }
+  m_next_state = link.m_connection_open ? state::close_connection_failure
+                                        : state::failure;
+}
+
+/// The esp8266 was busy and dropped the command, send it again shortly
+inline void esp8266::command_dropped()
+{
+  notify(event::busy);
+  if (m_state == state::connected_to_ap) {
+    // Not issuing a command, resume listening
+    return;
+  }
+  // States that read an answer after their command must send it again
+  m_reading_answer = false;
+  if (++m_busy_retries > m_timeouts.retries) {
+    m_busy_retries = 0;
+    command_timed_out();
+    return;
+  }
+  m_next_state = m_state;
+  delay(busy_retry_delay);
+}
+
+/**
+ * @brief The access point connection dropped. Every connection is gone with
+ * it, so the requests in progress fail and the access point is joined again
+ * right away rather than after the requests time out.
+ */
+inline void esp8266::wifi_disconnected()
+{
+  for (auto& link : m_links) {
+    link.m_connection_open = false;
+    if (!finished(link.m_state) && link.m_state != state::connected_to_ap) {
+      link.m_state = state::failure;
+    }
+  }
+  m_join_attempts = 0;
+  if (m_access_points != nullptr) {
+    m_access_points->forget_signal();
+  }
+  m_read_state = read_state::complete;
+  m_state = state::attempting_ap_connection;
+  m_next_state = state::attempting_ap_connection;
+  notify(event::wifi_disconnected);
+}
+
+inline void esp8266::check_timeouts()
+{
+  if (m_clock == nullptr) {
+    return;
+  }
+
+  if (m_read_state == read_state::until_sequence &&
+      expired(m_command_start, m_command_limit)) {
+    command_timed_out();
+  }
+
+  for (auto& link : m_links) {
+    bool first_byte = link.m_parser.header().header_length == 0;
+    if (receiving(link.m_state) &&
+        expired(link.m_last_activity,
+                first_byte ? m_timeouts.first_byte : m_timeouts.body)) {
+      // The connection is closed when the link is next used
+      link.m_state = state::timeout;
+      if (m_state == state::connected_to_ap) {
+        // Stop listening so schedule() looks at the links again
+        m_read_state = read_state::complete;
+      }
     }
+  }
+}
 
-    index = header_info.find("Content-Length: ");
-    if (index == std::string_view::npos) {
-      return failure_header;
-    }
+inline void esp8266::command_timed_out()
+{
+  m_read_state = read_state::complete;
+
+  if (m_state < state::connected_to_ap) {
+    phase_one_failed();
+    return;
+  }
+
+  switch (m_state) {
+    case state::resolving_domain:
+    case state::connecting_to_server:
+      retry_connect(active_link(), state::timeout);
+      break;
+    case state::closing_previous_connection:
+    case state::close_connection:
+    case state::close_connection_failure:
+    case state::leaving_passthrough:
+      // Carry on as if the esp8266 had confirmed the command
+      break;
+    default:
+      if (m_passthrough) {
+        // The esp8266 may already be in transparent transmission
+        m_passthrough_outcome = state::timeout;
+        m_next_state = state::exiting_passthrough;
+      } else {
+        m_next_state = state::timeout;
+      }
+      break;
+  }
+}
+
+inline void esp8266::phase_one_failed()
+{
+  if (m_state != state::attempting_ap_connection) {
+    m_next_state = m_failure_state;
+    return;
+  }
 
-    count = sscanf(&header_info[index],
-                   "Content-Length: %" PRIu32,
-                   &new_header.content_length);
-    if (count != 1) {
-      return failure_header;
+  if (m_join_attempts < m_timeouts.retries) {
+    m_next_state = state::attempting_ap_connection;
+    delay(backoff(m_join_attempts++));
+    if (m_instrumentation != nullptr) {
+      m_instrumentation->retried(0, m_state, m_join_attempts);
     }
+  } else if (m_access_points != nullptr) {
+    // Join the strongest known access point in range instead, a scan that
+    // fails starts over from a reset
+    m_join_attempts = 0;
+    m_scan_for_join = true;
+    m_next_state = state::scanning_access_points;
+  } else {
+    // Start over in case the esp8266 itself is what went wrong
+    m_join_attempts = 0;
+    m_next_state = state::reset;
+  }
+}
 
-    index = header_info.find(end_of_header);
-    if (index == std::string_view::npos) {
-      return failure_header;
+/**
+ * @brief Connecting p_link to its server failed, try again after a backoff,
+ * during which other links are served, or end the request in p_give_up.
+ */
+inline void esp8266::retry_connect(link_t& p_link, state p_give_up)
+{
+  m_next_state = state::connected_to_ap;
+  if (m_dns_cache != nullptr) {
+    // The cached address may be what stopped working
+    m_dns_cache->erase(p_link.m_request.domain);
+  }
+  if (p_link.m_attempts < m_timeouts.retries) {
+    p_link.m_state = state::connecting_to_server;
+    p_link.m_retry_at = now() + backoff(p_link.m_attempts++);
+    if (m_instrumentation != nullptr) {
+      m_instrumentation->retried(
+        m_active_link, state::connecting_to_server, p_link.m_attempts);
     }
+  } else {
+    p_link.m_attempts = 0;
+    p_link.m_state = p_give_up;
+  }
+}
 
-    new_header.header_length = index + end_of_header.size();
+/// @return how long the command issued in p_state may take, 0 for no limit
+inline std::chrono::milliseconds esp8266::command_limit(state p_state) const
+{
+  switch (p_state) {
+    case state::attempting_ap_connection:
+      return m_timeouts.join;
+    case state::waking_up:
+      return wake_probe_interval;
+    case state::scanning_access_points:
+      return m_access_points->options().scan;
+    case state::resolving_domain:
+    case state::connecting_to_server:
+      return m_timeouts.connect;
+    case state::preparing_segment:
+    case state::entering_passthrough:
+    case state::sending_request:
+      return m_timeouts.send;
+    case state::connected_to_ap:
+    case state::receiving_header:
+    case state::receiving_body:
+      // Waiting on responses is limited per link by check_timeouts()
+      return std::chrono::milliseconds{ 0 };
+    default:
+      return m_timeouts.command;
+  }
+}
 
-    return new_header;
+inline void esp8266::link_closed(size_t p_link)
+{
+  if (p_link >= m_links.size()) {
+    return;
   }
 
-  serial& m_serial;
-  std::span<std::byte> m_response;
-  std::string_view m_ssid;
-  std::string_view m_password;
-  command_and_find_response m_commander;
-  read_into_buffer m_reader;
-  read_integer m_integer_reader;
-  std::array<std::byte, maximum_response_packet_size> m_packet;
-  request_t m_request;
-  header_t m_header;
-  state m_state = state::reset;
-  state m_next_state = state::reset;
-  read_state m_read_state = read_state::complete;
-  int m_request_length = 0;
-  int m_response_position = 0;
-};
+  auto& link = m_links[p_link];
+  link.m_connection_open = false;
+  notify(event::connection_closed, p_link);
 
-template<size_t ResponseBufferSize = esp8266::maximum_response_packet_size>
-class static_esp8266 : public esp8266
-{
-public:
-  static_esp8266(embed::serial& p_serial,
-                 std::string_view p_ssid,
-                 std::string_view p_password)
-    : esp8266(p_serial, p_ssid, p_password, m_response_buffer)
-  {}
+  if (receiving(link.m_state)) {
+    // Ends a body that runs until the connection closes
+    link.m_parser.connection_closed();
+    update_link(link);
+  }
 
-private:
-  std::array<std::byte, ResponseBufferSize> m_response_buffer;
-};
-} // namespace embed
+  if (m_state > state::connected_to_ap && p_link == m_active_link) {
+    // The command being issued for this link finishes on its own
+    return;
+  }
 
-namespace embed {
-inline bool esp8266::driver_initialize()
-{
-  m_serial.settings().baud_rate = 115200;
-  m_serial.settings().frame_size = 8;
-  m_serial.settings().parity = serial_settings::parity::none;
-  m_serial.settings().stop = serial_settings::stop_bits::one;
-  if (!m_serial.initialize()) {
-    return false;
+  // There is nothing left to close
+  if (link.m_state == state::closing_previous_connection) {
+    link.m_state = state::connecting_to_server;
+  } else if (link.m_state == state::close_connection) {
+    link.m_state = state::complete;
+  } else if (link.m_state == state::close_connection_failure) {
+    link.m_state = state::failure;
   }
-  m_serial.flush();
-  m_state = state::reset;
-  return true;
 }
-inline void esp8266::change_access_point(std::string_view p_ssid,
-                                         std::string_view p_password)
+
+/// Read an entry of AT+CWLAP while scanning, or the answer to AT+CWJAP_CUR?
+inline void esp8266::read_access_point(std::string_view p_line)
 {
-  m_ssid = p_ssid;
-  m_password = p_password;
-  m_next_state = state::connected_to_ap;
+  m_read_state = read_state::until_sequence;
+  if (m_state == state::scanning_access_points) {
+    access_point_list::access_point found;
+    if (access_point_list::parse(p_line, found)) {
+      m_access_points->add(found);
+    }
+    // Carry on searching for the OK that ends the list
+    return;
+  }
+
+  m_access_points->read_signal(p_line);
+  m_commander.new_search(std::span<const std::byte>{}, to_bytes(ok_response));
+  m_next_state = m_access_points->signal_weak() ? state::scanning_access_points
+                                                : state::connected_to_ap;
 }
-inline bool esp8266::connected()
+
+inline bool esp8266::read_access_point_line()
 {
-  return m_state >= state::connected_to_ap;
+  for (auto chunk = m_serial_reader.fetch(); !chunk.empty();
+       chunk = m_serial_reader.fetch()) {
+    for (size_t i = 0; i < chunk.size(); i++) {
+      if (m_access_points->add_to_line(std::to_integer<char>(chunk[i]))) {
+        m_serial_reader.unread(chunk.subspan(i + 1));
+        return true;
+      }
+    }
+  }
+  return false;
 }
-inline void esp8266::request(request_t p_request)
+
+/// Join the strongest known access point found by the scan if it is worth it
+inline void esp8266::choose_access_point()
 {
-  m_request = p_request;
-  m_next_state = state::connecting_to_server;
-  transition_state();
+  bool joined = !m_scan_for_join;
+  m_scan_for_join = false;
+  m_next_state = state::connected_to_ap;
+
+  const auto* strongest = m_access_points->strongest_known();
+  if (strongest == nullptr) {
+    if (!joined) {
+      m_next_state = state::reset;
+    }
+    return;
+  }
+  if (joined && !m_access_points->worth_moving_to(*strongest)) {
+    return;
+  }
+
+  const auto* network = m_access_points->known(strongest->ssid.view());
+  m_ssid = network->ssid;
+  m_password = network->password;
+  m_join_options.bssid = m_access_points->choose(*strongest);
+  m_join_attempts = 0;
+  m_next_state = state::attempting_ap_connection;
 }
 
-inline auto esp8266::get_status() -> state
+inline void esp8266::schedule()
 {
-  if (m_state == state::reset) {
-    transition_state();
-  }
+  // Stay idle unless a link needs something
+  m_next_state = state::connected_to_ap;
 
-  switch (m_read_state) {
-    case read_state::until_sequence:
-      if (m_commander.done()) {
-        m_read_state = read_state::complete;
-      }
-      break;
-    case read_state::into_buffer:
-      if (m_reader.done()) {
-        m_read_state = read_state::complete;
+  // Round robin, starting after the link that was last given a command
+  for (size_t i = 1; i <= m_links.size(); i++) {
+    size_t id = (m_active_link + i) % m_links.size();
+    if (ready_for_command(m_links[id])) {
+      if (m_asleep) {
+        // Wake the esp8266 first, the link is looked at again once it is up
+        m_state = state::waking_up;
+        transition_state();
+        return;
       }
-      break;
-    case read_state::integer:
-      if (m_integer_reader.done()) {
-        m_read_state = read_state::complete;
-      }
-      break;
-    case read_state::complete:
-      m_state = m_next_state;
+      m_active_link = id;
+      m_state = m_links[id].m_state;
       transition_state();
-      break;
+      return;
+    }
   }
 
-  return m_state;
+  if (roaming_check_due()) {
+    if (m_asleep) {
+      m_state = state::waking_up;
+    } else {
+      m_state = m_scan_requested ? state::scanning_access_points
+                                 : state::checking_signal;
+    }
+    transition_state();
+    return;
+  }
+
+  if (should_sleep()) {
+    m_state = state::entering_sleep;
+    transition_state();
+    return;
+  }
+
+  // Nothing to send, listen for +IPD frames and unsolicited messages such as
+  // close notices and WIFI DISCONNECT
+  m_commander.new_search(std::span<const std::byte>{},
+                         std::span<const std::byte>{});
+  m_read_state = read_state::until_sequence;
 }
+
 inline void esp8266::transition_state()
 {
+  if (!m_transmitter.done()) {
+    // Each command starts with an empty transmit queue, so it always fits.
+    // Until the last one has gone out, come back on the next get_status().
+    m_next_state = m_state;
+    m_read_state = read_state::complete;
+    return;
+  }
+  if (m_state > state::connected_to_ap) {
+    active_link().m_state = m_state;
+  }
+  if (m_instrumentation != nullptr) {
+    observe_transition();
+  }
+
   switch (m_state) {
     case state::reset:
+      if (m_target_baud_rate != default_baud_rate) {
+        m_next_state = state::changing_baud_rate;
+      } else {
+        m_next_state = state::disable_echo;
+      }
+      break;
+    case state::changing_baud_rate: {
+      std::array<std::byte, 32> buffer;
+      buffer_writer command(buffer);
+      command.append("AT+UART_CUR=")
+        .append(m_target_baud_rate)
+        .append(",8,1,0,0\r\n");
+      m_transmitter.write_copy(command.written());
+      m_commander.stop_watching();
+      m_commander.watch_for(0, to_bytes(error_response));
+      m_commander.new_search(std::span<std::byte>{}, to_bytes(ok_response));
+      m_next_state = state::probing_baud_rate;
+      m_failure_state = state::disable_echo;
+      m_read_state = read_state::until_sequence;
+      break;
+    }
+    case state::probing_baud_rate:
+      // AT+UART_CUR has gone out at the old baud rate, as this transition
+      // waited for the transmit queue to empty
+      m_serial.settings().baud_rate = m_target_baud_rate;
+      if (!m_serial.initialize()) {
+        m_next_state = state::restoring_baud_rate;
+        break;
+      }
+      m_serial_reader.flush();
+      m_commander.new_search(
+        to_bytes("AT\r\n"), to_bytes(ok_response), baud_rate_probe_limit);
+      m_next_state = state::disable_echo;
+      m_failure_state = state::restoring_baud_rate;
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::restoring_baud_rate: {
+      // Entered to send the command and again once it has gone out, as it has
+      // to be sent at the old baud rate
+      if (!m_restoring_sent) {
+        // Best effort attempt to put the esp8266 back to the default baud rate
+        std::array<std::byte, 32> buffer;
+        buffer_writer command(buffer);
+        command.append("AT+UART_CUR=")
+          .append(default_baud_rate)
+          .append(",8,1,0,0\r\n");
+        m_transmitter.write_copy(command.written());
+        m_restoring_sent = true;
+        m_next_state = state::restoring_baud_rate;
+        break;
+      }
+      m_restoring_sent = false;
+      m_serial.settings().baud_rate = default_baud_rate;
+      m_serial.initialize();
+      m_serial_reader.flush();
       m_next_state = state::disable_echo;
       break;
+    }
     case state::disable_echo:
+      m_commander.stop_watching();
       m_commander.new_search(to_bytes("ATE0\r\n"), to_bytes(ok_response));
       m_next_state = state::configure_as_http_client;
+      // An unresponsive esp8266 is given another full initialization
+      m_failure_state = state::reset;
       m_read_state = read_state::until_sequence;
       break;
     case state::configure_as_http_client:
       m_commander.new_search(to_bytes("AT+CWMODE=1\r\n"),
                              to_bytes(ok_response));
-      m_next_state = state::attempting_ap_connection;
+      m_next_state =
+        m_multiplexed ? state::configure_multiplexing : state::configure_dns;
       m_read_state = read_state::until_sequence;
       break;
-    case state::attempting_ap_connection:
-      write("AT+CWJAP_CUR=\"");
-      write(m_ssid);
-      write("\",\"");
-      write(m_password);
+    case state::configure_multiplexing:
+      m_commander.new_search(to_bytes("AT+CIPMUX=1\r\n"),
+                             to_bytes(ok_response));
+      m_next_state = state::configure_dns;
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::configure_dns:
+      m_next_state = state::configure_ssl;
+      if (m_dns_primary.empty()) {
+        break;
+      }
+      // Older firmware does not have AT+CIPDNS_CUR, carry on without it
+      m_commander.watch_for(0, to_bytes(error_response));
+      m_failure_state = state::configure_ssl;
+      write("AT+CIPDNS_CUR=1,\"");
+      write(m_dns_primary);
+      if (!m_dns_secondary.empty()) {
+        write("\",\"");
+        write(m_dns_secondary);
+      }
       m_commander.new_search(to_bytes("\"\r\n"), to_bytes(ok_response));
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::configure_ssl: {
+      m_next_state = state::checking_ap_connection;
+      if (m_ssl_buffer_size == 0) {
+        break;
+      }
+      // Out of range sizes are rejected, the default size is kept then
+      m_commander.watch_for(0, to_bytes(error_response));
+      m_failure_state = state::checking_ap_connection;
+      std::array<std::byte, 24> buffer;
+      buffer_writer command(buffer);
+      command.append("AT+CIPSSLSIZE=").append(m_ssl_buffer_size);
+      m_transmitter.write_copy(command.written());
+      m_commander.new_search(to_bytes("\r\n"), to_bytes(ok_response));
+      m_read_state = read_state::until_sequence;
+      break;
+    }
+    case state::checking_ap_connection:
+      if (!m_join_options.reuse_connection) {
+        m_next_state = state::attempting_ap_connection;
+        break;
+      }
+      // Entered to send AT+CIPSTATUS and again once its answer has started
+      if (m_reading_answer) {
+        m_reading_answer = false;
+        m_integer_reader.restart();
+        m_read_state = read_state::station_status;
+        break;
+      }
+      m_commander.stop_watching();
+      m_commander.new_search(to_bytes("AT+CIPSTATUS\r\n"),
+                             to_bytes(station_status_prefix));
+      m_reading_answer = true;
+      m_next_state = state::checking_ap_connection;
+      m_failure_state = state::attempting_ap_connection;
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::attempting_ap_connection:
+      m_commander.stop_watching();
+      m_commander.watch_for(0, to_bytes(join_failed));
+      m_serial_reader.flush();
+      if (m_join_options.bssid.empty() && !m_join_options.persist &&
+          m_precomposed_join != nullptr &&
+          m_precomposed_join->first_argument == m_ssid &&
+          m_precomposed_join->second_argument == m_password) {
+        m_commander.new_search(to_bytes(m_precomposed_join->command),
+                               to_bytes(ok_response));
+      } else {
+        write(m_join_options.persist ? "AT+CWJAP_DEF=\"" : "AT+CWJAP_CUR=\"");
+        write(m_ssid);
+        write("\",\"");
+        write(m_password);
+        if (!m_join_options.bssid.empty()) {
+          write("\",\"");
+          write(m_join_options.bssid);
+        }
+        m_commander.new_search(to_bytes("\"\r\n"), to_bytes(ok_response));
+      }
+      m_next_state = state::connected_to_ap;
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::entering_sleep:
+      // Counted as asleep even if the command times out, so waking it is
+      // harmless while sleeping again right away is not
+      m_asleep = true;
+      m_commander.new_search(to_bytes(m_sleep_mode == sleep_mode::light
+                                        ? "AT+SLEEP=1\r\n"
+                                        : "AT+SLEEP=2\r\n"),
+                             to_bytes(ok_response));
+      m_next_state = state::connected_to_ap;
+      m_failure_state = state::connected_to_ap;
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::waking_up:
+      if (m_wake_probes == 0) {
+        m_wake_start = now();
+      }
+      if (m_wake_probes == wake_probe_limit) {
+        // Unresponsive, the esp8266 is woken again once initialized
+        m_wake_probes = 0;
+        m_next_state = state::reset;
+        break;
+      }
+      m_wake_probes++;
+      m_commander.new_search(to_bytes("AT\r\n"), to_bytes(ok_response));
+      m_next_state = state::leaving_sleep;
+      // Each probe the esp8266 does not answer is sent again
+      m_failure_state = state::waking_up;
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::leaving_sleep:
+      if (m_instrumentation != nullptr) {
+        m_instrumentation->woke(now() - m_wake_start, m_wake_probes);
+      }
+      m_asleep = false;
+      m_wake_probes = 0;
+      m_commander.new_search(to_bytes("AT+SLEEP=0\r\n"),
+                             to_bytes(ok_response));
       m_next_state = state::connected_to_ap;
+      m_failure_state = state::connected_to_ap;
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::checking_signal:
+      // Entered to send AT+CWJAP_CUR? and again once its answer has started
+      if (m_reading_answer) {
+        m_reading_answer = false;
+        m_access_points->start_line();
+        m_read_state = read_state::access_point;
+        break;
+      }
+      m_access_points->checked(now());
+      m_commander.new_search(to_bytes("AT+CWJAP_CUR?\r\n"),
+                             to_bytes(join_status_prefix));
+      m_reading_answer = true;
+      m_next_state = state::checking_signal;
+      m_failure_state = state::connected_to_ap;
       m_read_state = read_state::until_sequence;
       break;
+    case state::scanning_access_points:
+      m_scan_requested = false;
+      m_access_points->checked(now());
+      m_access_points->clear();
+      // The list ends with OK, each entry interrupts the search to be read
+      watch_for_link_events();
+      m_commander.watch_for(error_interrupt, to_bytes(scan_entry_prefix));
+      m_commander.new_search(to_bytes("AT+CWLAP\r\n"), to_bytes(ok_response));
+      m_next_state = state::choosing_access_point;
+      m_failure_state =
+        m_scan_for_join ? state::reset : state::connected_to_ap;
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::choosing_access_point:
+      choose_access_point();
+      notify(event::scan_complete);
+      break;
     case state::connected_to_ap:
+      m_join_attempts = 0;
+      m_scan_for_join = false;
+      watch_for_link_events();
+      schedule();
       break;
-    case state::connecting_to_server:
-      write("AT+CIPSTART=\"TCP\",\"");
-      write(m_request.domain);
-      write("\",");
-      write(m_request.port);
-      m_commander.new_search(to_bytes("\r\n"), to_bytes(ok_response));
+    case state::closing_previous_connection:
+      close_active_link(state::connecting_to_server);
+      break;
+    case state::resolving_domain:
+      // Entered to send AT+CIPDOMAIN and again once its answer has started
+      if (m_reading_answer) {
+        m_reading_answer = false;
+        m_address_octets = 0;
+        m_integer_reader.restart();
+        m_read_state = read_state::address;
+        break;
+      }
+      write("AT+CIPDOMAIN=\"");
+      write(active_link().m_request.domain);
+      m_commander.new_search(to_bytes("\"\r\n"),
+                             to_bytes(domain_address_prefix));
+      m_reading_answer = true;
+      m_next_state = state::resolving_domain;
+      m_read_state = read_state::until_sequence;
+      break;
+    case state::connecting_to_server: {
+      const auto& request = active_link().m_request;
+      const dns_cache::address_t* address = nullptr;
+      if (m_dns_cache != nullptr && !is_address(request.domain) &&
+          request.domain.size() <= dns_cache::maximum_domain_length) {
+        address = m_dns_cache->find(request.domain, now());
+        if (address == nullptr && !m_looked_up) {
+          m_reading_answer = false;
+          m_state = state::resolving_domain;
+          transition_state();
+          break;
+        }
+      }
+      m_looked_up = false;
+
+      remember_host(active_link());
       m_next_state = state::preparing_request;
       m_read_state = read_state::until_sequence;
+      bool datagram = active_link().m_datagrams != nullptr;
+      if (address == nullptr && !datagram && !request.secure &&
+          !m_multiplexed &&
+          m_precomposed_connect != nullptr &&
+          m_precomposed_connect->first_argument == request.domain &&
+          m_precomposed_connect->second_argument == request.port) {
+        m_commander.new_search(to_bytes(m_precomposed_connect->command),
+                               to_bytes(ok_response));
+        break;
+      }
+      write("AT+CIPSTART=");
+      write_link_id(true);
+      if (datagram) {
+        write("\"UDP\",\"");
+      } else {
+        write(request.secure ? "\"SSL\",\"" : "\"TCP\",\"");
+      }
+      if (address != nullptr) {
+        std::array<std::byte, 16> buffer;
+        buffer_writer text(buffer);
+        for (size_t i = 0; i < address->size(); i++) {
+          text.append(i == 0 ? "" : ".").append((*address)[i]);
+        }
+        m_transmitter.write_copy(text.written());
+      } else {
+        write(request.domain);
+      }
+      write("\",");
+      write(request.port);
+      if (datagram && !active_link().m_local_port.empty()) {
+        // Mode 0 keeps sending to the remote given here
+        write(",");
+        write(active_link().m_local_port);
+        write(",0");
+      }
+      m_commander.new_search(to_bytes("\r\n"), to_bytes(ok_response));
       break;
+    }
     case state::preparing_request: {
-      m_request_length = snprintf(reinterpret_cast<char*>(m_response.data()),
-                                  m_response.size(),
-                                  // Request
-                                  "GET %s HTTP/1.1\r\n"
-                                  // Host Field
-                                  "Host: %s:%s\r\n"
-                                  // End of header
-                                  "\r\n\r\n",
-                                  m_request.path.data(),
-                                  m_request.domain.data(),
-                                  m_request.port.data());
-
-      if (m_request_length < 0) {
-        m_next_state = state::close_connection_failure;
+      auto& link = active_link();
+      link.m_connection_open = true;
+      link.m_attempts = 0;
+      if (link.m_datagrams != nullptr) {
+        // Nothing to send right after opening the link
+        m_request_length = 0;
+        m_send_data = link.m_request.send_data;
+        m_send_offset = 0;
+        link.m_request.send_data = {};
+        m_state = m_send_data.empty() ? state::complete
+                                      : state::preparing_segment;
+        transition_state();
         break;
       }
+      begin_response(link);
+      auto request = link.m_request;
+      add_validators(request);
+      m_request_length = serialize_request(request, link.m_response).size();
+      m_send_data = link.m_request.send_data;
+      m_send_offset = 0;
+      link.m_pipelined = 0;
+      if (link.m_queued && m_request_length != 0) {
+        batch_queued_requests(link);
+      }
 
-      std::array<char, 64> buffer;
-      int cipsend_command_length = snprintf(
-        buffer.data(), buffer.size(), "AT+CIPSEND=%d\r\n", m_request_length);
-
-      if (cipsend_command_length < 0) {
+      if (m_request_length == 0) {
         m_next_state = state::close_connection_failure;
         break;
       }
 
-      write(std::string_view(buffer.data(), cipsend_command_length));
+      m_passthrough =
+        link.m_request.passthrough && !m_multiplexed && m_clock != nullptr;
+      if (m_passthrough) {
+        m_commander.new_search(to_bytes("AT+CIPMODE=1\r\n"),
+                               to_bytes(ok_response));
+        m_next_state = state::entering_passthrough;
+        m_read_state = read_state::until_sequence;
+        break;
+      }
 
-      m_commander.new_search(std::span<std::byte>{}, to_bytes(ok_response));
+      m_state = state::preparing_segment;
+      transition_state();
+      break;
+    }
+    case state::preparing_segment: {
+      size_t remaining = m_request_length +
+                         m_send_data.size() -
+                         m_send_offset;
+      std::array<std::byte, 32> buffer;
+      buffer_writer command(buffer);
+      command.append("AT+CIPSEND=");
+      if (m_multiplexed) {
+        command.append(m_active_link).append(",");
+      }
+      command
+        .append(std::min(remaining, maximum_transmit_packet_size))
+        .append("\r\n");
+      m_transmitter.write_copy(command.written());
+
+      m_commander.new_search(std::span<std::byte>{}, to_bytes(send_prompt));
       m_next_state = state::sending_request;
       m_read_state = read_state::until_sequence;
+      break;
     }
-    case state::sending_request:
-      m_commander.new_search(m_response.subspan(0, m_request_length),
-                             to_bytes("+IPD,"));
-      m_next_state = state::get_first_packet_length;
+    case state::entering_passthrough:
+      m_commander.new_search(to_bytes("AT+CIPSEND\r\n"),
+                             to_bytes(send_prompt));
+      m_next_state = state::sending_request;
       m_read_state = read_state::until_sequence;
       break;
-    case state::get_first_packet_length:
-      m_integer_reader.restart();
-      m_next_state = state::reading_first_packet;
-      m_read_state = read_state::integer;
-      break;
-    case state::reading_first_packet:
-      m_reader.new_buffer(
-        std::span{ m_packet.begin(), m_integer_reader.get() });
-      m_next_state = state::parsing_header;
-      m_read_state = read_state::into_buffer;
-      break;
-    case state::parsing_header:
-      m_header = response_header_from_string(m_packet);
-      if (!m_header.is_valid()) {
-        m_next_state = state::close_connection_failure;
+    case state::sending_request: {
+      size_t total = m_request_length + m_send_data.size();
+      if (m_passthrough) {
+        // The esp8266 splits transparent transmissions up by itself
+        auto request = request_bytes(0, total);
+        write(request[0]);
+        write(request[1]);
+        m_next_state = state::receiving_header;
         break;
-      } else if (m_header.content_length > m_response.size()) {
-        m_next_state = state::close_connection_failure;
-        break;
-      } else if (m_integer_reader.get() < maximum_response_packet_size) {
-        std::copy_n(m_packet.begin() + m_header.header_length,
-                    m_header.content_length,
-                    m_response.begin());
-        m_next_state = state::close_connection;
-      } else {
-        // Pull out contents of body from header packet
-        size_t bytes_retrieved =
-          m_integer_reader.get() - m_header.header_length;
-        std::copy_n(m_packet.begin() + m_header.header_length,
-                    bytes_retrieved,
-                    m_response.begin());
-        m_response_position = bytes_retrieved;
-        m_next_state = state::get_packet_length;
-      }
-      break;
-    case state::get_packet_length:
-      m_integer_reader.restart();
-      m_next_state = state::read_packet_into_response;
-      m_read_state = read_state::integer;
-      break;
-    case state::read_packet_into_response:
-      m_reader.new_buffer(
-        std::span(m_response)
-          .subspan(m_response_position, m_integer_reader.get()));
-      m_next_state = state::get_next_packet;
-      m_read_state = read_state::into_buffer;
-      break;
-    case state::get_next_packet:
-      m_response_position += m_integer_reader.get();
-      if (m_response_position >= m_header.content_length) {
-        m_next_state = state::close_connection;
+      }
+      size_t end =
+        std::min(m_send_offset + maximum_transmit_packet_size, total);
+      auto segment = request_bytes(m_send_offset, end);
+      m_send_offset = end;
+      write(segment[0]);
+      m_commander.new_search(segment[1], to_bytes(send_ok));
+      if (m_send_offset < total) {
+        m_next_state = state::preparing_segment;
+      } else if (active_link().m_datagrams != nullptr) {
+        m_next_state = state::complete;
       } else {
-        m_next_state = state::get_packet_length;
+        m_next_state = state::receiving_header;
       }
-      break;
-    case state::close_connection:
-      m_commander.new_search(to_bytes("AT+CIPCLOSE\r\n"),
-                             to_bytes(ok_response));
-      m_next_state = state::complete;
       m_read_state = read_state::until_sequence;
       break;
-    case state::close_connection_failure:
-      m_commander.new_search(to_bytes("AT+CIPCLOSE\r\n"),
+    }
+    case state::receiving_header:
+    case state::receiving_body:
+      if (m_state == state::receiving_header) {
+        // The first byte timeout starts once the request has been sent
+        active_link().m_last_activity = now();
+      }
+      if (m_passthrough) {
+        m_read_state = read_state::raw_response;
+        break;
+      }
+      // The command phase of the active link is over
+      m_state = state::connected_to_ap;
+      transition_state();
+      break;
+    case state::exiting_passthrough:
+      write("+++");
+      m_next_state = state::leaving_passthrough;
+      delay(passthrough_guard_time);
+      break;
+    case state::leaving_passthrough:
+      m_passthrough = false;
+      m_serial_reader.flush();
+      m_commander.new_search(to_bytes("AT+CIPMODE=0\r\n"),
                              to_bytes(ok_response));
-      m_next_state = state::failure;
+      m_next_state = m_passthrough_outcome;
       m_read_state = read_state::until_sequence;
       break;
     case state::complete:
-      break;
     case state::failure:
+    case state::timeout:
+      // The command phase of the active link is over
+      m_state = state::connected_to_ap;
+      transition_state();
+      break;
+    case state::close_connection:
+      close_active_link(state::complete);
+      break;
+    case state::close_connection_failure:
+      close_active_link(state::failure);
       break;
   }
+
+  m_commander.watch_for(busy_interrupt, to_bytes(busy_notice));
+  m_command_start = now();
+  m_command_limit = command_limit(m_state);
+}
+
+inline std::span<std::byte> esp8266::serialize_request(
+  const request_t& p_request,
+  std::span<std::byte> p_buffer)
+{
+  buffer_writer request(p_buffer);
+  // Request
+  request.append(to_string(p_request.method))
+    .append(" ")
+    .append(p_request.path)
+    .append(" HTTP/1.1\r\n");
+  // Host Field
+  request.append("Host: ")
+    .append(p_request.domain)
+    .append(":")
+    .append(p_request.port)
+    .append("\r\n");
+  // Connection Field
+  if (p_request.keep_alive) {
+    request.append("Connection: keep-alive\r\n");
+  }
+  // Accept-Encoding Field
+  if (p_request.compressed) {
+    request.append("Accept-Encoding: gzip, deflate\r\n");
+  }
+  // Conditional Fields
+  if (!p_request.if_none_match.empty()) {
+    request.append("If-None-Match: ")
+      .append(p_request.if_none_match)
+      .append("\r\n");
+  }
+  if (!p_request.if_modified_since.empty()) {
+    request.append("If-Modified-Since: ")
+      .append(p_request.if_modified_since)
+      .append("\r\n");
+  }
+  // Content Length Field, the body itself is sent from send_data
+  if (!p_request.send_data.empty() ||
+      p_request.method == http_method::POST ||
+      p_request.method == http_method::PUT ||
+      p_request.method == http_method::PATCH) {
+    request.append("Content-Length: ")
+      .append(p_request.send_data.size())
+      .append("\r\n");
+  }
+  // End of header
+  request.append("\r\n");
+
+  if (request.overflowed()) {
+    return {};
+  }
+  return request.written();
 }
 
 inline std::string_view esp8266::to_string(http_method p_method)
@@ -685,5 +4193,6 @@ inline std::string_view esp8266::to_string(http_method p_method)
     case http_method::PATCH:
       return "PATCH";
   }
+  return "GET";
 }
 } // namespace embed
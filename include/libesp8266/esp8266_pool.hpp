@@ -0,0 +1,213 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "esp8266.hpp"
+
+namespace embed {
+
+/**
+ * @brief Spreads requests over several esp8266 modules, each on its own serial
+ * port, so that as many requests are in progress at once as there are links
+ * across the modules. Requests wait in a queue until a link of a module that
+ * has joined its access point is free, trying the modules in turn.
+ *
+ * The pool makes requests on every link of its modules, which must not be
+ * used for anything else while it does.
+ *
+ * @tparam ModuleCount number of modules
+ * @tparam QueueCapacity most requests waiting for a free link at once
+ */
+template<size_t ModuleCount, size_t QueueCapacity = 8>
+class esp8266_pool
+{
+public:
+  using state = esp8266::state;
+  using request_t = esp8266::request_t;
+
+  static_assert(ModuleCount != 0, "A pool needs at least one module");
+
+  /**
+   * @brief Notified when a request made by the pool finishes
+   *
+   */
+  class completion_handler
+  {
+  public:
+    /**
+     * @brief Called from poll() once a request has finished. Read the
+     * response with module(p_module).response(p_link), it stays valid until
+     * this returns.
+     *
+     * @param p_module index of the module the request was made on
+     * @param p_link link ID on the module
+     * @param p_state `complete`, `failure` or `timeout`
+     */
+    virtual void finished(size_t p_module, size_t p_link, state p_state) = 0;
+    virtual ~completion_handler() = default;
+  };
+
+  /**
+   * @param p_modules drivers of the modules, must outlive the pool
+   */
+  explicit esp8266_pool(std::array<esp8266*, ModuleCount> p_modules)
+    : m_modules{ p_modules }
+  {}
+
+  /**
+   * @brief Initialize every module. Modules that fail to initialize are left
+   * out, as they never join their access point.
+   *
+   * @return false if any module failed to initialize
+   */
+  bool initialize()
+  {
+    bool success = true;
+    for (auto* module : m_modules) {
+      success = module->initialize() && success;
+    }
+    return success;
+  }
+
+  /// @param p_handler notified as requests finish, must outlive the pool
+  void on_completion(completion_handler& p_handler)
+  {
+    m_completion_handler = &p_handler;
+  }
+
+  /// @return false if the queue is full
+  bool queue_request(request_t p_request)
+  {
+    return m_queue.push(p_request, nullptr);
+  }
+
+  /**
+   * @param p_sink receives the body, must stay valid until the request has
+   * finished
+   * @return false if the queue is full
+   */
+  bool queue_request(request_t p_request, body_sink& p_sink)
+  {
+    return m_queue.push(p_request, &p_sink);
+  }
+
+  /**
+   * @brief Progress every module once, report finished requests and hand
+   * waiting requests to free links. Call this in place of get_status() on the
+   * modules.
+   */
+  void poll()
+  {
+    for (size_t i = 0; i < ModuleCount; i++) {
+      m_modules[i]->get_status();
+      report_finished(i);
+    }
+    dispatch();
+  }
+
+  /**
+   * @return true if poll() cannot make progress until something happens on
+   * the serial port of a module, see esp8266::waiting()
+   */
+  bool waiting()
+  {
+    for (auto* module : m_modules) {
+      if (!module->waiting()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// @return number of requests waiting for a free link
+  size_t queued() const { return m_queue.size(); }
+
+  /// @return number of requests in progress on the modules
+  size_t in_flight() const
+  {
+    size_t count = 0;
+    for (auto busy : m_busy_links) {
+      for (; busy != 0; busy &= static_cast<uint8_t>(busy - 1)) {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  /// @return the driver of module p_module
+  esp8266& module(size_t p_module) { return *m_modules[p_module]; }
+
+private:
+  static bool finished(state p_state)
+  {
+    return p_state == state::complete || p_state == state::failure ||
+           p_state == state::timeout;
+  }
+
+  void report_finished(size_t p_module)
+  {
+    auto& module = *m_modules[p_module];
+    for (size_t link = 0; link < module.link_count(); link++) {
+      auto bit = static_cast<uint8_t>(1U << link);
+      auto status = module.get_status(link);
+      if ((m_busy_links[p_module] & bit) == 0 || !finished(status)) {
+        continue;
+      }
+      m_busy_links[p_module] &= static_cast<uint8_t>(~bit);
+      if (m_completion_handler != nullptr) {
+        m_completion_handler->finished(p_module, link, status);
+      }
+    }
+  }
+
+  /// Start waiting requests on free links, trying the modules in turn
+  void dispatch()
+  {
+    while (!m_queue.empty()) {
+      size_t link = 0;
+      size_t module = 0;
+      if (!find_free_link(module, link)) {
+        return;
+      }
+      const auto& next = m_queue[0];
+      if (next.sink != nullptr) {
+        m_modules[module]->request(link, next.request, *next.sink);
+      } else {
+        m_modules[module]->request(link, next.request);
+      }
+      m_queue.pop();
+      m_busy_links[module] |= static_cast<uint8_t>(1U << link);
+      m_next_module = (module + 1) % ModuleCount;
+    }
+  }
+
+  bool find_free_link(size_t& p_module, size_t& p_link)
+  {
+    for (size_t i = 0; i < ModuleCount; i++) {
+      size_t id = (m_next_module + i) % ModuleCount;
+      auto& module = *m_modules[id];
+      if (!module.connected()) {
+        continue;
+      }
+      for (size_t link = 0; link < module.link_count(); link++) {
+        if ((m_busy_links[id] & (1U << link)) == 0) {
+          p_module = id;
+          p_link = link;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  std::array<esp8266*, ModuleCount> m_modules;
+  /// Links of each module with a request made by the pool in progress
+  std::array<uint8_t, ModuleCount> m_busy_links{};
+  static_request_queue<QueueCapacity> m_queue;
+  completion_handler* m_completion_handler = nullptr;
+  /// Module tried first for the next request
+  size_t m_next_module = 0;
+};
+} // namespace embed
@@ -0,0 +1,627 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <string_view>
+
+namespace embed {
+
+/**
+ * @brief Parse a decimal integer from the start of p_text
+ *
+ * @param p_text text starting with the integer
+ * @param p_integer set to the parsed value on success
+ * @return true if p_text starts with an integer that fits in p_integer
+ */
+template<std::integral Integer>
+bool from_decimal(std::string_view p_text, Integer& p_integer)
+{
+  auto result =
+    std::from_chars(p_text.data(), p_text.data() + p_text.size(), p_integer);
+  return result.ec == std::errc{};
+}
+
+/**
+ * @brief Parse a hexadecimal integer, without a "0x" prefix, from the start of
+ * p_text, such as the size of a chunk
+ *
+ * @param p_text text starting with the integer
+ * @param p_integer set to the parsed value on success
+ * @return true if p_text starts with an integer that fits in p_integer
+ */
+template<std::integral Integer>
+bool from_hex(std::string_view p_text, Integer& p_integer)
+{
+  auto result = std::from_chars(
+    p_text.data(), p_text.data() + p_text.size(), p_integer, 16);
+  return result.ec == std::errc{};
+}
+
+/**
+ * @brief Compare two ASCII strings without regard to case
+ */
+constexpr bool equal_ignoring_case(std::string_view p_left,
+                                   std::string_view p_right)
+{
+  constexpr auto lower = [](char p_character) {
+    if (p_character >= 'A' && p_character <= 'Z') {
+      return static_cast<char>(p_character - 'A' + 'a');
+    }
+    return p_character;
+  };
+
+  return std::equal(p_left.begin(),
+                    p_left.end(),
+                    p_right.begin(),
+                    p_right.end(),
+                    [lower](char p_first, char p_second) {
+                      return lower(p_first) == lower(p_second);
+                    });
+}
+
+/**
+ * @brief @return true if p_text contains p_word without regard to case
+ */
+constexpr bool contains_ignoring_case(std::string_view p_text,
+                                      std::string_view p_word)
+{
+  for (size_t i = 0; i + p_word.size() <= p_text.size(); i++) {
+    if (equal_ignoring_case(p_text.substr(i, p_word.size()), p_word)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Fixed capacity copy of a header field value
+ *
+ * @tparam Capacity maximum number of characters stored
+ */
+template<size_t Capacity>
+class field_value
+{
+public:
+  /**
+   * @brief Store p_value, or nothing if p_value does not fit, since a cut off
+   * value (such as an ETag) would be wrong rather than just shorter.
+   *
+   * @return true if p_value was stored
+   */
+  constexpr bool assign(std::string_view p_value)
+  {
+    if (p_value.size() > Capacity) {
+      m_length = 0;
+      return false;
+    }
+    std::copy(p_value.begin(), p_value.end(), m_value.begin());
+    m_length = p_value.size();
+    return true;
+  }
+
+  constexpr std::string_view view() const
+  {
+    return std::string_view(m_value.data(), m_length);
+  }
+
+  constexpr bool empty() const { return m_length == 0; }
+
+private:
+  std::array<char, Capacity> m_value{};
+  size_t m_length = 0;
+};
+
+/**
+ * @brief Copies of the header fields of a response, indexed by a hash of
+ * their name so that any field, such as Date or a custom one, is found
+ * without scanning the header again. Names are matched without regard to
+ * case. Fields are kept in a caller provided buffer, a field that does not
+ * fit is left out.
+ *
+ */
+class header_index
+{
+public:
+  /// Where a field is held in the buffer, the value follows the name
+  struct field
+  {
+    uint32_t hash = 0;
+    uint16_t offset = 0;
+    uint16_t name_length = 0;
+    uint16_t value_length = 0;
+  };
+
+  /**
+   * @param p_buffer holds the names and values of the fields
+   * @param p_fields one entry for each field kept, at most 255
+   * @param p_slots hash table of indices into p_fields, should have at least
+   * twice as many slots as p_fields has entries
+   */
+  header_index(std::span<char> p_buffer,
+               std::span<field> p_fields,
+               std::span<uint8_t> p_slots)
+    : m_buffer{ p_buffer }
+    , m_fields{ p_fields.first(std::min<size_t>(p_fields.size(), 255)) }
+    , m_slots{ p_slots }
+  {}
+
+  /// Forget every field, done by the parser as a new response begins
+  void clear()
+  {
+    std::fill(m_slots.begin(), m_slots.end(), uint8_t{ 0 });
+    m_count = 0;
+    m_used = 0;
+    m_overflowed = false;
+  }
+
+  /**
+   * @brief Keep a copy of a field
+   *
+   * @return false if the buffer, the fields or the slots are full
+   */
+  bool add(std::string_view p_name, std::string_view p_value)
+  {
+    size_t length = p_name.size() + p_value.size();
+    if (m_count == m_fields.size() || m_count + 1 >= m_slots.size() ||
+        length > m_buffer.size() - m_used) {
+      m_overflowed = true;
+      return false;
+    }
+
+    auto hash = hash_name(p_name);
+    size_t slot = hash % m_slots.size();
+    while (m_slots[slot] != 0) {
+      slot = (slot + 1) % m_slots.size();
+    }
+    std::copy(p_name.begin(), p_name.end(), m_buffer.begin() + m_used);
+    std::copy(p_value.begin(),
+              p_value.end(),
+              m_buffer.begin() + m_used + p_name.size());
+    m_fields[m_count] = field{ .hash = hash,
+                               .offset = static_cast<uint16_t>(m_used),
+                               .name_length =
+                                 static_cast<uint16_t>(p_name.size()),
+                               .value_length =
+                                 static_cast<uint16_t>(p_value.size()) };
+    m_used += length;
+    m_count++;
+    m_slots[slot] = static_cast<uint8_t>(m_count);
+    return true;
+  }
+
+  /**
+   * @return the value of the first field named p_name, or a null
+   * string_view if the response has no such field
+   */
+  std::string_view find(std::string_view p_name) const
+  {
+    if (m_slots.empty()) {
+      return {};
+    }
+    auto hash = hash_name(p_name);
+    for (size_t slot = hash % m_slots.size(); m_slots[slot] != 0;
+         slot = (slot + 1) % m_slots.size()) {
+      const auto& candidate = m_fields[m_slots[slot] - 1U];
+      if (candidate.hash == hash &&
+          equal_ignoring_case(name(candidate), p_name)) {
+        return value(candidate);
+      }
+    }
+    return {};
+  }
+
+  /// @return true if the response has a field named p_name
+  bool contains(std::string_view p_name) const
+  {
+    return find(p_name).data() != nullptr;
+  }
+
+  /// @return number of fields kept, in the order they were received
+  size_t size() const { return m_count; }
+
+  /// @return name of field p_index, counting in the order received
+  std::string_view name(size_t p_index) const
+  {
+    return name(m_fields[p_index]);
+  }
+
+  /// @return value of field p_index, counting in the order received
+  std::string_view value(size_t p_index) const
+  {
+    return value(m_fields[p_index]);
+  }
+
+  /// @return true if a field of the response was left out for lack of room
+  bool overflowed() const { return m_overflowed; }
+
+  /// @return FNV-1a hash of p_name in lower case
+  static constexpr uint32_t hash_name(std::string_view p_name)
+  {
+    uint32_t hash = 2166136261U;
+    for (char character : p_name) {
+      if (character >= 'A' && character <= 'Z') {
+        character = static_cast<char>(character - 'A' + 'a');
+      }
+      hash = (hash ^ static_cast<uint8_t>(character)) * 16777619U;
+    }
+    return hash;
+  }
+
+private:
+  std::string_view name(const field& p_field) const
+  {
+    return std::string_view(m_buffer.data() + p_field.offset,
+                            p_field.name_length);
+  }
+
+  std::string_view value(const field& p_field) const
+  {
+    return std::string_view(
+      m_buffer.data() + p_field.offset + p_field.name_length,
+      p_field.value_length);
+  }
+
+  std::span<char> m_buffer;
+  std::span<field> m_fields;
+  std::span<uint8_t> m_slots;
+  size_t m_count = 0;
+  size_t m_used = 0;
+  bool m_overflowed = false;
+};
+
+/**
+ * @brief header_index that owns its storage
+ *
+ * @tparam Fields most fields kept per response
+ * @tparam BufferSize bytes for the names and values of the fields
+ */
+template<size_t Fields = 16, size_t BufferSize = 512>
+class static_header_index : public header_index
+{
+public:
+  static_assert(Fields < 255, "At most 254 fields can be indexed");
+  static_assert(BufferSize <= std::numeric_limits<uint16_t>::max(),
+                "Field offsets are 16 bits");
+
+  static_header_index()
+    : header_index(m_buffer, m_fields, m_slots)
+  {}
+
+private:
+  std::array<char, BufferSize> m_buffer{};
+  std::array<field, Fields> m_fields{};
+  std::array<uint8_t, Fields * 2> m_slots{};
+};
+
+/**
+ * @brief The parts of an http response header that the driver keeps.
+ *
+ */
+struct http_header
+{
+  uint32_t status_code = 0;
+  /// Size of the body, only meaningful if has_content_length is true
+  size_t content_length = 0;
+  /// Number of bytes in the status line and header fields
+  size_t header_length = 0;
+  /// A Content-Length field was received
+  bool has_content_length = false;
+  /// The body uses "Transfer-Encoding: chunked"
+  bool chunked = false;
+  /// The server will close the connection after this response
+  bool connection_close = false;
+  /// Seconds from the Retry-After field, 0 if absent or given as a date
+  uint32_t retry_after = 0;
+  field_value<48> content_type;
+  /// Coding the body was compressed with, such as "gzip", empty if none
+  field_value<16> content_encoding;
+  field_value<48> etag;
+  field_value<32> last_modified;
+
+  bool is_valid() { return status_code != 0 && header_length != 0; }
+};
+
+/**
+ * @brief Resumable http/1.1 response parser. Bytes can be given to parse() in
+ * pieces of any size, including a single byte, so a header can be split across
+ * any number of +IPD frames. Only one header line is buffered at a time.
+ *
+ * Bodies delimited by Content-Length, by chunked transfer encoding or by the
+ * server closing the connection are supported. The body is returned from
+ * parse() as spans of the input, so it is never copied by the parser.
+ *
+ */
+class http_response_parser
+{
+public:
+  /// Header lines longer than this are cut off and their value ignored
+  static constexpr size_t maximum_line_length = 96;
+
+  enum class stage : uint8_t
+  {
+    status_line,
+    header_fields,
+    body,
+    chunk_size,
+    chunk_data,
+    chunk_data_end,
+    trailer,
+    complete,
+    failure,
+  };
+
+  /**
+   * @brief Get ready to parse a new response
+   *
+   * @param p_expect_body false if the response cannot have a body, such as the
+   * response to a HEAD request.
+   */
+  void reset(bool p_expect_body = true)
+  {
+    m_header = {};
+    if (m_index != nullptr) {
+      m_index->clear();
+    }
+    m_stage = stage::status_line;
+    m_line_length = 0;
+    m_line_truncated = false;
+    m_expect_body = p_expect_body;
+    m_until_close = false;
+    m_remaining = 0;
+  }
+
+  /**
+   * @brief Consume bytes from the front of p_input until a piece of the body is
+   * found or p_input is used up.
+   *
+   * @param p_input bytes received from the server, advanced past the bytes
+   * that were consumed.
+   * @return std::span<const std::byte> piece of the body, a subspan of the
+   * original p_input, empty if none was found. At the end of the header it
+   * returns early with an empty span, leaving the body in p_input.
+   */
+  std::span<const std::byte> parse(std::span<const std::byte>& p_input)
+  {
+    while (!p_input.empty()) {
+      switch (m_stage) {
+        case stage::body:
+        case stage::chunk_data: {
+          size_t count = std::min(p_input.size(), m_remaining);
+          auto body = p_input.first(count);
+          p_input = p_input.subspan(count);
+          skip_body(count);
+          return body;
+        }
+        case stage::complete:
+        case stage::failure:
+          return {};
+        default: {
+          bool in_header = m_stage == stage::status_line ||
+                           m_stage == stage::header_fields;
+          if (in_header) {
+            m_header.header_length++;
+          }
+          parse_line_byte(std::to_integer<char>(p_input[0]));
+          p_input = p_input.subspan(1);
+          if (in_header && header_complete()) {
+            // Let the caller look at the header before any of the body
+            return {};
+          }
+          break;
+        }
+      }
+    }
+    return {};
+  }
+
+  /**
+   * @return size_t number of body bytes that can be consumed without going
+   * through parse(), for example by reading them straight into a buffer. 0 if
+   * the parser is not in the middle of the body.
+   */
+  size_t body_bytes_expected() const
+  {
+    if (m_stage == stage::body || m_stage == stage::chunk_data) {
+      return m_remaining;
+    }
+    return 0;
+  }
+
+  /**
+   * @brief Account for body bytes that were consumed without parse()
+   *
+   * @param p_count bytes consumed, at most body_bytes_expected()
+   */
+  void skip_body(size_t p_count)
+  {
+    if (m_until_close) {
+      return;
+    }
+    m_remaining -= std::min(p_count, m_remaining);
+    if (m_remaining == 0) {
+      m_stage = (m_stage == stage::chunk_data) ? stage::chunk_data_end
+                                               : stage::complete;
+    }
+  }
+
+  /**
+   * @brief The server closed the connection. This completes a body that runs
+   * until the connection closes, otherwise the response is incomplete.
+   */
+  void connection_closed()
+  {
+    if (m_stage == stage::body && m_until_close) {
+      m_stage = stage::complete;
+    } else if (m_stage != stage::complete) {
+      m_stage = stage::failure;
+    }
+  }
+
+  /**
+   * @brief Also keep every header field of the response in p_index, which is
+   * cleared as each response begins. Fields longer than maximum_line_length
+   * are left out.
+   *
+   * @param p_index where fields are kept, null to stop indexing
+   */
+  void set_header_index(header_index* p_index) { m_index = p_index; }
+
+  stage current_stage() const { return m_stage; }
+  bool header_complete() const { return m_stage > stage::header_fields; }
+  const http_header& header() const { return m_header; }
+
+private:
+  void parse_line_byte(char p_character)
+  {
+    if (p_character != '\n') {
+      if (m_line_length < m_line.size()) {
+        m_line[m_line_length++] = p_character;
+      } else {
+        m_line_truncated = true;
+      }
+      return;
+    }
+
+    std::string_view line(m_line.data(), m_line_length);
+    if (line.ends_with('\r')) {
+      line.remove_suffix(1);
+    }
+    parse_line(line);
+    m_line_length = 0;
+    m_line_truncated = false;
+  }
+
+  void parse_line(std::string_view p_line)
+  {
+    switch (m_stage) {
+      case stage::status_line:
+        parse_status_line(p_line);
+        break;
+      case stage::header_fields:
+        if (p_line.empty()) {
+          end_of_header();
+        } else if (!m_line_truncated) {
+          parse_field(p_line);
+        }
+        break;
+      case stage::chunk_size: {
+        size_t size = 0;
+        if (!from_hex(p_line, size)) {
+          m_stage = stage::failure;
+        } else if (size == 0) {
+          m_stage = stage::trailer;
+        } else {
+          m_remaining = size;
+          m_stage = stage::chunk_data;
+        }
+        break;
+      }
+      case stage::chunk_data_end:
+        m_stage = p_line.empty() ? stage::chunk_size : stage::failure;
+        break;
+      case stage::trailer:
+        if (p_line.empty()) {
+          m_stage = stage::complete;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  void parse_status_line(std::string_view p_line)
+  {
+    constexpr std::string_view version = "HTTP/1.";
+    size_t space = p_line.find(' ');
+    if (!p_line.starts_with(version) || space == std::string_view::npos ||
+        !from_decimal(p_line.substr(space + 1), m_header.status_code) ||
+        m_header.status_code < 100 || m_header.status_code > 999) {
+      m_stage = stage::failure;
+      return;
+    }
+    m_stage = stage::header_fields;
+  }
+
+  void parse_field(std::string_view p_line)
+  {
+    size_t colon = p_line.find(':');
+    if (colon == std::string_view::npos) {
+      return;
+    }
+
+    std::string_view name = p_line.substr(0, colon);
+    std::string_view value = p_line.substr(colon + 1);
+    while (value.starts_with(' ') || value.starts_with('\t')) {
+      value.remove_prefix(1);
+    }
+    while (value.ends_with(' ') || value.ends_with('\t')) {
+      value.remove_suffix(1);
+    }
+
+    if (m_index != nullptr) {
+      m_index->add(name, value);
+    }
+
+    if (equal_ignoring_case(name, "Content-Length")) {
+      m_header.has_content_length =
+        from_decimal(value, m_header.content_length);
+    } else if (equal_ignoring_case(name, "Transfer-Encoding")) {
+      m_header.chunked = contains_ignoring_case(value, "chunked");
+    } else if (equal_ignoring_case(name, "Connection")) {
+      m_header.connection_close = contains_ignoring_case(value, "close");
+    } else if (equal_ignoring_case(name, "Content-Type")) {
+      m_header.content_type.assign(value);
+    } else if (equal_ignoring_case(name, "Content-Encoding")) {
+      m_header.content_encoding.assign(value);
+    } else if (equal_ignoring_case(name, "ETag")) {
+      m_header.etag.assign(value);
+    } else if (equal_ignoring_case(name, "Last-Modified")) {
+      m_header.last_modified.assign(value);
+    } else if (equal_ignoring_case(name, "Retry-After")) {
+      from_decimal(value, m_header.retry_after);
+    }
+  }
+
+  void end_of_header()
+  {
+    const auto status = m_header.status_code;
+
+    if (status >= 100 && status < 200 && status != 101) {
+      // Interim response (such as 100 Continue), the real one follows
+      bool expect_body = m_expect_body;
+      reset(expect_body);
+      return;
+    }
+
+    if (!m_expect_body || status == 204 || status == 304 || status == 101) {
+      m_stage = stage::complete;
+    } else if (m_header.chunked) {
+      m_stage = stage::chunk_size;
+    } else if (m_header.has_content_length) {
+      m_remaining = m_header.content_length;
+      m_stage = (m_remaining == 0) ? stage::complete : stage::body;
+    } else {
+      // Body runs until the server closes the connection
+      m_until_close = true;
+      m_remaining = std::numeric_limits<size_t>::max();
+      m_stage = stage::body;
+    }
+  }
+
+  http_header m_header;
+  header_index* m_index = nullptr;
+  std::array<char, maximum_line_length> m_line{};
+  size_t m_line_length = 0;
+  size_t m_remaining = 0;
+  stage m_stage = stage::status_line;
+  bool m_line_truncated = false;
+  bool m_expect_body = true;
+  bool m_until_close = false;
+};
+} // namespace embed
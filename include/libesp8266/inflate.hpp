@@ -0,0 +1,760 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace embed {
+
+/**
+ * @brief Streaming decoder for deflate compressed data (RFC 1951), either raw
+ * or wrapped in a zlib (RFC 1950) or gzip (RFC 1952) header and trailer, as
+ * sent by servers for "Content-Encoding: deflate" and "gzip".
+ *
+ * Compressed bytes can be given to feed() in pieces of any size, including a
+ * single byte. Decoded bytes are kept in a caller provided window, which back
+ * references copy from, and are handed on from there, so nothing but the
+ * window and around 1 KB of code tables is needed.
+ *
+ * The window size must be a power of two. Compressors refer back up to 32 KB
+ * unless configured otherwise, such as zlib's windowBits, and a stream that
+ * refers back further than the window fails rather than decoding wrong bytes.
+ *
+ */
+class inflater
+{
+public:
+  /// Wrapper around the deflate data
+  enum class format : uint8_t
+  {
+    /// Deflate data without header or trailer
+    raw,
+    /// zlib header and Adler-32 trailer
+    zlib,
+    /// gzip header and CRC-32 trailer, the first member only
+    gzip,
+    /// zlib, or raw if there is no zlib header, since servers send either for
+    /// "Content-Encoding: deflate"
+    deflate,
+  };
+
+  enum class status : uint8_t
+  {
+    /// Waiting for more compressed bytes
+    more,
+    /// The end of the compressed data was reached and its checksum matched
+    finished,
+    /// The data is corrupt or refers back further than the window
+    failure,
+  };
+
+  /**
+   * @param p_window history of decoded bytes, its size must be a power of two
+   */
+  explicit inflater(std::span<std::byte> p_window)
+    : m_window{ p_window }
+  {
+    reset(format::raw);
+  }
+
+  /// Get ready to decode a new stream in p_format
+  void reset(format p_format)
+  {
+    m_format = p_format;
+    m_stage = (p_format == format::gzip)  ? stage::gzip_header
+              : (p_format == format::raw) ? stage::block_header
+                                          : stage::zlib_header;
+    m_bits = 0;
+    m_bit_count = 0;
+    m_final = false;
+    m_position = 0;
+    m_flushed = 0;
+    m_total_out = 0;
+    m_check = (p_format == format::gzip) ? 0xffff'ffffU : 1U;
+  }
+
+  /**
+   * @brief Decode the next piece of compressed data
+   *
+   * @param p_input compressed bytes, all of which are consumed. Bytes after
+   * the end of the compressed data are ignored.
+   * @param p_output called with each piece of decoded data, which is only
+   * valid for the duration of the call
+   * @return status of the stream after p_input
+   */
+  template<typename Output>
+  status feed(std::span<const std::byte> p_input, Output&& p_output)
+  {
+    while (true) {
+      bool flush = decode(p_input);
+      auto decoded = std::span<const std::byte>(m_window).subspan(
+        m_flushed, m_position - m_flushed);
+      if (!decoded.empty()) {
+        update_check(decoded);
+        p_output(decoded);
+      }
+      m_flushed = m_position;
+      if (!flush) {
+        return current_status();
+      }
+      if (m_position == m_window.size()) {
+        m_position = 0;
+        m_flushed = 0;
+      }
+    }
+  }
+
+  status current_status() const
+  {
+    if (m_stage == stage::finished) {
+      return status::finished;
+    }
+    return (m_stage == stage::failure) ? status::failure : status::more;
+  }
+
+  /// @return number of decoded bytes so far
+  size_t total_out() const { return m_total_out; }
+
+private:
+  enum class stage : uint8_t
+  {
+    gzip_header,
+    gzip_fields,
+    gzip_skip,
+    gzip_string,
+    zlib_header,
+    block_header,
+    stored_length,
+    stored_data,
+    table_sizes,
+    code_length_lengths,
+    code_lengths,
+    block_data,
+    distance,
+    copy,
+    checksum,
+    stream_size,
+    finished,
+    failure,
+  };
+
+  /// Canonical Huffman code, decoded one bit at a time as in zlib's puff
+  template<size_t Symbols>
+  struct huffman
+  {
+    /// Number of codes of each length
+    std::array<uint16_t, 16> counts{};
+    /// Symbols ordered by their code
+    std::array<uint16_t, Symbols> symbols{};
+  };
+
+  static constexpr size_t maximum_code_length = 15;
+  static constexpr int need_bits = -1;
+  static constexpr int invalid_code = -2;
+
+  static constexpr uint8_t gzip_header_crc = 0x02;
+  static constexpr uint8_t gzip_extra = 0x04;
+  static constexpr uint8_t gzip_name = 0x08;
+  static constexpr uint8_t gzip_comment = 0x10;
+
+  static constexpr std::array<uint16_t, 29> length_base{
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+  };
+  static constexpr std::array<uint8_t, 29> length_extra{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+  };
+  static constexpr std::array<uint16_t, 30> distance_base{
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577
+  };
+  static constexpr std::array<uint8_t, 30> distance_extra{
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+  };
+  /// Order in which the code lengths of the code length code are sent
+  static constexpr std::array<uint8_t, 19> code_length_order{
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+  };
+  /// CRC-32 of each nibble, for a table 16 times smaller than a byte table
+  static constexpr std::array<uint32_t, 16> crc_table{
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+    0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+  };
+
+  /// Move whole bytes from p_input into the bit buffer
+  void fill(std::span<const std::byte>& p_input)
+  {
+    size_t count = 0;
+    while (m_bit_count <= 56 && count < p_input.size()) {
+      m_bits |= std::to_integer<uint64_t>(p_input[count++]) << m_bit_count;
+      m_bit_count += 8;
+    }
+    p_input = p_input.subspan(count);
+  }
+
+  bool have(unsigned p_count) const { return m_bit_count >= p_count; }
+
+  void consume(unsigned p_count)
+  {
+    m_bits >>= p_count;
+    m_bit_count -= p_count;
+  }
+
+  uint32_t bits(unsigned p_count)
+  {
+    auto value =
+      static_cast<uint32_t>(m_bits & ((uint64_t{ 1 } << p_count) - 1U));
+    consume(p_count);
+    return value;
+  }
+
+  /// Skip to the next byte boundary of the compressed data
+  void align() { consume(m_bit_count % 8); }
+
+  void put(uint8_t p_byte)
+  {
+    m_window[m_position++] = static_cast<std::byte>(p_byte);
+    m_total_out++;
+  }
+
+  bool window_full() const { return m_position == m_window.size(); }
+
+  /**
+   * @return int symbol of the code at the front of the bit buffer, whose
+   * length is put in p_length, need_bits if the bit buffer does not hold all
+   * of it, or invalid_code
+   */
+  template<size_t Symbols>
+  int decode_symbol(const huffman<Symbols>& p_code, unsigned& p_length) const
+  {
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (unsigned length = 1; length <= maximum_code_length; length++) {
+      if (length > m_bit_count) {
+        return need_bits;
+      }
+      code |= static_cast<int>((m_bits >> (length - 1)) & 1U);
+      int count = p_code.counts[length];
+      if (code - first < count) {
+        p_length = length;
+        return p_code.symbols[static_cast<size_t>(index + code - first)];
+      }
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+    }
+    return invalid_code;
+  }
+
+  /**
+   * @brief Build the code for symbols with the code lengths in p_lengths,
+   * where 0 means the symbol is not used
+   *
+   * @return false if more codes are given a length than fit in it
+   */
+  template<size_t Symbols>
+  static bool build(huffman<Symbols>& p_code,
+                    std::span<const uint8_t> p_lengths)
+  {
+    p_code.counts.fill(0);
+    for (auto length : p_lengths) {
+      p_code.counts[length]++;
+    }
+    p_code.counts[0] = 0;
+
+    int left = 1;
+    std::array<uint16_t, maximum_code_length + 1> offsets{};
+    for (size_t length = 1; length <= maximum_code_length; length++) {
+      left = (left << 1) - p_code.counts[length];
+      if (left < 0) {
+        return false;
+      }
+      offsets[length] =
+        static_cast<uint16_t>(offsets[length - 1] + p_code.counts[length - 1]);
+    }
+
+    for (size_t symbol = 0; symbol < p_lengths.size(); symbol++) {
+      if (p_lengths[symbol] != 0) {
+        p_code.symbols[offsets[p_lengths[symbol]]++] =
+          static_cast<uint16_t>(symbol);
+      }
+    }
+    return true;
+  }
+
+  void build_fixed_codes()
+  {
+    auto lengths = std::span(m_lengths);
+    std::fill(lengths.begin(), lengths.begin() + 144, 8);
+    std::fill(lengths.begin() + 144, lengths.begin() + 256, 9);
+    std::fill(lengths.begin() + 256, lengths.begin() + 280, 7);
+    std::fill(lengths.begin() + 280, lengths.begin() + 288, 8);
+    build(m_literals, lengths.first(288));
+    std::fill(lengths.begin(), lengths.begin() + 30, 5);
+    build(m_distances, lengths.first(30));
+  }
+
+  /// @return true if the decoded bytes must be flushed before the trailer
+  bool end_of_block()
+  {
+    if (!m_final) {
+      m_stage = stage::block_header;
+      return false;
+    }
+    align();
+    m_stage = (m_format == format::raw) ? stage::finished : stage::checksum;
+    return true;
+  }
+
+  void update_check(std::span<const std::byte> p_data)
+  {
+    if (m_format == format::gzip) {
+      for (auto byte : p_data) {
+        m_check ^= std::to_integer<uint32_t>(byte);
+        m_check = (m_check >> 4) ^ crc_table[m_check & 0xfU];
+        m_check = (m_check >> 4) ^ crc_table[m_check & 0xfU];
+      }
+      return;
+    }
+    if (m_format == format::zlib) {
+      // Largest run of bytes whose sums cannot overflow before the modulo
+      constexpr size_t run = 5552;
+      constexpr uint32_t modulus = 65521;
+      uint32_t low = m_check & 0xffffU;
+      uint32_t high = m_check >> 16;
+      while (!p_data.empty()) {
+        auto part = p_data.first(std::min(run, p_data.size()));
+        p_data = p_data.subspan(part.size());
+        for (auto byte : part) {
+          low += std::to_integer<uint32_t>(byte);
+          high += low;
+        }
+        low %= modulus;
+        high %= modulus;
+      }
+      m_check = (high << 16) | low;
+    }
+  }
+
+  /**
+   * @brief Decode from p_input into the window until p_input is used up, the
+   * window is full or the deflate data ends
+   *
+   * @return true if the window must be flushed before decoding further
+   */
+  bool decode(std::span<const std::byte>& p_input)
+  {
+    while (true) {
+      fill(p_input);
+      switch (m_stage) {
+        case stage::gzip_header: {
+          if (!have(32)) {
+            return false;
+          }
+          uint32_t magic = bits(16);
+          uint32_t method = bits(8);
+          m_gzip_flags = static_cast<uint8_t>(bits(8));
+          if (magic != 0x8b1fU || method != 8 || (m_gzip_flags & 0xe0U) != 0) {
+            m_stage = stage::failure;
+            return false;
+          }
+          // Modification time, extra flags and operating system
+          m_count = 6;
+          m_stage = stage::gzip_skip;
+          break;
+        }
+        case stage::gzip_fields:
+          if ((m_gzip_flags & gzip_extra) != 0) {
+            if (!have(16)) {
+              return false;
+            }
+            m_gzip_flags &= ~gzip_extra;
+            m_count = bits(16);
+            m_stage = stage::gzip_skip;
+          } else if ((m_gzip_flags & (gzip_name | gzip_comment)) != 0) {
+            m_gzip_flags &= (m_gzip_flags & gzip_name)
+                              ? ~gzip_name
+                              : static_cast<uint8_t>(~gzip_comment);
+            m_stage = stage::gzip_string;
+          } else if ((m_gzip_flags & gzip_header_crc) != 0) {
+            m_gzip_flags &= ~gzip_header_crc;
+            m_count = 2;
+            m_stage = stage::gzip_skip;
+          } else {
+            m_stage = stage::block_header;
+          }
+          break;
+        case stage::gzip_skip:
+          while (m_count != 0 && have(8)) {
+            consume(8);
+            m_count--;
+            fill(p_input);
+          }
+          if (m_count != 0) {
+            return false;
+          }
+          m_stage = stage::gzip_fields;
+          break;
+        case stage::gzip_string: {
+          // File name or comment, skipped up to its terminating zero
+          bool ended = false;
+          while (!ended && have(8)) {
+            ended = bits(8) == 0;
+            fill(p_input);
+          }
+          if (!ended) {
+            return false;
+          }
+          m_stage = stage::gzip_fields;
+          break;
+        }
+        case stage::zlib_header: {
+          if (!have(16)) {
+            return false;
+          }
+          auto header = static_cast<uint32_t>(m_bits & 0xffffU);
+          uint32_t method = header & 0xffU;
+          bool wrapped = (method & 0x0fU) == 8 && (method >> 4) <= 7 &&
+                         (((method << 8) | (header >> 8)) % 31) == 0;
+          if (wrapped && (header & 0x2000U) == 0) {
+            consume(16);
+            m_format = format::zlib;
+            m_stage = stage::block_header;
+          } else if (!wrapped && m_format == format::deflate) {
+            m_format = format::raw;
+            m_stage = stage::block_header;
+          } else {
+            // Preset dictionaries are not supported
+            m_stage = stage::failure;
+            return false;
+          }
+          break;
+        }
+        case stage::block_header: {
+          if (!have(3)) {
+            return false;
+          }
+          m_final = bits(1) != 0;
+          uint32_t type = bits(2);
+          if (type == 0) {
+            align();
+            m_stage = stage::stored_length;
+          } else if (type == 1) {
+            build_fixed_codes();
+            m_stage = stage::block_data;
+          } else if (type == 2) {
+            m_stage = stage::table_sizes;
+          } else {
+            m_stage = stage::failure;
+            return false;
+          }
+          break;
+        }
+        case stage::stored_length: {
+          if (!have(32)) {
+            return false;
+          }
+          uint32_t length = bits(16);
+          if (length != (~bits(16) & 0xffffU)) {
+            m_stage = stage::failure;
+            return false;
+          }
+          m_count = length;
+          m_stage = stage::stored_data;
+          break;
+        }
+        case stage::stored_data: {
+          while (m_count != 0 && have(8) && !window_full()) {
+            put(static_cast<uint8_t>(bits(8)));
+            m_count--;
+          }
+          size_t length = std::min({ static_cast<size_t>(m_count),
+                                     p_input.size(),
+                                     m_window.size() - m_position });
+          if (length != 0) {
+            std::copy_n(p_input.begin(), length, m_window.begin() + m_position);
+            p_input = p_input.subspan(length);
+            m_position += length;
+            m_total_out += length;
+            m_count -= static_cast<uint32_t>(length);
+          }
+          if (m_count != 0) {
+            return window_full();
+          }
+          if (end_of_block()) {
+            return true;
+          }
+          break;
+        }
+        case stage::table_sizes:
+          if (!have(14)) {
+            return false;
+          }
+          m_literal_count = static_cast<uint16_t>(bits(5) + 257);
+          m_distance_count = static_cast<uint16_t>(bits(5) + 1);
+          m_code_length_count = static_cast<uint16_t>(bits(4) + 4);
+          if (m_literal_count > 286 || m_distance_count > 30) {
+            m_stage = stage::failure;
+            return false;
+          }
+          m_lengths.fill(0);
+          m_count = 0;
+          m_stage = stage::code_length_lengths;
+          break;
+        case stage::code_length_lengths:
+          while (m_count < m_code_length_count && have(3)) {
+            m_lengths[code_length_order[m_count++]] =
+              static_cast<uint8_t>(bits(3));
+            fill(p_input);
+          }
+          if (m_count < m_code_length_count) {
+            return false;
+          }
+          // The code length code is kept in the distance code until the
+          // distance code itself is known
+          if (!build(m_distances, std::span(m_lengths).first(19))) {
+            m_stage = stage::failure;
+            return false;
+          }
+          m_lengths.fill(0);
+          m_count = 0;
+          m_stage = stage::code_lengths;
+          break;
+        case stage::code_lengths:
+          if (!read_code_lengths(p_input)) {
+            return false;
+          }
+          break;
+        case stage::block_data:
+          while (!window_full()) {
+            unsigned length = 0;
+            int symbol = decode_symbol(m_literals, length);
+            if (symbol == need_bits) {
+              return false;
+            }
+            if (symbol < 256) {
+              if (symbol < 0) {
+                m_stage = stage::failure;
+                return false;
+              }
+              consume(length);
+              put(static_cast<uint8_t>(symbol));
+              fill(p_input);
+              continue;
+            }
+            if (symbol == 256) {
+              consume(length);
+              if (end_of_block()) {
+                return true;
+              }
+              break;
+            }
+            auto index = static_cast<size_t>(symbol - 257);
+            if (index >= length_base.size()) {
+              m_stage = stage::failure;
+              return false;
+            }
+            if (!have(length + length_extra[index])) {
+              return false;
+            }
+            consume(length);
+            m_copy_length = length_base[index] + bits(length_extra[index]);
+            m_stage = stage::distance;
+            break;
+          }
+          if (m_stage == stage::block_data) {
+            return true;
+          }
+          break;
+        case stage::distance: {
+          unsigned length = 0;
+          int symbol = decode_symbol(m_distances, length);
+          if (symbol == need_bits) {
+            return false;
+          }
+          auto index = static_cast<size_t>(symbol);
+          if (symbol < 0 || index >= distance_base.size()) {
+            m_stage = stage::failure;
+            return false;
+          }
+          if (!have(length + distance_extra[index])) {
+            return false;
+          }
+          consume(length);
+          m_copy_distance =
+            distance_base[index] + bits(distance_extra[index]);
+          if (m_copy_distance > m_window.size() ||
+              m_copy_distance > m_total_out) {
+            m_stage = stage::failure;
+            return false;
+          }
+          m_stage = stage::copy;
+          break;
+        }
+        case stage::copy: {
+          const size_t mask = m_window.size() - 1;
+          while (m_copy_length != 0 && !window_full()) {
+            m_window[m_position] =
+              m_window[(m_position - m_copy_distance) & mask];
+            m_position++;
+            m_total_out++;
+            m_copy_length--;
+          }
+          if (m_copy_length != 0) {
+            return true;
+          }
+          m_stage = stage::block_data;
+          break;
+        }
+        case stage::checksum: {
+          if (!have(32)) {
+            return false;
+          }
+          uint32_t expected = bits(32);
+          uint32_t check = m_check;
+          if (m_format == format::gzip) {
+            check = ~check;
+          } else {
+            // Adler-32 is sent most significant byte first
+            expected = (expected >> 24) | ((expected >> 8) & 0xff00U) |
+                       ((expected << 8) & 0xff'0000U) | (expected << 24);
+          }
+          if (check != expected) {
+            m_stage = stage::failure;
+            return false;
+          }
+          m_stage = (m_format == format::gzip) ? stage::stream_size
+                                               : stage::finished;
+          break;
+        }
+        case stage::stream_size:
+          if (!have(32)) {
+            return false;
+          }
+          m_stage = (bits(32) == static_cast<uint32_t>(m_total_out))
+                      ? stage::finished
+                      : stage::failure;
+          return false;
+        case stage::finished:
+        case stage::failure:
+          return false;
+      }
+    }
+  }
+
+  /**
+   * @brief Read the code lengths of the literal/length and distance codes,
+   * sent with the code length code, and build both codes once all are read
+   *
+   * @return false to wait for more input or on failure
+   */
+  bool read_code_lengths(std::span<const std::byte>& p_input)
+  {
+    const size_t total = m_literal_count + m_distance_count;
+    while (m_count < total) {
+      fill(p_input);
+      unsigned length = 0;
+      int symbol = decode_symbol(m_distances, length);
+      if (symbol == need_bits) {
+        return false;
+      }
+      if (symbol < 0) {
+        m_stage = stage::failure;
+        return false;
+      }
+      if (symbol < 16) {
+        consume(length);
+        m_lengths[m_count++] = static_cast<uint8_t>(symbol);
+        continue;
+      }
+
+      // Repeat the previous length, or zero, 3 to 138 times
+      unsigned extra = (symbol == 16) ? 2 : (symbol == 17) ? 3 : 7;
+      if (!have(length + extra)) {
+        return false;
+      }
+      consume(length);
+      uint32_t repeat = bits(extra) + ((symbol == 18) ? 11 : 3);
+      uint8_t value = 0;
+      if (symbol == 16) {
+        if (m_count == 0) {
+          m_stage = stage::failure;
+          return false;
+        }
+        value = m_lengths[m_count - 1];
+      }
+      if (m_count + repeat > total) {
+        m_stage = stage::failure;
+        return false;
+      }
+      std::fill_n(m_lengths.begin() + m_count, repeat, value);
+      m_count += repeat;
+    }
+
+    auto lengths = std::span<const uint8_t>(m_lengths);
+    if (m_lengths[256] == 0 ||
+        !build(m_literals, lengths.first(m_literal_count)) ||
+        !build(m_distances,
+               lengths.subspan(m_literal_count, m_distance_count))) {
+      m_stage = stage::failure;
+      return false;
+    }
+    m_stage = stage::block_data;
+    return true;
+  }
+
+  std::span<std::byte> m_window;
+  huffman<288> m_literals;
+  huffman<32> m_distances;
+  /// Code lengths of the literal/length and distance codes being read
+  std::array<uint8_t, 320> m_lengths{};
+  uint64_t m_bits = 0;
+  /// Next position in the window to decode into
+  size_t m_position = 0;
+  /// Decoded bytes before this position in the window have been handed on
+  size_t m_flushed = 0;
+  size_t m_total_out = 0;
+  /// Running CRC-32 or Adler-32 of the decoded bytes
+  uint32_t m_check = 0;
+  /// Bytes left to skip or copy, or code lengths read so far
+  uint32_t m_count = 0;
+  uint32_t m_copy_length = 0;
+  uint32_t m_copy_distance = 0;
+  uint16_t m_literal_count = 0;
+  uint16_t m_distance_count = 0;
+  uint16_t m_code_length_count = 0;
+  unsigned m_bit_count = 0;
+  stage m_stage = stage::block_header;
+  format m_format = format::raw;
+  uint8_t m_gzip_flags = 0;
+  bool m_final = false;
+};
+
+/**
+ * @brief inflater with its window
+ *
+ * @tparam WindowSize size of the history kept, a power of two. 32768 decodes
+ * any stream.
+ */
+template<size_t WindowSize = 32768>
+class static_inflater : public inflater
+{
+public:
+  static_assert(WindowSize != 0 && (WindowSize & (WindowSize - 1)) == 0,
+                "The window of an inflater must be a power of two");
+
+  static_inflater()
+    : inflater(m_storage)
+  {}
+
+private:
+  std::array<std::byte, WindowSize> m_storage{};
+};
+} // namespace embed
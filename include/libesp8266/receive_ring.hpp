@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace embed {
+
+/**
+ * @brief Lock-free single producer, single consumer ring of received bytes.
+ * The receive interrupt, or the half and full transfer callbacks of a DMA
+ * channel, add bytes as they arrive and the driver reads them in place, so no
+ * byte is lost while get_status() is not being called.
+ *
+ * Only push(), writable() and produced() may be called from the producer and
+ * only the other functions from the driver. The capacity must be a power of
+ * two.
+ *
+ */
+class receive_ring
+{
+public:
+  /// @param p_storage memory for the bytes, its size a power of two
+  explicit receive_ring(std::span<std::byte> p_storage)
+    : m_storage{ p_storage }
+    , m_mask{ p_storage.size() - 1 }
+  {}
+
+  /**
+   * @brief Producer: add p_data, bytes that do not fit are counted as overruns
+   *
+   * @return size_t number of bytes added
+   */
+  size_t push(std::span<const std::byte> p_data)
+  {
+    size_t added = 0;
+    while (added < p_data.size()) {
+      auto space = writable();
+      if (space.empty()) {
+        break;
+      }
+      size_t count = std::min(space.size(), p_data.size() - added);
+      std::copy_n(p_data.begin() + added, count, space.begin());
+      produced(count);
+      added += count;
+    }
+    if (added < p_data.size()) {
+      // Only the producer writes the count, so no read-modify-write is needed
+      m_overruns.store(
+        m_overruns.load(std::memory_order_relaxed) +
+          static_cast<uint32_t>(p_data.size() - added),
+        std::memory_order_relaxed);
+    }
+    return added;
+  }
+
+  /**
+   * @brief Producer: free space directly after the newest byte, for a DMA
+   * transfer or a copy to fill before calling produced()
+   */
+  std::span<std::byte> writable()
+  {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_acquire);
+    size_t free = m_storage.size() - (head - tail);
+    if (free == 0) {
+      return {};
+    }
+    size_t index = head & m_mask;
+    return m_storage.subspan(index, std::min(free, m_storage.size() - index));
+  }
+
+  /// Producer: hand p_count bytes written to writable() over to the driver
+  void produced(size_t p_count)
+  {
+    m_head.store(m_head.load(std::memory_order_relaxed) + p_count,
+                 std::memory_order_release);
+  }
+
+  /// @return size_t number of bytes waiting to be read
+  size_t size() const
+  {
+    return m_head.load(std::memory_order_acquire) -
+           m_tail.load(std::memory_order_relaxed);
+  }
+
+  /// @return the oldest bytes that are stored one after another
+  std::span<const std::byte> readable() const
+  {
+    size_t head = m_head.load(std::memory_order_acquire);
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (head == tail) {
+      return {};
+    }
+    size_t index = tail & m_mask;
+    return std::span<const std::byte>(m_storage)
+      .subspan(index, std::min(head - tail, m_storage.size() - index));
+  }
+
+  /// Free the p_count oldest bytes for the producer to reuse
+  void consume(size_t p_count)
+  {
+    m_tail.store(m_tail.load(std::memory_order_relaxed) + p_count,
+                 std::memory_order_release);
+  }
+
+  /// Discard every byte waiting to be read
+  void clear()
+  {
+    m_tail.store(m_head.load(std::memory_order_acquire),
+                 std::memory_order_release);
+  }
+
+  /// @return bytes dropped by push() as the ring was full, wrapping around
+  uint32_t overruns() const
+  {
+    return m_overruns.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::span<std::byte> m_storage;
+  size_t m_mask;
+  /// Counts of bytes ever added and ever consumed, wrapping around together
+  std::atomic<size_t> m_head = 0;
+  std::atomic<size_t> m_tail = 0;
+  std::atomic<uint32_t> m_overruns = 0;
+};
+
+/**
+ * @brief receive_ring that owns its storage
+ *
+ * @tparam Size capacity in bytes, a power of two
+ */
+template<size_t Size = 1024>
+class static_receive_ring : public receive_ring
+{
+public:
+  static_assert(Size != 0 && (Size & (Size - 1)) == 0,
+                "The capacity of a receive_ring must be a power of two");
+
+  static_receive_ring()
+    : receive_ring(m_storage)
+  {}
+
+private:
+  std::array<std::byte, Size> m_storage{};
+};
+} // namespace embed
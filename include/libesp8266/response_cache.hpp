@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#include "http_response_parser.hpp"
+
+namespace embed {
+
+/**
+ * @brief Remembers the ETag and Last-Modified of responses, along with their
+ * body, so that polling a resource that has not changed only costs a "304 Not
+ * Modified" response. The least recently used entry makes room for a new one.
+ *
+ */
+class response_cache
+{
+public:
+  /// Longest "domain:port/path" that can be cached
+  static constexpr size_t maximum_key_length = 96;
+
+  struct entry
+  {
+    std::array<char, maximum_key_length> key{};
+    uint8_t key_length = 0;
+    field_value<48> etag;
+    field_value<32> last_modified;
+    /// Where the body is kept, empty to keep only the validators
+    std::span<std::byte> body;
+    size_t body_length = 0;
+    /// Ordering of uses for finding the least recently used entry, 0 if empty
+    uint32_t last_used = 0;
+
+    std::span<const std::byte> cached_body() const
+    {
+      return std::span<const std::byte>(body).first(body_length);
+    }
+  };
+
+  /// @param p_entries storage for the cached responses and their bodies
+  explicit response_cache(std::span<entry> p_entries)
+    : m_entries{ p_entries }
+  {}
+
+  /**
+   * @param p_domain server of the resource
+   * @param p_port port of the server
+   * @param p_path path of the resource
+   * @return entry* cached response for the resource, null if there is none
+   */
+  entry* find(std::string_view p_domain,
+              std::string_view p_port,
+              std::string_view p_path)
+  {
+    for (auto& cached : m_entries) {
+      if (cached.last_used != 0 && matches(cached, p_domain, p_port, p_path)) {
+        cached.last_used = ++m_uses;
+        return &cached;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief Take the entry of a resource, or the least recently used one, to
+   * store a new response for it in. The entry is empty until commit().
+   *
+   * @return entry* null if the key is too long
+   */
+  entry* claim(std::string_view p_domain,
+               std::string_view p_port,
+               std::string_view p_path)
+  {
+    size_t length = p_domain.size() + 1 + p_port.size() + p_path.size();
+    if (length > maximum_key_length || m_entries.empty()) {
+      return nullptr;
+    }
+    auto* slot = find(p_domain, p_port, p_path);
+    if (slot == nullptr) {
+      slot = &*std::min_element(
+        m_entries.begin(), m_entries.end(), [](const auto& a, const auto& b) {
+          return a.last_used < b.last_used;
+        });
+    }
+    auto end = std::copy(p_domain.begin(), p_domain.end(), slot->key.begin());
+    *end++ = ':';
+    end = std::copy(p_port.begin(), p_port.end(), end);
+    std::copy(p_path.begin(), p_path.end(), end);
+    slot->key_length = static_cast<uint8_t>(length);
+    slot->body_length = 0;
+    slot->last_used = 0;
+    return slot;
+  }
+
+  /// Store the validators of p_header in p_entry, which then becomes usable
+  void commit(entry& p_entry, const http_header& p_header)
+  {
+    p_entry.etag = p_header.etag;
+    p_entry.last_modified = p_header.last_modified;
+    p_entry.last_used = ++m_uses;
+  }
+
+  /// Forget the response for a resource
+  void erase(std::string_view p_domain,
+             std::string_view p_port,
+             std::string_view p_path)
+  {
+    if (auto* cached = find(p_domain, p_port, p_path)) {
+      cached->last_used = 0;
+    }
+  }
+
+  /// @return true if p_entry holds the response for the resource
+  static bool matches(const entry& p_entry,
+                      std::string_view p_domain,
+                      std::string_view p_port,
+                      std::string_view p_path)
+  {
+    std::string_view key(p_entry.key.data(), p_entry.key_length);
+    return key.size() == p_domain.size() + 1 + p_port.size() + p_path.size() &&
+           key.starts_with(p_domain) && key[p_domain.size()] == ':' &&
+           key.substr(p_domain.size() + 1).starts_with(p_port) &&
+           key.ends_with(p_path);
+  }
+
+private:
+  std::span<entry> m_entries;
+  uint32_t m_uses = 0;
+};
+
+/**
+ * @brief response_cache that owns its entries and their bodies. Responses
+ * whose body is larger than BodySize are not cached.
+ *
+ * @tparam Capacity number of resources remembered
+ * @tparam BodySize largest body cached per resource. With 0 only the
+ * validators are kept and a 304 comes with an empty body, for applications
+ * that keep the last body themselves.
+ */
+template<size_t Capacity = 4, size_t BodySize = 512>
+class static_response_cache : public response_cache
+{
+public:
+  static_response_cache()
+    : response_cache(m_storage)
+  {
+    for (size_t i = 0; i < Capacity; i++) {
+      m_storage[i].body = m_bodies[i];
+    }
+  }
+
+private:
+  std::array<entry, Capacity> m_storage{};
+  std::array<std::array<std::byte, BodySize>, Capacity> m_bodies{};
+};
+} // namespace embed
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdio>
+#include <source_location>
+#include <string_view>
+
+/// Checks that failed so far, a test program returns non-zero if there are any
+inline int check_failures = 0;
+
+/**
+ * @brief Report p_what along with where it was checked, unless p_condition
+ * holds
+ *
+ * @return p_condition
+ */
+inline bool check(
+  bool p_condition,
+  std::string_view p_what,
+  const std::source_location& p_location = std::source_location::current())
+{
+  if (!p_condition) {
+    check_failures++;
+    printf("  %s:%u: %.*s\n",
+           p_location.file_name(),
+           static_cast<unsigned>(p_location.line()),
+           static_cast<int>(p_what.size()),
+           p_what.data());
+  }
+  return p_condition;
+}
+
+/// Run the checks of p_test and report whether they all held
+template<typename Test>
+void run(std::string_view p_name, Test p_test)
+{
+  int failures = check_failures;
+  p_test();
+  printf("%-60.*s %s\n",
+         static_cast<int>(p_name.size()),
+         p_name.data(),
+         check_failures == failures ? "ok" : "FAILED");
+}
@@ -0,0 +1,96 @@
+#include <array>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "check.hpp"
+#include "../include/libesp8266/datagram_ring.hpp"
+
+namespace {
+/// Add p_datagram the way the driver does as its frame arrives
+bool push(embed::datagram_ring& p_ring, std::string_view p_datagram)
+{
+  auto parts = p_ring.prepare(p_datagram.size());
+  if (parts[0].size() + parts[1].size() != p_datagram.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < p_datagram.size(); i++) {
+    auto& part = (i < parts[0].size()) ? parts[0] : parts[1];
+    size_t offset = (i < parts[0].size()) ? i : i - parts[0].size();
+    part[offset] = static_cast<std::byte>(p_datagram[i]);
+  }
+  p_ring.commit();
+  return true;
+}
+
+std::string pop(embed::datagram_ring& p_ring)
+{
+  std::array<std::byte, 64> buffer;
+  auto datagram = p_ring.receive(buffer);
+  return std::string(reinterpret_cast<const char*>(datagram.data()),
+                     datagram.size());
+}
+
+void oldest_first()
+{
+  embed::static_datagram_ring<64> ring;
+  check(ring.empty() && pop(ring).empty(), "starts empty");
+  check(push(ring, "one") && push(ring, "two!") && push(ring, "three"),
+        "datagrams fit");
+  check(ring.size() == 3 && ring.next_size() == 3, "sizes");
+  check(pop(ring) == "one" && pop(ring) == "two!" && pop(ring) == "three",
+        "read back whole, oldest first");
+  check(ring.empty(), "empty again");
+}
+
+/// The bytes of a datagram, or its length, continue at the start of the
+/// storage
+void wrap_around()
+{
+  embed::static_datagram_ring<16> ring;
+  check(push(ring, "aaaa") && push(ring, "bbbb"), "12 bytes used");
+  check(pop(ring) == "aaaa", "6 bytes freed at the front");
+  auto parts = ring.prepare(5);
+  check(parts[0].size() == 2 && parts[1].size() == 3,
+        "datagram is split at the end of the storage");
+  parts[0][0] = std::byte{ 'c' };
+  parts[0][1] = std::byte{ 'd' };
+  parts[1][0] = std::byte{ 'e' };
+  parts[1][1] = std::byte{ 'f' };
+  parts[1][2] = std::byte{ 'g' };
+  ring.commit();
+  check(pop(ring) == "bbbb", "datagram before it");
+  check(pop(ring) == "cdefg", "datagram is read across the end");
+  check(ring.empty(), "empty");
+
+  // The front is now at 3, so the length of the next one after a 10 byte
+  // datagram straddles the end
+  check(push(ring, "0123456789") && push(ring, "xy"), "both fit");
+  check(pop(ring) == "0123456789" && pop(ring) == "xy",
+        "length is read across the end");
+}
+
+void overflow()
+{
+  embed::static_datagram_ring<16> ring;
+  check(push(ring, "1234567890"), "12 bytes used");
+  check(!push(ring, "12345"), "7 more bytes do not fit");
+  check(ring.dropped() == 1, "dropped datagram is counted");
+  check(push(ring, "12"), "the 4 bytes left can still be used");
+  check(ring.size() == 2, "dropped datagram is not in the ring");
+  check(pop(ring) == "1234567890" && pop(ring) == "12", "kept datagrams");
+
+  std::array<std::byte, 4> small;
+  check(push(ring, "abcdefgh") &&
+          ring.receive(small).size() == small.size() && ring.empty(),
+        "a datagram longer than the destination is cut off");
+}
+} // namespace
+
+int main()
+{
+  run("datagrams are read oldest first", oldest_first);
+  run("datagrams wrap around the end of the storage", wrap_around);
+  run("datagrams that do not fit are dropped", overflow);
+  return check_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,295 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "scripted_serial.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static uint64_t cycle_count()
+{
+  return __rdtsc();
+}
+#else
+static uint64_t cycle_count()
+{
+  return 0;
+}
+#endif
+
+using state = embed::esp8266::state;
+using namespace std::chrono_literals;
+
+namespace {
+/// How often the application loop calls get_status()
+constexpr auto call_period = 50us;
+/// Simulated time after which a request counts as stuck
+constexpr auto request_limit = 60s;
+
+/// Transcript of a request captured from an esp8266 running AT firmware 1.7
+constexpr std::string_view captured_get = R"(# Startup
+> ATE0\r\n
+< ATE0\r\r\n\r\nOK\r\n
+> AT+CWMODE=1\r\n
+< \r\nOK\r\n
+> AT+CWJAP_CUR="SSID","PASSWORD"\r\n
+~ 1800
+< WIFI CONNECTED\r\n
+~ 900
+< WIFI GOT IP\r\n\r\nOK\r\n
+# GET http://example.com/
+> AT+CIPSTART="TCP","example.com",80\r\n
+~ 40
+< CONNECT\r\n\r\nOK\r\n
+> AT+CIPSEND=40\r\n
+< \r\nOK\r\n>
+> GET / HTTP/1.1\r\nHost: example.com:80\r\n\r\n
+< \r\nRecv 40 bytes\r\n\r\nSEND OK\r\n
+~ 95
+< +IPD,167:HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\n
+< Content-Length: 64\r\nConnection: keep-alive\r\n\r\n
+< <!doctype html><html><head><title>Example</title></head></html>\n
+> AT+CIPCLOSE\r\n
+< CLOSED\r\n\r\nOK\r\n
+)";
+
+struct scenario
+{
+  std::string_view name;
+  /// Size of the body the server responds with
+  size_t body_size;
+  size_t frame_size;
+  bool chunked;
+  uint32_t baud_rate;
+  /// Pause between frames, as the data trickles in from the server
+  std::chrono::microseconds frame_gap;
+};
+
+constexpr std::array scenarios{
+  scenario{ "3 KB, 1460 byte frames", 3000, 1460, false, 115200, 0us },
+  scenario{ "16 KB, 512 byte frames with gaps", 16384, 512, false, 115200,
+            2ms },
+  scenario{ "16 KB chunked at 921600 baud", 16384, 1460, true, 921600, 0us },
+};
+
+constexpr embed::esp8266::request_t benchmark_request{ .domain =
+                                                         "example.com" };
+
+std::string make_body(size_t p_size)
+{
+  std::string body(p_size, ' ');
+  for (size_t i = 0; i < body.size(); i++) {
+    body[i] = static_cast<char>('a' + i % 26);
+  }
+  return body;
+}
+
+std::string make_response(const std::string& p_body, bool p_chunked)
+{
+  std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+  if (!p_chunked) {
+    return response + "Content-Length: " + std::to_string(p_body.size()) +
+           "\r\n\r\n" + p_body;
+  }
+  response += "Transfer-Encoding: chunked\r\n\r\n";
+  for (size_t i = 0; i < p_body.size(); i += 1000) {
+    auto chunk = p_body.substr(i, 1000);
+    std::array<char, 8> size{};
+    auto end = std::to_chars(size.begin(), size.end(), chunk.size(), 16).ptr;
+    response += std::string(size.begin(), end) + "\r\n" + chunk + "\r\n";
+  }
+  return response + "0\r\n\r\n";
+}
+
+void script(scripted_serial& p_serial, const scenario& p_scenario)
+{
+  if (p_scenario.baud_rate != embed::esp8266::default_baud_rate) {
+    p_serial
+      .expect("AT+UART_CUR=" + std::to_string(p_scenario.baud_rate) +
+              ",8,1,0,0\r\n")
+      .reply("\r\nOK\r\n")
+      .expect("AT\r\n")
+      .reply("\r\nOK\r\n");
+  }
+  p_serial.expect("ATE0\r\n")
+    .reply("ATE0\r\r\n\r\nOK\r\n")
+    .expect("AT+CWMODE=1\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CWJAP_CUR=\"SSID\",\"PASSWORD\"\r\n")
+    .pause(1s)
+    .reply("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n");
+
+  std::array<std::byte, 256> buffer;
+  auto request = embed::to_string_view(
+    embed::esp8266::serialize_request(benchmark_request, buffer));
+  auto length = std::to_string(request.size());
+  p_serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .pause(40ms)
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(request)
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .pause(100ms)
+    .reply_frames(make_response(make_body(p_scenario.body_size),
+                                p_scenario.chunked),
+                  p_scenario.frame_size,
+                  -1,
+                  p_scenario.frame_gap)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+}
+
+struct measurement
+{
+  size_t calls = 0;
+  uint64_t cycles = 0;
+  std::chrono::nanoseconds wall{ 0 };
+  size_t bytes = 0;
+  bool ok = true;
+};
+
+bool finished(state p_state)
+{
+  return p_state == state::complete || p_state == state::failure ||
+         p_state == state::timeout;
+}
+
+/**
+ * @brief Run the driver against p_serial until p_done returns true for the
+ * status, timing only the calls to get_status()
+ */
+template<typename Done>
+state drive(embed::esp8266& p_esp,
+            scripted_serial& p_serial,
+            measurement& p_measurement,
+            Done p_done)
+{
+  auto limit = p_serial.now() + request_limit;
+  while (p_serial.now() < limit) {
+    auto wall_start = std::chrono::steady_clock::now();
+    auto cycle_start = cycle_count();
+    auto status = p_esp.get_status();
+    p_measurement.cycles += cycle_count() - cycle_start;
+    p_measurement.wall += std::chrono::steady_clock::now() - wall_start;
+    p_measurement.calls++;
+    if (p_done(status)) {
+      return status;
+    }
+    p_serial.advance(call_period);
+  }
+  p_measurement.ok = false;
+  return state::failure;
+}
+
+/// Connect, make a request and measure the request
+measurement run(scripted_serial& p_serial,
+                uint32_t p_baud_rate,
+                size_t p_body_size)
+{
+  embed::static_esp8266<16384> esp(p_serial, "SSID", "PASSWORD", p_baud_rate);
+  esp.set_clock(p_serial);
+  measurement connecting;
+  measurement request;
+  if (!esp.initialize()) {
+    request.ok = false;
+    return request;
+  }
+
+  drive(esp, p_serial, connecting, [](state p_state) {
+    return p_state == state::connected_to_ap;
+  });
+
+  size_t delivered = p_serial.bytes_delivered();
+  esp.request(benchmark_request);
+  auto status = drive(esp, p_serial, request, finished);
+  // Let the connection close
+  for (size_t i = 0; i < 1000 && !p_serial.finished(); i++) {
+    p_serial.advance(call_period);
+    esp.get_status();
+  }
+
+  request.bytes = p_serial.bytes_delivered() - delivered;
+  request.ok = connecting.ok && request.ok && status == state::complete &&
+               esp.response().size() == p_body_size && p_serial.finished();
+  return request;
+}
+
+void report(std::string_view p_name,
+            const measurement& p_total,
+            size_t p_iterations)
+{
+  double requests = static_cast<double>(p_iterations);
+  double bytes = static_cast<double>(p_total.bytes);
+  double nanoseconds = static_cast<double>(p_total.wall.count());
+  double cycles = static_cast<double>(p_total.cycles);
+  printf("%-36.*s %8.0f %12.0f %10.1f %9.2f %8.2f %s\n",
+         static_cast<int>(p_name.size()),
+         p_name.data(),
+         static_cast<double>(p_total.calls) / requests,
+         cycles / requests,
+         nanoseconds / requests / 1000.0,
+         cycles / bytes,
+         nanoseconds / bytes,
+         p_total.ok ? "ok" : "FAILED");
+}
+
+void accumulate(measurement& p_total, const measurement& p_run)
+{
+  p_total.calls += p_run.calls;
+  p_total.cycles += p_run.cycles;
+  p_total.wall += p_run.wall;
+  p_total.bytes += p_run.bytes;
+  p_total.ok = p_total.ok && p_run.ok;
+}
+} // namespace
+
+/**
+ * Replays scripted esp8266 sessions at their simulated baud rate and reports,
+ * per request, the get_status() calls made along with the cycles and wall time
+ * spent inside them, and the same costs per byte received from the esp8266.
+ *
+ * Usage: esp8266.benchmark [iterations]
+ * Returns non-zero if any request did not replay as scripted.
+ */
+int main(int argc, char* argv[])
+{
+  size_t iterations = 20;
+  if (argc > 1) {
+    iterations = std::max(1, std::atoi(argv[1]));
+  }
+
+  printf("%-36s %8s %12s %10s %9s %8s\n",
+         "scenario",
+         "calls",
+         "cycles",
+         "us",
+         "cyc/byte",
+         "ns/byte");
+
+  bool ok = true;
+  {
+    measurement total;
+    for (size_t i = 0; i < iterations; i++) {
+      scripted_serial serial;
+      ok = serial.load(captured_get) && ok;
+      accumulate(total, run(serial, embed::esp8266::default_baud_rate, 64));
+    }
+    report("captured GET", total, iterations);
+    ok = ok && total.ok;
+  }
+
+  for (const auto& scenario : scenarios) {
+    measurement total;
+    for (size_t i = 0; i < iterations; i++) {
+      scripted_serial serial;
+      script(serial, scenario);
+      accumulate(total, run(serial, scenario.baud_rate, scenario.body_size));
+    }
+    report(scenario.name, total, iterations);
+    ok = ok && total.ok;
+  }
+
+  return ok ? 0 : 1;
+}
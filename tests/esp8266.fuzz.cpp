@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "scripted_serial.hpp"
+
+using state = embed::esp8266::state;
+using namespace std::chrono_literals;
+
+namespace {
+/// How often the application loop calls get_status()
+constexpr auto call_period = 50us;
+/// Calls to get_status() within which a request has to have finished,
+/// counting from initialize(). Ten seconds of simulated time.
+constexpr size_t call_limit = 200000;
+
+struct scenario
+{
+  std::string_view name;
+  size_t body_size;
+  size_t frame_size;
+  bool chunked;
+  /// Make a second request over the kept alive connection
+  bool keep_alive;
+  /// Faster rates let several bytes arrive between calls to get_status()
+  uint32_t baud_rate;
+};
+
+constexpr std::array scenarios{
+  scenario{ "3 KB, 512 byte frames", 3000, 512, false, false, 115200 },
+  scenario{ "4 KB chunked at 921600 baud", 4000, 1460, true, false, 921600 },
+  scenario{ "2 x 1 KB kept alive, 97 byte frames", 1000, 97, false, true,
+            115200 },
+};
+
+struct disturbance
+{
+  std::string_view name;
+  scripted_serial::disturbances settings;
+};
+
+constexpr std::array disturbances{
+  disturbance{ "none", {} },
+  disturbance{ "chopped replies", { .chop = 50 } },
+  disturbance{ "withheld and partial reads",
+               { .withhold = 30, .partial = 50 } },
+  disturbance{ "garbage between replies", { .garbage = 30 } },
+  disturbance{ "all of the above",
+               { .chop = 30, .garbage = 20, .withhold = 20, .partial = 30 } },
+};
+
+embed::esp8266::request_t make_request(const scenario& p_scenario)
+{
+  return { .domain = "example.com", .keep_alive = p_scenario.keep_alive };
+}
+
+std::string make_body(size_t p_size, char p_first)
+{
+  std::string body(p_size, ' ');
+  for (size_t i = 0; i < body.size(); i++) {
+    body[i] = static_cast<char>(p_first + i % 26);
+  }
+  return body;
+}
+
+std::string make_response(const std::string& p_body,
+                          bool p_chunked,
+                          bool p_keep_alive)
+{
+  std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+  if (!p_keep_alive) {
+    response += "Connection: close\r\n";
+  }
+  if (!p_chunked) {
+    return response + "Content-Length: " + std::to_string(p_body.size()) +
+           "\r\n\r\n" + p_body;
+  }
+  response += "Transfer-Encoding: chunked\r\n\r\n";
+  for (size_t i = 0; i < p_body.size(); i += 1000) {
+    auto chunk = p_body.substr(i, 1000);
+    std::array<char, 8> size{};
+    auto end = std::to_chars(size.begin(), size.end(), chunk.size(), 16).ptr;
+    response += std::string(size.begin(), end) + "\r\n" + chunk + "\r\n";
+  }
+  return response + "0\r\n\r\n";
+}
+
+void script_request(scripted_serial& p_serial,
+                    const scenario& p_scenario,
+                    const std::string& p_body)
+{
+  std::array<std::byte, 256> buffer;
+  auto request = embed::to_string_view(
+    embed::esp8266::serialize_request(make_request(p_scenario), buffer));
+  auto length = std::to_string(request.size());
+  p_serial.expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(request)
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .pause(20ms)
+    .reply_frames(
+      make_response(p_body, p_scenario.chunked, p_scenario.keep_alive),
+      p_scenario.frame_size);
+}
+
+/// @return the bodies of the responses, in the order they are requested
+std::vector<std::string> script(scripted_serial& p_serial,
+                                const scenario& p_scenario)
+{
+  if (p_scenario.baud_rate != embed::esp8266::default_baud_rate) {
+    p_serial
+      .expect("AT+UART_CUR=" + std::to_string(p_scenario.baud_rate) +
+              ",8,1,0,0\r\n")
+      .reply("\r\nOK\r\n")
+      .expect("AT\r\n")
+      .reply("\r\nOK\r\n");
+  }
+  p_serial.expect("ATE0\r\n")
+    .reply("ATE0\r\r\n\r\nOK\r\n")
+    .expect("AT+CWMODE=1\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CWJAP_CUR=\"SSID\",\"PASSWORD\"\r\n")
+    .pause(100ms)
+    .reply("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .pause(10ms)
+    .reply("CONNECT\r\n\r\nOK\r\n");
+
+  std::vector<std::string> bodies{ make_body(p_scenario.body_size, 'a') };
+  script_request(p_serial, p_scenario, bodies.back());
+  if (p_scenario.keep_alive) {
+    bodies.push_back(make_body(p_scenario.body_size, 'A'));
+    script_request(p_serial, p_scenario, bodies.back());
+  } else {
+    p_serial.expect("AT+CIPCLOSE\r\n").reply("CLOSED\r\n\r\nOK\r\n");
+  }
+  return bodies;
+}
+
+bool finished(state p_state)
+{
+  return p_state == state::complete || p_state == state::failure ||
+         p_state == state::timeout;
+}
+
+struct outcome
+{
+  /// Calls to get_status() from initialize() until the last request finished
+  size_t calls = 0;
+  bool ok = false;
+};
+
+/// Connect and make the requests of p_scenario while p_serial misbehaves
+outcome run(const scenario& p_scenario,
+            const scripted_serial::disturbances& p_disturbances,
+            uint32_t p_seed)
+{
+  scripted_serial serial;
+  auto bodies = script(serial, p_scenario);
+  serial.disturb(p_disturbances, p_seed);
+
+  embed::static_esp8266<8192> esp(
+    serial, "SSID", "PASSWORD", p_scenario.baud_rate);
+  esp.set_clock(serial);
+  outcome result;
+  if (!esp.initialize()) {
+    return result;
+  }
+
+  bool ok = true;
+  bool requested = false;
+  size_t responses = 0;
+  for (; result.calls < call_limit && responses < bodies.size();
+       result.calls++) {
+    auto status = esp.get_status();
+    if (!requested && esp.connected()) {
+      esp.request(make_request(p_scenario));
+      requested = true;
+    } else if (requested && finished(status)) {
+      std::string_view response(
+        reinterpret_cast<const char*>(esp.response().data()),
+        esp.response().size());
+      ok = ok && status == state::complete && response == bodies[responses];
+      requested = false;
+      responses++;
+      continue;
+    }
+    serial.advance(call_period);
+  }
+
+  result.ok =
+    ok && responses == bodies.size() && serial.unexpected().empty();
+  return result;
+}
+
+struct summary
+{
+  std::vector<size_t> calls;
+  size_t failures = 0;
+  uint32_t first_failed_seed = 0;
+};
+
+void report(const scenario& p_scenario,
+            const disturbance& p_disturbance,
+            summary& p_summary)
+{
+  auto& calls = p_summary.calls;
+  std::sort(calls.begin(), calls.end());
+  printf("%-36.*s %-28.*s %8zu %8zu %8zu",
+         static_cast<int>(p_scenario.name.size()),
+         p_scenario.name.data(),
+         static_cast<int>(p_disturbance.name.size()),
+         p_disturbance.name.data(),
+         calls.front(),
+         calls[calls.size() / 2],
+         calls.back());
+  if (p_summary.failures == 0) {
+    printf(" ok\n");
+  } else {
+    printf(" FAILED %zu, first with seed %u\n",
+           p_summary.failures,
+           static_cast<unsigned>(p_summary.first_failed_seed));
+  }
+}
+} // namespace
+
+/**
+ * Replays scripted esp8266 sessions while the esp8266 and the serial port
+ * misbehave: replies cut at random bytes, garbage between replies, and
+ * bytes_available() or read() handing over nothing or only part of what
+ * arrived. Every request has to complete with the scripted body within
+ * call_limit calls to get_status(). Reports the fewest, median and most calls
+ * from initialize() until the last request finished, to track alongside the
+ * benchmark.
+ *
+ * Usage: esp8266.fuzz [iterations] [first seed]
+ * Returns non-zero if any run did not complete as scripted, a failing run is
+ * replayed by passing its seed with 1 iteration.
+ */
+int main(int argc, char* argv[])
+{
+  size_t iterations = 50;
+  uint32_t first_seed = 1;
+  if (argc > 1) {
+    iterations = std::max(1, std::atoi(argv[1]));
+  }
+  if (argc > 2) {
+    first_seed = static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10));
+  }
+
+  printf("%-36s %-28s %8s %8s %8s\n",
+         "scenario",
+         "disturbance",
+         "fewest",
+         "median",
+         "most");
+
+  bool ok = true;
+  for (const auto& scenario : scenarios) {
+    for (const auto& disturbance : disturbances) {
+      summary total;
+      for (size_t i = 0; i < iterations; i++) {
+        auto seed = static_cast<uint32_t>(first_seed + i);
+        auto result = run(scenario, disturbance.settings, seed);
+        total.calls.push_back(result.calls);
+        if (!result.ok && total.failures++ == 0) {
+          total.first_failed_seed = seed;
+        }
+      }
+      report(scenario, disturbance, total);
+      ok = ok && total.failures == 0;
+    }
+  }
+
+  return ok ? 0 : 1;
+}
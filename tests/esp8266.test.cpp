@@ -1,57 +1,1511 @@
-#include <cstdio>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
 
-#include "../include/libesp8266/esp8266.hpp"
+#include "scripted_session.hpp"
 
-class mock_serial : public embed::serial
+namespace {
+void get()
 {
-  bool driver_initialize() override { return true; }
+  scripted_serial serial;
+  check(serial.load(startup), "load the startup transcript");
+  check(serial.load(R"(> AT+CIPSTART="TCP","example.com",80\r\n
+< CONNECT\r\n\r\nOK\r\n
+> AT+CIPSEND=40\r\n
+< \r\nOK\r\n>
+> GET / HTTP/1.1\r\nHost: example.com:80\r\n\r\n
+< \r\nRecv 40 bytes\r\n\r\nSEND OK\r\n
+< +IPD,22:HTTP/1.1 200 OK\r\nConte
+< +IPD,21:nt-Length: 5\r\n\r\nhello
+> AT+CIPCLOSE\r\n
+< CLOSED\r\n\r\nOK\r\n
+)"),
+        "load the request transcript");
 
-  [[nodiscard]] bool busy() override { return false; }
-  void write(std::span<const std::byte> p_data) override
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, { .domain = "example.com" }) == state::complete,
+        "request completes");
+  check(text(esp.response()) == "hello", "body is received");
+  check(esp.header().status_code == 200, "status code is kept");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "connection is closed");
+}
+
+/// A sequence longer than a matcher holds is rejected rather than cut short
+void sequence_length_limit()
+{
+  constexpr auto limit = embed::sequence_matcher::maximum_sequence_length;
+  auto longest = make_body(limit);
+  auto received = "noise " + longest;
+
+  auto matches = [&received](embed::sequence_matcher& p_matcher) {
+    bool matched = false;
+    for (auto byte : embed::to_bytes(received)) {
+      matched = p_matcher.feed(byte) || matched;
+    }
+    return matched;
+  };
+
+  embed::sequence_matcher matcher;
+  check(matcher.new_sequence(embed::to_bytes(longest)),
+        "longest sequence is accepted");
+  check(matches(matcher), "longest sequence is matched");
+  auto too_long = longest + "z";
+  check(!matcher.new_sequence(embed::to_bytes(too_long)),
+        "longer sequence is rejected");
+  check(matcher.empty(), "rejected sequence leaves the matcher empty");
+  check(!matches(matcher), "nothing is matched after a rejected sequence");
+}
+
+/// The body goes to the sink a piece at a time, so it can be larger than the
+/// response buffer
+void body_sink()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  auto body = make_body(1000);
+  auto length = std::to_string(serialized(request).size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n" + body,
+                  300)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_esp8266<256> esp(serial, "SSID", "PASSWORD");
+  if (!join(esp, serial)) {
+    return;
+  }
+  string_sink sink;
+  esp.request(request, sink);
+  check(drive(esp, serial, finished) == state::complete, "request completes");
+  check(sink.body == body, "whole body reaches the sink");
+  check(sink.writes > 1, "body is passed on as it arrives");
+  check(esp.response().empty(), "response buffer holds no body");
+  check(esp.header().content_length == 1000, "header is kept");
+}
+
+/// Two links with requests in flight at once, whose frames arrive interleaved
+void multiplexed_links()
+{
+  constexpr embed::esp8266::request_t first{ .domain = "one.com" };
+  constexpr embed::esp8266::request_t second{ .domain = "two.com",
+                                              .path = "/b" };
+  auto first_length = std::to_string(serialized(first).size());
+  auto second_length = std::to_string(serialized(second).size());
+  std::string first_response =
+    "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\nfirst!";
+  std::string second_response =
+    "HTTP/1.1 200 OK\r\nContent-Length: 7\r\n\r\nsecond!";
+
+  scripted_serial serial;
+  serial.expect("ATE0\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CWMODE=1\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CIPMUX=1\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CWJAP_CUR=\"SSID\",\"PASSWORD\"\r\n")
+    .reply("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n")
+    // Round robin starts after link 0
+    .expect("AT+CIPSTART=1,\"TCP\",\"two.com\",80\r\n")
+    .reply("1,CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=1," + second_length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(second))
+    .reply("\r\nRecv " + second_length + " bytes\r\n\r\nSEND OK\r\n")
+    .expect("AT+CIPSTART=0,\"TCP\",\"one.com\",80\r\n")
+    .reply("0,CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=0," + first_length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(first))
+    .reply("\r\nRecv " + first_length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames(second_response.substr(0, 20), 20, 1)
+    .reply_frames(first_response.substr(0, 30), 30, 0)
+    .reply_frames(second_response.substr(20), 100, 1)
+    .reply_frames(first_response.substr(30), 100, 0)
+    .expect("AT+CIPCLOSE=1\r\n")
+    .reply("1,CLOSED\r\n\r\nOK\r\n")
+    .expect("AT+CIPCLOSE=0\r\n")
+    .reply("0,CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_multiplexed_esp8266<2, 512> esp(serial, "SSID", "PASSWORD");
+  if (!join(esp, serial)) {
+    return;
+  }
+  esp.request(0, first);
+  esp.request(1, second);
+  drive(esp, serial, [&esp](state) {
+    return finished(esp.get_status(0)) && finished(esp.get_status(1));
+  });
+  check(esp.get_status(0) == state::complete, "link 0 completes");
+  check(esp.get_status(1) == state::complete, "link 1 completes");
+  check(text(esp.response(0)) == "first!", "link 0 body");
+  check(text(esp.response(1)) == "second!", "link 1 body");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "both connections are closed");
+}
+
+/// A garbled answer at the new baud rate falls back to the default rate
+void baud_rate_fallback()
+{
+  scripted_serial serial;
+  serial.expect("AT+UART_CUR=921600,8,1,0,0\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT\r\n")
+    .reply(std::string(48, '\xfe'))
+    .expect("AT+UART_CUR=115200,8,1,0,0\r\n");
+  serial.load(startup);
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD", 921600);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(esp.baud_rate() == embed::esp8266::default_baud_rate,
+        "default baud rate is used");
+  check(serial.settings().baud_rate == embed::esp8266::default_baud_rate,
+        "serial port is back at the default baud rate");
+  check(serial.finished(), "esp8266 is initialized at the default rate");
+  check(serial.blocked_waits() == 0,
+        "AT+UART_CUR goes out at the old rate without waiting for it");
+}
+
+/// Transparent transmission is left with "+++" only once the guard time has
+/// passed, and the request only completes back in command mode
+void passthrough()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com",
+                                               .passthrough = true };
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPMODE=1\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CIPSEND\r\n")
+    .reply("\r\nOK\r\n\r\n>")
+    .expect(serialized(request))
+    .pause(50ms)
+    .reply("HTTP/1.1 200 OK\r\nContent-Length: 11\r\n\r\nhello ")
+    .reply("world")
+    .expect("+++")
+    .expect("AT+CIPMODE=0\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  if (!join(esp, serial)) {
+    return;
+  }
+  esp.request(request);
+  bool finished_in_passthrough = false;
+  auto status = drive(esp, serial, [&](state p_state) {
+    if (finished(p_state) && serial.written_at("AT+CIPMODE=0").count() < 0) {
+      finished_in_passthrough = true;
+    }
+    return finished(p_state);
+  });
+  check(status == state::complete, "request completes");
+  check(text(esp.response()) == "hello world", "raw body is received");
+  check(!finished_in_passthrough, "request finishes back in command mode");
+  auto escape = serial.written_at("+++");
+  auto command_mode = serial.written_at("AT+CIPMODE=0");
+  check(escape.count() >= 0 && command_mode - escape >=
+                                 embed::esp8266::passthrough_guard_time,
+        "guard time passes before the next command");
+  check(command_mode - escape < embed::esp8266::passthrough_guard_time + 10ms,
+        "next command follows the guard time");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "connection is closed");
+}
+
+/// Answer p_request with p_response, which claims a body larger than the
+/// response buffer, and wait for the request to finish
+state content_length_beyond_buffer(const embed::esp8266::request_t& p_request,
+                                   std::string_view p_response)
+{
+  auto length = std::to_string(serialized(p_request).size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(p_request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames(std::string(p_response), 100)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_esp8266<256> esp(serial, "SSID", "PASSWORD");
+  if (!join(esp, serial)) {
+    return state::failure;
+  }
+  auto status = fetch(esp, serial, p_request);
+  check(esp.header().content_length == 100000, "Content-Length is kept");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "connection is closed");
+  return status;
+}
+
+/// A HEAD response and a 304 have no body, so their Content-Length may be
+/// larger than the response buffer
+void content_length_without_body()
+{
+  check(content_length_beyond_buffer(
+          { .domain = "example.com",
+            .method = embed::esp8266::http_method::HEAD },
+          "HTTP/1.1 200 OK\r\nContent-Length: 100000\r\n\r\n") ==
+          state::complete,
+        "HEAD request completes");
+  check(content_length_beyond_buffer(
+          { .domain = "example.com" },
+          "HTTP/1.1 304 Not Modified\r\nContent-Length: 100000\r\n\r\n") ==
+          state::complete,
+        "304 completes");
+  check(content_length_beyond_buffer(
+          { .domain = "example.com" },
+          "HTTP/1.1 200 OK\r\nContent-Length: 100000\r\n\r\n") ==
+          state::failure,
+        "body that does not fit fails");
+}
+
+/// A body larger than one AT+CIPSEND goes out in 2048 byte segments
+void post_segments()
+{
+  auto body = make_body(5000);
+  embed::esp8266::request_t request{
+    .domain = "example.com",
+    .path = "/upload",
+    .method = embed::esp8266::http_method::POST,
+    .send_data = embed::to_bytes(body),
+  };
+  auto whole = serialized(request) + body;
+
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n");
+  for (size_t sent = 0; sent < whole.size(); sent += 2048) {
+    auto segment = whole.substr(sent, 2048);
+    auto length = std::to_string(segment.size());
+    serial.expect("AT+CIPSEND=" + length + "\r\n")
+      .reply("\r\nOK\r\n> ")
+      .expect(segment)
+      .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n");
+  }
+  serial.reply_frames("HTTP/1.1 201 Created\r\nContent-Length: 2\r\n\r\nok",
+                      100)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_esp8266<512> esp(serial, "SSID", "PASSWORD");
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, request) == state::complete, "request completes");
+  check(esp.header().status_code == 201, "server received the body");
+  check(serial.written_at("AT+CIPSEND=2048", 1).count() >= 0 &&
+          serial.written_at("AT+CIPSEND=2048", 2).count() < 0,
+        "two full segments are sent");
+  check(serial.written_at("AT+CIPSEND=" +
+                          std::to_string(whole.size() - 2 * 2048))
+            .count() >= 0,
+        "the rest follows in a third segment");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "connection is closed");
+}
+
+/// A full transmit queue refuses writes rather than waiting for the serial
+/// port, and takes them again once the queued writes have gone out
+void transmit_backpressure()
+{
+  constexpr size_t writes = embed::transmit_queue::maximum_writes;
+  // Every other byte, so that the writes do not continue each other
+  std::string text = make_body(2 * (writes + 2));
+  auto byte = [&text](size_t p_index) {
+    return std::as_bytes(std::span(text).subspan(2 * p_index, 1));
+  };
+  std::string queued;
+  for (size_t i = 0; i <= writes; i++) {
+    queued += text[2 * i];
+  }
+  std::string copy(embed::transmit_queue::copy_capacity, 'c');
+  scripted_serial serial;
+  serial.expect(queued).expect(text.substr(2 * (writes + 1), 1)).expect(copy);
+  embed::transmit_queue queue(serial);
+
+  // The first write goes straight to the serial port
+  for (size_t i = 0; i <= writes; i++) {
+    check(queue.write(byte(i)), "write is queued");
+  }
+  check(!queue.write(byte(writes + 1)), "write beyond the queue is refused");
+  check(!queue.write_copy(embed::to_bytes("x")),
+        "copy beyond the queue is refused");
+  check(serial.now().count() == 0 && serial.blocked_waits() == 0,
+        "writes do not wait for the serial port");
+  check(serial.written().size() == 1, "only the first write has started");
+
+  while (!queue.done()) {
+    serial.advance(call_period);
+  }
+  check(serial.written() == queued, "queued writes go out in order");
+  check(queue.write(byte(writes + 1)), "write is queued once there is room");
+  check(!queue.write_copy(embed::to_bytes(copy + "c")),
+        "copy larger than the copy buffer is refused");
+  check(queue.write_copy(embed::to_bytes(copy)), "copy that fits is queued");
+  while (!queue.done()) {
+    serial.advance(call_period);
+  }
+  check(serial.finished(), "refused writes leave nothing behind");
+  check(serial.blocked_waits() == 0, "nothing waited for the serial port");
+}
+
+/// Records each request that finishes, with the body it was answered with
+class completions : public embed::esp8266::completion_handler
+{
+public:
+  explicit completions(embed::esp8266& p_esp)
+    : m_esp(p_esp)
+  {}
+
+  void finished(size_t p_link, state p_state) override
+  {
+    links.push_back(p_link);
+    states.push_back(p_state);
+    bodies.emplace_back(text(m_esp.response(p_link)));
+  }
+
+  std::vector<size_t> links;
+  std::vector<state> states;
+  std::vector<std::string> bodies;
+
+protected:
+  embed::esp8266& m_esp;
+};
+
+/// Each finished request is reported once, and the handler can start the
+/// next request
+void completion_handler()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  auto length = std::to_string(serialized(request).size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("\r\nERROR\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", 100)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  /// Makes the request again once the first attempt has failed
+  class retry : public completions
   {
-    for (const auto& byte : p_data) {
-      putchar(std::to_integer<char>(byte));
+  public:
+    using completions::completions;
+
+    void finished(size_t p_link, state p_state) override
+    {
+      completions::finished(p_link, p_state);
+      if (p_state == state::failure) {
+        m_esp.request({ .domain = "example.com" });
+      }
     }
+  };
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  esp.set_timeouts({ .retries = 0 });
+  retry handler(esp);
+  esp.on_completion(handler);
+  if (!join(esp, serial)) {
+    return;
+  }
+  esp.request(request);
+  drive(esp, serial, [&handler](state) { return handler.states.size() == 2; });
+  idle(esp, serial, 1s);
+  check(handler.states == std::vector{ state::failure, state::complete },
+        "the failure and the request made from the handler are reported once");
+  check(handler.links == std::vector<size_t>{ 0, 0 }, "both on link 0");
+  check(handler.bodies.back() == "hello", "response is there when reported");
+  check(serial.finished(), "connection is closed");
+}
+
+/// AT+CIPSTART is retried after a timeout and an error, waiting a doubling
+/// backoff between the attempts
+void connect_retries()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  auto length = std::to_string(serialized(request).size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("\r\nERROR\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok", 100)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  esp.set_timeouts({ .connect = 1s, .retries = 2, .backoff = 500ms });
+  if (!join(esp, serial)) {
+    return;
   }
+  check(fetch(esp, serial, request) == state::complete,
+        "third attempt connects");
+  auto first = serial.written_at("AT+CIPSTART", 0);
+  auto second = serial.written_at("AT+CIPSTART", 1);
+  auto third = serial.written_at("AT+CIPSTART", 2);
+  // The driver's clock counts whole milliseconds
+  check(second - first > 1499ms && second - first < 1510ms,
+        "timeout of 1 s and a backoff of 500 ms before the second attempt");
+  check(third - second > 999ms && third - second < 1010ms,
+        "backoff doubles to 1 s before the third attempt");
+}
 
-  [[nodiscard]] size_t bytes_available() override { return 1; }
-  std::span<const std::byte> read(std::span<std::byte> p_data) override
+/// Connecting gives up once the retries are used up, and a server that never
+/// answers ends the request after the first byte timeout
+void phase_timeouts()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  auto length = std::to_string(serialized(request).size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("\r\nERROR\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("\r\nERROR\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  esp.set_timeouts({ .first_byte = 2s, .retries = 1, .backoff = 100ms });
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, request) == state::failure,
+        "request fails once the retry fails too");
+
+  auto start = serial.now();
+  check(fetch(esp, serial, request) == state::timeout,
+        "request without an answer times out");
+  auto sent = serial.written_at(serialized(request));
+  check(serial.now() - sent >= 2s && serial.now() - sent < 2010ms,
+        "first byte timeout starts once the request was sent");
+  check(sent > start, "request was sent");
+  esp.request(request);
+  drive(esp, serial, [&serial](state) { return serial.finished(); });
+  check(serial.finished(),
+        "next request closes the timed out connection and connects again");
+}
+
+/// Records what the driver reports to its instrumentation
+class recorder : public embed::esp8266::instrumentation
+{
+public:
+  void state_entered(size_t p_link,
+                     state p_state,
+                     std::chrono::milliseconds p_time) override
+  {
+    states.emplace_back(p_link, p_state);
+    times_in_order = times_in_order && p_time >= last_time;
+    last_time = p_time;
+  }
+
+  void bytes_transferred(state, size_t p_received, size_t p_sent) override
   {
-    static constexpr std::string_view ok = "OK\r\n";
-    static constexpr std::string_view blank = "";
-    static constexpr std::string_view ready = "\r\nready\r\n";
-    static constexpr std::string_view connected = "WIFI GOT IP\r\n\r\nOK\r\n";
+    received += p_received;
+    sent += p_sent;
+  }
 
-    std::array outputs{ blank, ok, blank, ready, blank, blank, connected };
-    m_rotation++;
-    auto select = m_rotation % outputs.size();
-    printf("rotation = %d :: select = %d\n", m_rotation, select);
-    return std::as_bytes(std::span<const char>(outputs.at(select).begin(),
-                                               outputs.at(select).end()));
+  void retried(size_t p_link, state p_state, uint8_t p_attempt) override
+  {
+    retries.emplace_back(p_link, p_state);
+    attempts.push_back(p_attempt);
   }
-  void flush() override {}
-  int m_rotation = 0;
+
+  void matchers_reset(state, size_t p_count) override { resets += p_count; }
+
+  void woke(std::chrono::milliseconds, uint8_t) override { wakes++; }
+
+  /// @return true if p_expected were entered in this order, with other
+  /// states in between
+  bool entered(const std::vector<std::pair<size_t, state>>& p_expected) const
+  {
+    auto next = states.begin();
+    for (const auto& expected : p_expected) {
+      next = std::find(next, states.end(), expected);
+      if (next == states.end()) {
+        return false;
+      }
+      next++;
+    }
+    return true;
+  }
+
+  std::vector<std::pair<size_t, state>> states;
+  std::vector<std::pair<size_t, state>> retries;
+  std::vector<uint8_t> attempts;
+  std::chrono::milliseconds last_time{ 0 };
+  bool times_in_order = true;
+  size_t received = 0;
+  size_t sent = 0;
+  size_t resets = 0;
+  size_t wakes = 0;
 };
 
-int main()
+/// The instrumentation sees every state entered, every byte transferred and
+/// each retry
+void instrumentation_hooks()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  auto length = std::to_string(serialized(request).size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("\r\nERROR\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", 20)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  esp.set_timeouts({ .backoff = 100ms });
+  recorder hooks;
+  esp.set_instrumentation(hooks);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, request) == state::complete, "request completes");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "connection is closed");
+
+  check(hooks.entered({ { 0, state::reset },
+                        { 0, state::disable_echo },
+                        { 0, state::attempting_ap_connection },
+                        { 0, state::connected_to_ap },
+                        { 0, state::connecting_to_server },
+                        { 0, state::sending_request },
+                        { 0, state::receiving_header },
+                        { 0, state::receiving_body },
+                        { 0, state::close_connection },
+                        { 0, state::complete } }),
+        "states are entered in order");
+  check(hooks.times_in_order && hooks.last_time.count() > 0,
+        "states are entered at the time of the clock");
+  check(hooks.retries ==
+            std::vector<std::pair<size_t, state>>{
+              { 0, state::connecting_to_server } } &&
+          hooks.attempts == std::vector<uint8_t>{ 1 },
+        "the failed AT+CIPSTART is retried once");
+  check(hooks.sent == serial.written().size(), "every byte sent is counted");
+  check(hooks.received == serial.bytes_delivered(),
+        "every byte received is counted");
+  check(hooks.resets >= 8, "matchers are reset for each command");
+  check(hooks.wakes == 0, "the esp8266 was never asleep");
+}
+
+/// The join and the connection to the server given as template parameters
+/// are sent precomposed, other servers and access points the usual way
+void precomposed_commands()
+{
+  constexpr embed::esp8266::request_t fixed{ .domain = "example.com" };
+  constexpr embed::esp8266::request_t other{ .domain = "other.com" };
+  std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+  scripted_serial serial;
+  serial.load(startup);
+  for (const auto& request : { fixed, other }) {
+    auto length = std::to_string(serialized(request).size());
+    serial
+      .expect("AT+CIPSTART=\"TCP\",\"" + std::string(request.domain) +
+              "\",80\r\n")
+      .reply("CONNECT\r\n\r\nOK\r\n")
+      .expect("AT+CIPSEND=" + length + "\r\n")
+      .reply("\r\nOK\r\n> ")
+      .expect(serialized(request))
+      .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+      .reply_frames(response, 100)
+      .expect("AT+CIPCLOSE\r\n")
+      .reply("CLOSED\r\n\r\nOK\r\n");
+  }
+
+  embed::static_esp8266<1024, "SSID", "PASSWORD", "example.com", "80"> esp(
+    serial);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, fixed) == state::complete,
+        "request to the precomposed server");
+  check(fetch(esp, serial, other) == state::complete,
+        "request to another server");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "commands are the same as composed at runtime");
+
+  // Joining another access point than the precomposed one
+  scripted_serial elsewhere;
+  elsewhere.expect("ATE0\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CWMODE=1\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CWJAP_CUR=\"OTHER\",\"SECRET\"\r\n")
+    .reply("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n");
+  embed::static_esp8266<1024, "SSID", "PASSWORD"> roaming(
+    elsewhere, "OTHER", "SECRET");
+  join(roaming, elsewhere);
+  check(elsewhere.finished(), "access point given at runtime is joined");
+}
+
+/**
+ * @brief Expect p_request to be made on a connection of its own, answered by
+ * a short body
+ *
+ * @param p_host what AT+CIPSTART connects to, the domain of p_request if empty
+ */
+void expect_exchange(scripted_serial& p_serial,
+                     const embed::esp8266::request_t& p_request,
+                     std::string_view p_host = {})
+{
+  auto length = std::to_string(serialized(p_request).size());
+  p_serial
+    .expect("AT+CIPSTART=\"" + std::string(p_request.secure ? "SSL" : "TCP") +
+            "\",\"" +
+            std::string(p_host.empty() ? p_request.domain : p_host) + "\"," +
+            std::string(p_request.port) + "\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(p_request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok", 100)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+}
+
+/// The domain is looked up once with AT+CIPDOMAIN and later requests connect
+/// to the cached address
+void dns_cached_address()
 {
-  mock_serial test;
-  embed::static_esp8266 esp(test, "SSID", "PASSWORD");
-  bool success = esp.initialize();
-  if (!success) {
-    return 1;
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPDOMAIN=\"example.com\"\r\n")
+    .reply("+CIPDOMAIN:93.184.216.34\r\n\r\nOK\r\n");
+  expect_exchange(serial, request, "93.184.216.34");
+  expect_exchange(serial, request, "93.184.216.34");
+
+  embed::static_dns_cache<> cache;
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  esp.set_dns_cache(cache);
+  if (!join(esp, serial)) {
+    return;
   }
+  check(fetch(esp, serial, request) == state::complete, "first request");
+  check(fetch(esp, serial, request) == state::complete, "second request");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "both connect to the address");
+  check(serial.written_at("AT+CIPDOMAIN", 1).count() < 0,
+        "domain is looked up once");
+}
+
+/// An address that cannot be connected to is forgotten, so the retry looks
+/// the domain up again
+void dns_connect_failure()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPDOMAIN=\"example.com\"\r\n")
+    .reply("+CIPDOMAIN:93.184.216.34\r\n\r\nOK\r\n");
+  expect_exchange(serial, request, "93.184.216.34");
+  serial.expect("AT+CIPSTART=\"TCP\",\"93.184.216.34\",80\r\n")
+    .reply("\r\nERROR\r\n")
+    .expect("AT+CIPDOMAIN=\"example.com\"\r\n")
+    .reply("+CIPDOMAIN:93.184.216.35\r\n\r\nOK\r\n");
+  expect_exchange(serial, request, "93.184.216.35");
 
-  printf("sizeof(esp) = %zu\n", sizeof(esp));
+  embed::static_dns_cache<> cache;
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  esp.set_dns_cache(cache);
+  esp.set_timeouts({ .retries = 1, .backoff = 100ms });
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, request) == state::complete, "first request");
+  check(fetch(esp, serial, request) == state::complete,
+        "retry connects to the new address");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "domain is looked up again after the failure");
+  auto* cached = cache.find(
+    "example.com",
+    std::chrono::duration_cast<std::chrono::milliseconds>(serial.now()));
+  check(cached != nullptr && (*cached)[3] == 35, "new address is cached");
+}
 
-  return 0;
+/// Once its lifetime is over, the domain is looked up again
+void dns_expiry()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPDOMAIN=\"example.com\"\r\n")
+    .reply("+CIPDOMAIN:93.184.216.34\r\n\r\nOK\r\n");
+  expect_exchange(serial, request, "93.184.216.34");
+  expect_exchange(serial, request, "93.184.216.34");
+  serial.expect("AT+CIPDOMAIN=\"example.com\"\r\n")
+    .reply("+CIPDOMAIN:93.184.216.36\r\n\r\nOK\r\n");
+  expect_exchange(serial, request, "93.184.216.36");
 
-  for (auto state = esp.get_status();
-       state != embed::esp8266::state::connected_to_ap;
-       state = esp.get_status()) {
-    printf("\u001b[41m== state == %d ==\u001b[0m\n", static_cast<int>(state));
-    // printf("state == %d", embed::esp8266::to_string(state).data());
+  embed::static_dns_cache<> cache(2s);
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  esp.set_dns_cache(cache);
+  if (!join(esp, serial)) {
+    return;
   }
+  check(fetch(esp, serial, request) == state::complete, "first request");
+  idle(esp, serial, 1s);
+  check(fetch(esp, serial, request) == state::complete,
+        "cached address within its lifetime");
+  idle(esp, serial, 1s);
+  check(fetch(esp, serial, request) == state::complete,
+        "expired address is looked up again");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "every request is made");
+}
 
-  return 0;
-}
\ No newline at end of file
+/// Initialization up to AT+CIPSTATUS, answered with p_status
+void expect_station_status(scripted_serial& p_serial, int p_status)
+{
+  p_serial.expect("ATE0\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CWMODE=1\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+CIPSTATUS\r\n")
+    .reply("STATUS:" + std::to_string(p_status) + "\r\n\r\nOK\r\n");
+}
+
+/// An esp8266 that still has an IP address is not joined again
+void join_reuses_connection()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  scripted_serial serial;
+  expect_station_status(serial, 2);
+  expect_exchange(serial, request);
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_join_options({ .reuse_connection = true });
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(serial.written().find("AT+CWJAP") == std::string_view::npos,
+        "joining is skipped");
+  check(fetch(esp, serial, request) == state::complete,
+        "request on the connection kept");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "request is made");
+}
+
+/// An esp8266 that is not associated joins the access point as usual
+void join_after_station_status()
+{
+  scripted_serial serial;
+  expect_station_status(serial, 5);
+  serial.expect("AT+CWJAP_CUR=\"SSID\",\"PASSWORD\"\r\n")
+    .reply("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_join_options({ .reuse_connection = true });
+  join(esp, serial);
+  check(serial.finished(), "AT+CWJAP_CUR follows the status");
+}
+
+/// The BSSID is passed to AT+CWJAP_CUR, and persisting uses AT+CWJAP_DEF
+void join_bssid()
+{
+  struct
+  {
+    embed::esp8266::join_options_t options;
+    std::string_view command;
+  } cases[] = {
+    { { .bssid = "aa:bb:cc:dd:ee:ff" },
+      "AT+CWJAP_CUR=\"SSID\",\"PASSWORD\",\"aa:bb:cc:dd:ee:ff\"\r\n" },
+    { { .persist = true }, "AT+CWJAP_DEF=\"SSID\",\"PASSWORD\"\r\n" },
+  };
+  for (const auto& [options, command] : cases) {
+    scripted_serial serial;
+    serial.expect("ATE0\r\n")
+      .reply("\r\nOK\r\n")
+      .expect("AT+CWMODE=1\r\n")
+      .reply("\r\nOK\r\n")
+      .expect(command)
+      .reply("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n");
+
+    // The precomposed join is left aside for these options
+    embed::static_esp8266<1024, "SSID", "PASSWORD"> esp(serial);
+    esp.set_join_options(options);
+    join(esp, serial);
+    check(serial.finished(), command);
+  }
+}
+
+/// Two queued requests go out in one AT+CIPSEND, and their responses are
+/// told apart by Content-Length and by chunked encoding
+void pipelining()
+{
+  constexpr embed::esp8266::request_t first{ .domain = "example.com",
+                                             .path = "/a" };
+  constexpr embed::esp8266::request_t second{ .domain = "example.com",
+                                              .path = "/b" };
+  auto batch = serialized(first) + serialized(second);
+  auto length = std::to_string(batch.size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(batch)
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    // The second response starts in the frame that ends the first
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nfirst"
+                  "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                  "3\r\nsec\r\n3\r\nond\r\n0\r\n\r\n",
+                  30)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  embed::static_request_queue<4> queue;
+  completions handler(esp);
+  esp.set_request_queue(queue);
+  esp.on_completion(handler);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(esp.queue_request(first) && esp.queue_request(second), "queued");
+  drive(esp, serial, [&handler](state) { return handler.states.size() == 2; });
+  idle(esp, serial, 10ms);
+  check(handler.states == std::vector{ state::complete, state::complete },
+        "both complete");
+  check(handler.bodies == std::vector<std::string>{ "first", "second" },
+        "each response has its own body");
+  check(serial.written_at("AT+CIPSEND", 1).count() < 0, "one AT+CIPSEND");
+  check(serial.finished(), "connection is closed after the batch");
+}
+
+/// When the first response of a batch fails the rest fail along with it,
+/// rather than being sent again
+void pipelining_failure()
+{
+  constexpr embed::esp8266::request_t first{ .domain = "example.com",
+                                             .path = "/a" };
+  constexpr embed::esp8266::request_t second{ .domain = "example.com",
+                                              .path = "/b" };
+  constexpr embed::esp8266::request_t third{ .domain = "example.com",
+                                             .path = "/c" };
+  auto batch = serialized(first) + serialized(second) + serialized(third);
+  auto length = std::to_string(batch.size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(batch)
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nfirst", 100)
+    .reply("CLOSED\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  embed::static_request_queue<4> queue;
+  completions handler(esp);
+  esp.set_request_queue(queue);
+  esp.on_completion(handler);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(esp.queue_request(first) && esp.queue_request(second) &&
+          esp.queue_request(third),
+        "queued");
+  drive(esp, serial, [&handler](state) { return handler.states.size() == 3; });
+  idle(esp, serial, 1s);
+  check(handler.states ==
+          std::vector{ state::failure, state::failure, state::failure },
+        "the batch fails, each request is reported once");
+  check(handler.links == std::vector<size_t>{ 0, 0, 0 },
+        "the rest of the batch is reported on link 0");
+  check(queue.size() == 0, "nothing is left in the queue");
+  check(serial.written_at("AT+CIPSTART", 1).count() < 0 &&
+          serial.written_at("AT+CIPSEND", 1).count() < 0,
+        "nothing is sent again");
+  check(serial.finished(), "session is over");
+}
+
+/// Open a UDP link, send a datagram and receive two, the third does not fit
+/// in the ring
+void udp()
+{
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"UDP\",\"10.0.0.2\",5000,6000,0\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=4\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect("ping")
+    .reply("\r\nRecv 4 bytes\r\n\r\nSEND OK\r\n")
+    .pause(5ms)
+    .reply("\r\n+IPD,5:hello")
+    .pause(5ms)
+    .reply("\r\n+IPD,6:world!\r\n+IPD,4:lost")
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  embed::static_datagram_ring<16> ring;
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(esp.open_datagram({ .domain = "10.0.0.2",
+                            .port = "5000",
+                            .local_port = "6000" },
+                          ring),
+        "open");
+  check(drive(esp, serial, finished) == state::complete, "link is open");
+  check(esp.send_to(embed::to_bytes("ping")), "send");
+  check(drive(esp, serial, finished) == state::complete, "datagram is sent");
+  drive(esp, serial, [&ring](state) { return ring.dropped() != 0; }, 1s);
+
+  std::array<std::byte, 16> buffer;
+  check(ring.size() == 2, "two datagrams are received");
+  check(ring.dropped() == 1, "the third is dropped");
+  check(text(ring.receive(buffer)) == "hello", "first datagram");
+  check(text(ring.receive(buffer)) == "world!", "second datagram");
+  check(esp.close_datagram(), "close");
+  check(drive(esp, serial, finished) == state::complete, "link is closed");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "session is over");
+}
+
+/// AT+CIPSSLSIZE is sent while initializing, and firmware that rejects the
+/// size keeps its default and joins all the same
+void ssl_buffer_size()
+{
+  for (std::string_view answer : { "\r\nOK\r\n", "\r\nERROR\r\n" }) {
+    scripted_serial serial;
+    serial.expect("ATE0\r\n")
+      .reply("\r\nOK\r\n")
+      .expect("AT+CWMODE=1\r\n")
+      .reply("\r\nOK\r\n")
+      .expect("AT+CIPSSLSIZE=4096\r\n")
+      .reply(answer)
+      .expect("AT+CWJAP_CUR=\"SSID\",\"PASSWORD\"\r\n")
+      .reply("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n");
+
+    embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+    esp.set_ssl_buffer_size(4096);
+    join(esp, serial);
+    check(serial.finished(), answer);
+  }
+}
+
+/// A kept alive TLS connection is reused by a secure request to the same
+/// server, but not by a plain one
+void ssl_keep_alive()
+{
+  constexpr embed::esp8266::request_t secure{
+    .domain = "example.com", .port = "443", .keep_alive = true, .secure = true
+  };
+  auto plain = secure;
+  plain.secure = false;
+  auto length = std::to_string(serialized(secure).size());
+  std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"SSL\",\"example.com\",443\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n");
+  for (int i = 0; i < 2; i++) {
+    serial.expect("AT+CIPSEND=" + length + "\r\n")
+      .reply("\r\nOK\r\n> ")
+      .expect(serialized(secure))
+      .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+      .reply_frames(response, 100);
+  }
+  serial.expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",443\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(plain))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames(response, 100);
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, secure) == state::complete, "first request");
+  check(fetch(esp, serial, secure) == state::complete,
+        "second request on the same connection");
+  check(fetch(esp, serial, plain) == state::complete,
+        "plain request on a new connection");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "TLS connection is closed for the plain request");
+  check(serial.written_at("AT+CIPSTART", 2).count() < 0,
+        "connected twice");
+}
+
+/// Records the events the driver reports
+class events : public embed::esp8266::event_handler
+{
+public:
+  using event = embed::esp8266::event;
+
+  void received(event p_event, size_t p_link) override
+  {
+    received_events.push_back(p_event);
+    links.push_back(p_link);
+  }
+
+  size_t count(event p_event) const
+  {
+    return static_cast<size_t>(
+      std::count(received_events.begin(), received_events.end(), p_event));
+  }
+
+  std::vector<event> received_events;
+  std::vector<size_t> links;
+};
+
+/// WIFI DISCONNECT in the middle of a body fails the request, and the access
+/// point is joined again
+void disconnect_mid_body()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  auto length = std::to_string(serialized(request).size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\npart", 100)
+    .pause(5ms)
+    .reply("WIFI DISCONNECT\r\n")
+    .expect("AT+CWJAP_CUR=\"SSID\",\"PASSWORD\"\r\n")
+    .reply("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  events handler;
+  esp.on_event(handler);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, request) == state::failure, "request fails");
+  check(handler.count(events::event::wifi_disconnected) == 1,
+        "wifi_disconnected is reported");
+  drive(esp, serial, [&](state) {
+    return serial.finished() && esp.connected();
+  });
+  check(serial.finished(), "join is sent again");
+  check(esp.connected(), "access point is joined again");
+}
+
+/// "busy p..." makes the driver send the command again a little later
+void busy_resent()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  auto length = std::to_string(serialized(request).size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("busy p...\r\n")
+    .expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.0 200 OK\r\n\r\nuntil close", 100)
+    .reply("CLOSED\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  events handler;
+  esp.set_clock(serial);
+  esp.on_event(handler);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, request) == state::complete, "request completes");
+  check(text(esp.response()) == "until close", "body until the close");
+  check(serial.written_at("AT+CIPSTART", 1) -
+            serial.written_at("AT+CIPSTART", 0) >=
+          embed::esp8266::busy_retry_delay,
+        "command is sent again after the retry delay");
+  check(handler.received_events ==
+          std::vector{ events::event::busy, events::event::connection_closed },
+        "busy and the close are reported");
+  check(handler.links.back() == 0, "close is on link 0");
+  check(serial.finished(), "session is over");
+}
+
+/// A command the esp8266 keeps being too busy for counts as timed out once
+/// the retries are used up
+void busy_retry_limit()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  scripted_serial serial;
+  serial.load(startup);
+  // One retry after busy, then one more connect attempt with its own retry
+  for (size_t i = 0; i < 4; i++) {
+    serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+      .reply("busy p...\r\n");
+  }
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  events handler;
+  esp.set_clock(serial);
+  esp.set_timeouts({ .retries = 1, .backoff = 100ms });
+  esp.on_event(handler);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, request) == state::timeout, "request times out");
+  check(handler.count(events::event::busy) == 4, "each busy is reported");
+  check(serial.written_at("AT+CIPSTART", 4).count() < 0,
+        "no more attempts are made");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "session is over");
+}
+
+/**
+ * @brief Request the same resource twice, the first time answered with a
+ * body and an ETag and the second time with "304 Not Modified"
+ */
+void revalidate(embed::esp8266& p_esp, scripted_serial& p_serial)
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com",
+                                               .path = "/data" };
+  auto conditional = request;
+  conditional.if_none_match = "\"v1\"";
+  check(serialized(conditional).find("If-None-Match: \"v1\"\r\n") !=
+          std::string::npos,
+        "ETag is sent as If-None-Match");
+  for (const auto& sent : { request, conditional }) {
+    auto length = std::to_string(serialized(sent).size());
+    p_serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+      .reply("CONNECT\r\n\r\nOK\r\n")
+      .expect("AT+CIPSEND=" + length + "\r\n")
+      .reply("\r\nOK\r\n> ")
+      .expect(serialized(sent))
+      .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+      .reply_frames(sent.if_none_match.empty()
+                      ? "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\n"
+                        "Content-Length: 5\r\n\r\nhello"
+                      : "HTTP/1.1 304 Not Modified\r\nETag: \"v1\"\r\n\r\n",
+                    100)
+      .expect("AT+CIPCLOSE\r\n")
+      .reply("CLOSED\r\n\r\nOK\r\n");
+  }
+
+  if (!join(p_esp, p_serial)) {
+    return;
+  }
+  check(fetch(p_esp, p_serial, request) == state::complete,
+        "first request completes");
+  check(text(p_esp.response()) == "hello", "first body");
+  check(fetch(p_esp, p_serial, request) == state::complete,
+        "second request completes");
+  check(p_esp.header().status_code == 304, "header gives the 304");
+  idle(p_esp, p_serial, 10ms);
+  check(p_serial.finished(), "If-None-Match is sent the second time");
+}
+
+/// A 304 is answered with the body kept in the cache
+void response_cache_body()
+{
+  scripted_serial serial;
+  serial.load(startup);
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  embed::static_response_cache<> cache;
+  esp.set_response_cache(cache);
+  revalidate(esp, serial);
+  check(text(esp.response()) == "hello", "cached body");
+}
+
+/// A cache without room for bodies only keeps the validators
+void response_cache_validators_only()
+{
+  scripted_serial serial;
+  serial.load(startup);
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  embed::static_response_cache<4, 0> cache;
+  esp.set_response_cache(cache);
+  revalidate(esp, serial);
+  check(esp.response().empty(), "no body");
+  auto* cached = cache.find("example.com", "80", "/data");
+  check(cached != nullptr && cached->etag.view() == "\"v1\"" &&
+          cached->cached_body().empty(),
+        "only the ETag is kept");
+}
+
+/// The esp8266 sleeps while idle and is woken with AT probes before the
+/// next request
+void sleep_while_idle()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  scripted_serial serial;
+  serial.load(startup);
+  expect_exchange(serial, request);
+  serial.expect("AT+SLEEP=1\r\n")
+    .reply("\r\nOK\r\n")
+    // The first probe is missed while waking up
+    .expect("AT\r\n")
+    .expect("AT\r\n")
+    .reply("\r\nOK\r\n")
+    .expect("AT+SLEEP=0\r\n")
+    .reply("\r\nOK\r\n");
+  expect_exchange(serial, request);
+  serial.expect("AT+SLEEP=1\r\n").reply("\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, request) == state::complete, "first request");
+  esp.set_sleep_mode(embed::esp8266::sleep_mode::light);
+  idle(esp, serial, 100ms);
+  check(serial.written_at("AT+SLEEP=1") > serial.written_at("AT+CIPCLOSE"),
+        "esp8266 sleeps once the request is over");
+  check(fetch(esp, serial, request) == state::complete, "second request");
+  idle(esp, serial, 100ms);
+
+  auto first_probe = serial.written_at("AT\r\n", 0);
+  auto second_probe = serial.written_at("AT\r\n", 1);
+  // The driver's clock counts whole milliseconds
+  check(second_probe - first_probe >=
+          embed::esp8266::wake_probe_interval - 1ms,
+        "missed probe is sent again after the probe interval");
+  check(serial.written_at("AT+SLEEP=0") <
+          serial.written_at("AT+CIPSTART", 1),
+        "woken up before connecting");
+  check(serial.finished(), "sleeps again after the second request");
+}
+
+/// Firmware that answers AT+SLEEP with ERROR is left awake
+void sleep_rejected()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+SLEEP=2\r\n").reply("\r\nERROR\r\n");
+  expect_exchange(serial, request);
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  esp.set_clock(serial);
+  esp.set_sleep_mode(embed::esp8266::sleep_mode::modem);
+  if (!join(esp, serial)) {
+    return;
+  }
+  idle(esp, serial, 100ms);
+  check(fetch(esp, serial, request) == state::complete, "request completes");
+  idle(esp, serial, 100ms);
+  check(serial.finished(), "request is made without waking up");
+  check(serial.written_at("AT\r\n").count() < 0, "no probes");
+  check(serial.written_at("AT+SLEEP", 1).count() < 0,
+        "sleep is not tried again");
+}
+
+constexpr std::array<embed::access_point_list::credentials, 2> networks{ {
+  { "SSID", "PASSWORD" },
+  { "OTHER", "SECRET" },
+} };
+
+/// Answer to AT+CWJAP_CUR? for the access point joined at p_rssi
+std::string signal_answer(int p_rssi)
+{
+  return "+CWJAP_CUR:\"SSID\",\"aa:aa:aa:aa:aa:aa\",6," +
+         std::to_string(p_rssi) + "\r\n\r\nOK\r\n";
+}
+
+/// Join with roaming between networks, and play the rest of the script
+void roam(scripted_serial& p_serial,
+          embed::access_point_list& p_list,
+          embed::esp8266& p_esp)
+{
+  p_esp.set_clock(p_serial);
+  p_esp.set_roaming(p_list, { .check_interval = 1s });
+  if (!join(p_esp, p_serial)) {
+    return;
+  }
+  drive(
+    p_esp, p_serial, [&p_serial](state) { return p_serial.finished(); }, 5s);
+  idle(p_esp, p_serial, 100ms);
+}
+
+/// A weak signal leads to a scan, and the strongest known access point is
+/// joined as it is stronger by more than the hysteresis
+void roaming_moves()
+{
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CWJAP_CUR?\r\n")
+    .reply(signal_answer(-80))
+    .expect("AT+CWLAP\r\n")
+    .reply("+CWLAP:(3,\"SSID\",-80,\"aa:aa:aa:aa:aa:aa\",6,-5,0)\r\n"
+           "+CWLAP:(4,\"CAFE\",-40,\"dd:dd:dd:dd:dd:dd\",1,3,0)\r\n"
+           "+CWLAP:(3,\"OTHER\",-70,\"cc:cc:cc:cc:cc:cc\",11,0,0)\r\n"
+           "+CWLAP:(3,\"SSID\",-74,\"bb:bb:bb:bb:bb:bb\",1,0,0)\r\n"
+           "\r\nOK\r\n")
+    .expect("AT+CWJAP_CUR=\"OTHER\",\"SECRET\",\"cc:cc:cc:cc:cc:cc\"\r\n")
+    .reply("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  embed::static_access_point_list<> list(networks);
+  roam(serial, list, esp);
+  check(serial.finished(), "access point OTHER is joined by its BSSID");
+  check(esp.connected(), "connected again");
+
+  auto found = list.found();
+  check(found.size() == 4, "every entry of the scan is kept");
+  if (found.size() == 4) {
+    check(found[1].ssid.view() == "CAFE" &&
+            found[1].bssid.view() == "dd:dd:dd:dd:dd:dd" &&
+            found[1].rssi == -40 && found[1].channel == 1,
+          "entry is read");
+    check(found[2].channel == 11, "two digit channel");
+  }
+  check(esp.rssi() == 0, "signal of the new access point is not known yet");
+}
+
+/// A known access point that is stronger by less than the hysteresis is not
+/// worth moving to
+void roaming_hysteresis()
+{
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CWJAP_CUR?\r\n")
+    .reply(signal_answer(-80))
+    .expect("AT+CWLAP\r\n")
+    .reply("+CWLAP:(3,\"SSID\",-80,\"aa:aa:aa:aa:aa:aa\",6,-5,0)\r\n"
+           "+CWLAP:(4,\"CAFE\",-40,\"dd:dd:dd:dd:dd:dd\",1,3,0)\r\n"
+           "+CWLAP:(3,\"SSID\",-74,\"bb:bb:bb:bb:bb:bb\",1,0,0)\r\n"
+           "\r\nOK\r\n");
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  embed::static_access_point_list<> list(networks);
+  roam(serial, list, esp);
+  check(serial.finished(), "scan is made");
+  check(serial.written_at("AT+CWJAP_CUR=", 1).count() < 0,
+        "access point is not changed");
+  check(esp.rssi() == -80, "signal is kept");
+  check(list.found().size() == 3, "scan is kept");
+}
+
+/// A signal above the threshold needs no scan
+void roaming_threshold()
+{
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CWJAP_CUR?\r\n").reply(signal_answer(-75));
+
+  embed::static_esp8266 esp(serial, "SSID", "PASSWORD");
+  embed::static_access_point_list<> list(networks);
+  roam(serial, list, esp);
+  check(serial.finished(), "signal is checked");
+  check(serial.written_at("AT+CWLAP").count() < 0, "no scan at the threshold");
+  check(esp.rssi() == -75, "signal is read");
+}
+} // namespace
+
+int main()
+{
+  run("GET", get);
+  run("sequence longer than a matcher holds", sequence_length_limit);
+  run("body_sink receives a body larger than the buffer", body_sink);
+  run("CIPMUX links with interleaved frames", multiplexed_links);
+  run("AT+UART_CUR falls back when the probe is garbled", baud_rate_fallback);
+  run("passthrough leaves with +++ after the guard time", passthrough);
+  run("HEAD and 304 with a Content-Length beyond the buffer",
+      content_length_without_body);
+  run("POST body in 2048 byte CIPSEND segments", post_segments);
+  run("full transmit queue refuses writes", transmit_backpressure);
+  run("completion handler", completion_handler);
+  run("CIPSTART retries with doubling backoff", connect_retries);
+  run("retries run out and the first byte times out", phase_timeouts);
+  run("instrumentation hooks", instrumentation_hooks);
+  run("precomposed AT+CWJAP_CUR and AT+CIPSTART", precomposed_commands);
+  run("AT+CIPDOMAIN address is cached", dns_cached_address);
+  run("cached address is dropped when connecting fails",
+      dns_connect_failure);
+  run("cached address expires", dns_expiry);
+  run("AT+CIPSTATUS with an IP address skips joining",
+      join_reuses_connection);
+  run("AT+CIPSTATUS without an IP address joins", join_after_station_status);
+  run("BSSID and AT+CWJAP_DEF joins", join_bssid);
+  run("pipelined requests in one AT+CIPSEND", pipelining);
+  run("pipelined batch fails with its first response", pipelining_failure);
+  run("UDP link", udp);
+  run("AT+CIPSSLSIZE and its ERROR fallback", ssl_buffer_size);
+  run("kept alive TLS connection is only reused by secure requests",
+      ssl_keep_alive);
+  run("WIFI DISCONNECT in the middle of a body", disconnect_mid_body);
+  run("busy p... sends the command again", busy_resent);
+  run("busy p... until the retries run out", busy_retry_limit);
+  run("304 is answered with the cached body", response_cache_body);
+  run("cache without bodies keeps the validators",
+      response_cache_validators_only);
+  run("sleep while idle and wake before a request", sleep_while_idle);
+  run("AT+SLEEP rejected", sleep_rejected);
+  run("roaming moves to a stronger access point", roaming_moves);
+  run("roaming stays within the hysteresis", roaming_hysteresis);
+  run("roaming does not scan at the threshold", roaming_threshold);
+  return check_failures == 0 ? 0 : 1;
+}
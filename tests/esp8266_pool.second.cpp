@@ -0,0 +1,8 @@
+#include <cstddef>
+
+#include "../include/libesp8266/esp8266_pool.hpp"
+
+size_t second_translation_unit_pool_size()
+{
+  return sizeof(embed::esp8266_pool<2>);
+}
@@ -0,0 +1,140 @@
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "../include/libesp8266/esp8266_pool.hpp"
+#include "scripted_session.hpp"
+
+/// Defined in esp8266_pool.second.cpp, which includes the same headers
+size_t second_translation_unit_pool_size();
+
+namespace {
+/// Records every request the pool reports as finished
+class completions : public embed::esp8266_pool<2>::completion_handler
+{
+public:
+  struct completion
+  {
+    size_t module;
+    size_t link;
+    state status;
+    std::string body;
+  };
+
+  explicit completions(embed::esp8266_pool<2>& p_pool)
+    : m_pool(p_pool)
+  {}
+
+  void finished(size_t p_module, size_t p_link, state p_state) override
+  {
+    received.push_back({ p_module,
+                         p_link,
+                         p_state,
+                         std::string(text(
+                           m_pool.module(p_module).response(p_link))) });
+  }
+
+  std::vector<completion> received;
+
+private:
+  embed::esp8266_pool<2>& m_pool;
+};
+
+/// Expect p_request on a connection of its own, answered with p_body after
+/// p_delay
+void expect_exchange(scripted_serial& p_serial,
+                     const embed::esp8266::request_t& p_request,
+                     std::string_view p_body,
+                     std::chrono::microseconds p_delay)
+{
+  auto length = std::to_string(serialized(p_request).size());
+  p_serial
+    .expect("AT+CIPSTART=\"TCP\",\"" + std::string(p_request.domain) +
+            "\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(p_request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .pause(p_delay)
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: " +
+                    std::to_string(p_body.size()) + "\r\n\r\n" +
+                    std::string(p_body),
+                  100)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+}
+
+/// Requests go to the modules in turn, and the one that has to wait is made
+/// on whichever module frees its link first
+void two_modules()
+{
+  constexpr embed::esp8266::request_t first{ .domain = "one.com" };
+  constexpr embed::esp8266::request_t second{ .domain = "two.com" };
+  constexpr embed::esp8266::request_t third{ .domain = "three.com" };
+
+  // Module 0 answers slowly, so module 1 is free first
+  std::array<scripted_serial, 2> serials;
+  serials[0].load(startup);
+  expect_exchange(serials[0], first, "first", 500ms);
+  serials[1].load(startup);
+  expect_exchange(serials[1], second, "second", 10ms);
+  expect_exchange(serials[1], third, "third", 10ms);
+
+  embed::static_esp8266 module0(serials[0], "SSID", "PASSWORD");
+  embed::static_esp8266 module1(serials[1], "SSID", "PASSWORD");
+  embed::esp8266_pool<2> pool({ &module0, &module1 });
+  completions handler(pool);
+  pool.on_completion(handler);
+  if (!check(pool.initialize(), "initialize")) {
+    return;
+  }
+  check(pool.queue_request(first) && pool.queue_request(second) &&
+          pool.queue_request(third),
+        "requests are queued");
+
+  auto limit = serials[0].now() + 20s;
+  while (handler.received.size() < 3 && serials[0].now() < limit) {
+    pool.poll();
+    for (auto& serial : serials) {
+      serial.advance(call_period);
+    }
+  }
+  check(pool.queued() == 0 && pool.in_flight() == 0, "nothing is left");
+
+  if (!check(handler.received.size() == 3, "every request finishes")) {
+    return;
+  }
+  const auto& received = handler.received;
+  check(received[0].module == 1 && received[0].body == "second",
+        "module 1 finishes first");
+  check(received[1].module == 1 && received[1].body == "third",
+        "waiting request is made on the module that was free first");
+  check(received[2].module == 0 && received[2].body == "first",
+        "module 0 finishes last");
+  for (const auto& completion : received) {
+    check(completion.link == 0 && completion.status == state::complete,
+          "link and state are reported");
+  }
+  idle(module0, serials[0], 10ms);
+  idle(module1, serials[1], 10ms);
+  check(serials[0].finished() && serials[1].finished(),
+        "every connection is closed");
+}
+
+/// The headers are included in two translation units of this program, which
+/// only links if everything they define out of line is inline
+void two_translation_units()
+{
+  check(second_translation_unit_pool_size() == sizeof(embed::esp8266_pool<2>),
+        "same pool in both translation units");
+}
+} // namespace
+
+int main()
+{
+  run("requests spread across two modules", two_modules);
+  run("headers included in two translation units", two_translation_units);
+  return check_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,302 @@
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "check.hpp"
+#include "../include/libesp8266/http_response_parser.hpp"
+
+using stage = embed::http_response_parser::stage;
+
+namespace {
+/// Body and stage after giving a response to the parser
+struct parsed
+{
+  std::string body;
+  stage last_stage;
+};
+
+/**
+ * @brief Give p_response to p_parser p_piece bytes at a time, the way it
+ * arrives in +IPD frames
+ */
+parsed parse(embed::http_response_parser& p_parser,
+             std::string_view p_response,
+             size_t p_piece)
+{
+  parsed result{ {}, p_parser.current_stage() };
+  while (!p_response.empty()) {
+    auto piece = p_response.substr(0, p_piece);
+    p_response.remove_prefix(piece.size());
+    auto input = std::as_bytes(std::span(piece.data(), piece.size()));
+    // Bytes after the end of the response are left in the input
+    while (!input.empty() && p_parser.current_stage() != stage::complete &&
+           p_parser.current_stage() != stage::failure) {
+      auto body = p_parser.parse(input);
+      result.body.append(reinterpret_cast<const char*>(body.data()),
+                         body.size());
+    }
+  }
+  result.last_stage = p_parser.current_stage();
+  return result;
+}
+
+parsed parse(std::string_view p_response, size_t p_piece = 1)
+{
+  embed::http_response_parser parser;
+  parser.reset();
+  return parse(parser, p_response, p_piece);
+}
+
+/// The piece sizes every response is given in
+constexpr size_t pieces[] = { 1, 2, 3, 7, 64, 4096 };
+
+void status_lines()
+{
+  struct
+  {
+    std::string_view line;
+    uint32_t status_code;
+  } valid[] = {
+    { "HTTP/1.1 200 OK", 200 },
+    { "HTTP/1.0 404 Not Found", 404 },
+    { "HTTP/1.1 418 I'm a teapot", 418 },
+    { "HTTP/1.1 503", 503 },
+    { "HTTP/1.1 999 Whatever", 999 },
+  };
+  for (auto [line, status_code] : valid) {
+    embed::http_response_parser parser;
+    parser.reset();
+    auto result = parse(parser,
+                        std::string(line) + "\r\nContent-Length: 0\r\n\r\n",
+                        1);
+    check(result.last_stage == stage::complete, line);
+    check(parser.header().status_code == status_code, line);
+  }
+
+  constexpr std::string_view invalid[] = {
+    "HTTP/1.1 abc OK", "HTTP/1.1 99 Low", "HTTP/1.1 1000 High",
+    "ICY 200 OK",      "HTTP/1.1",        "",
+  };
+  for (auto line : invalid) {
+    auto result = parse(std::string(line) + "\r\nContent-Length: 0\r\n\r\n");
+    check(result.last_stage == stage::failure, line);
+  }
+}
+
+void content_length()
+{
+  constexpr std::string_view response =
+    "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 11\r\n"
+    "\r\nhello world";
+  for (auto piece : pieces) {
+    embed::http_response_parser parser;
+    parser.reset();
+    auto result = parse(parser, response, piece);
+    check(result.last_stage == stage::complete, "complete");
+    check(result.body == "hello world", "body");
+    check(parser.header().content_length == 11, "content length");
+    check(parser.header().header_length == response.size() - 11,
+          "header length");
+    check(parser.header().content_type.view() == "text/plain",
+          "content type");
+  }
+}
+
+/// Whichever byte a frame ends on, the header lines come out the same
+void lines_split_across_frames()
+{
+  constexpr std::string_view response =
+    "HTTP/1.1 200 OK\r\nConnection: close\r\nETag: \"v1\"\r\n"
+    "Content-Length: 4\r\n\r\nbody";
+  for (size_t split = 1; split < response.size(); split++) {
+    embed::http_response_parser parser;
+    parser.reset();
+    auto first = parse(parser, response.substr(0, split), 4096);
+    auto second = parse(parser, response.substr(split), 4096);
+    if (!check(second.last_stage == stage::complete &&
+                 first.body + second.body == "body" &&
+                 parser.header().connection_close &&
+                 parser.header().etag.view() == "\"v1\"",
+               "split anywhere")) {
+      printf("    split after %zu bytes\n", split);
+    }
+  }
+}
+
+void interim_responses()
+{
+  constexpr std::string_view final_header =
+    "HTTP/1.1 201 Created\r\nContent-Length: 2\r\n\r\n";
+  std::string response = "HTTP/1.1 100 Continue\r\n\r\n"
+                         "HTTP/1.1 103 Early Hints\r\nLink: </a.css>\r\n\r\n" +
+                         std::string(final_header) + "ok";
+  for (auto piece : pieces) {
+    embed::http_response_parser parser;
+    parser.reset();
+    auto result = parse(parser, response, piece);
+    check(result.last_stage == stage::complete, "complete");
+    check(parser.header().status_code == 201, "final status code");
+    check(result.body == "ok", "body of the final response");
+    check(parser.header().header_length == final_header.size(),
+          "header length of the final response");
+  }
+}
+
+void chunked()
+{
+  constexpr std::string_view response =
+    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "5\r\nhello\r\n1a;x=y\r\n, abcdefghijklmnopqrstuvwx\r\n"
+    "0\r\nExpires: never\r\n\r\n";
+  for (auto piece : pieces) {
+    auto result = parse(response, piece);
+    check(result.last_stage == stage::complete, "complete after the trailer");
+    check(result.body == "hello, abcdefghijklmnopqrstuvwx",
+          "chunks without the sizes and the extension");
+  }
+
+  check(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+              "5\r\nhello!\r\n0\r\n\r\n")
+            .last_stage == stage::failure,
+        "chunk longer than its size fails");
+  check(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+              "x5\r\nhello\r\n0\r\n\r\n")
+            .last_stage == stage::failure,
+        "size that is not hexadecimal fails");
+}
+
+void until_close()
+{
+  embed::http_response_parser parser;
+  parser.reset();
+  auto result =
+    parse(parser, "HTTP/1.0 200 OK\r\nServer: old\r\n\r\nevery byte", 3);
+  check(result.last_stage == stage::body, "body runs on");
+  check(result.body == "every byte", "body so far");
+  parser.connection_closed();
+  check(parser.current_stage() == stage::complete, "close completes it");
+
+  parser.reset();
+  parse(parser, "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort", 3);
+  parser.connection_closed();
+  check(parser.current_stage() == stage::failure,
+        "close before Content-Length bytes fails");
+
+  parser.reset(false);
+  result = parse(parser, "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n", 3);
+  check(result.last_stage == stage::complete, "response to HEAD has no body");
+}
+
+/// Lines longer than maximum_line_length are dropped, not misread
+void over_long_line()
+{
+  std::string padding(embed::http_response_parser::maximum_line_length, 'x');
+  std::string response = "HTTP/1.1 200 OK\r\nX-Padding: " + padding +
+                         "\r\nContent-Type: " + padding +
+                         "\r\nContent-Length: 3\r\n\r\nabc";
+  for (auto piece : pieces) {
+    embed::http_response_parser parser;
+    parser.reset();
+    auto result = parse(parser, response, piece);
+    check(result.last_stage == stage::complete, "complete");
+    check(result.body == "abc", "field after the long lines is read");
+    check(parser.header().content_type.empty(), "cut off value is ignored");
+  }
+
+  // "Content-Length: 3" followed by enough spaces to be cut off
+  response = "HTTP/1.1 200 OK\r\nContent-Length: 3" + std::string(100, ' ') +
+             "\r\n\r\nabcdef";
+  embed::http_response_parser parser;
+  parser.reset();
+  auto result = parse(parser, response, 1);
+  check(!parser.header().has_content_length, "cut off field is ignored");
+  check(result.body == "abcdef", "body runs until close");
+}
+void header_index_find()
+{
+  embed::static_header_index<> index;
+  embed::http_response_parser parser;
+  parser.set_header_index(&index);
+  parser.reset();
+  parse(parser,
+        "HTTP/1.1 200 OK\r\nDate: Tue, 15 Nov 1994 08:12:31 GMT\r\n"
+        "X-Request-Id:  abc123 \r\nSet-Cookie: a=1\r\nSet-Cookie: b=2\r\n"
+        "Content-Length: 0\r\n\r\n",
+        5);
+  check(index.size() == 5, "every field is kept");
+  check(index.find("date") == "Tue, 15 Nov 1994 08:12:31 GMT",
+        "lower case name finds the field");
+  check(index.find("X-REQUEST-ID") == "abc123",
+        "upper case name finds the field, value is trimmed");
+  check(index.find("set-cookie") == "a=1", "first of repeated fields");
+  check(index.name(3) == "Set-Cookie" && index.value(3) == "b=2",
+        "fields are kept in the order received");
+  check(index.contains("Content-Length"), "contains()");
+  check(!index.contains("Content-Type"), "missing field");
+  check(index.find("Content-Type").data() == nullptr,
+        "missing field is a null view");
+  check(!index.overflowed(), "nothing was left out");
+}
+
+void header_index_full_table()
+{
+  embed::static_header_index<4, 512> index;
+  check(index.add("A", "1") && index.add("B", "2") && index.add("C", "3") &&
+          index.add("D", "4"),
+        "four fields fit");
+  check(!index.add("E", "5"), "fifth field does not fit");
+  check(index.overflowed(), "overflow is reported");
+  check(index.size() == 4, "four fields are kept");
+  check(index.find("d") == "4" && !index.contains("e"),
+        "kept fields are still found");
+  index.clear();
+  check(!index.overflowed() && index.size() == 0, "clear() starts over");
+  check(index.add("E", "5") && index.find("e") == "5", "room again");
+}
+
+void header_index_full_buffer()
+{
+  embed::static_header_index<16, 32> index;
+  check(index.add("Server", "example"), "13 bytes fit");
+  check(!index.add("Content-Type", "text/html"), "21 more bytes do not fit");
+  check(index.overflowed(), "overflow is reported");
+  check(index.add("Age", "12"), "a smaller field still fits");
+  check(index.find("age") == "12" && index.find("server") == "example",
+        "kept fields are found");
+  check(!index.contains("content-type"), "left out field is not found");
+}
+
+/// Fields of interim responses do not stay in the index
+void header_index_after_interim()
+{
+  embed::static_header_index<> index;
+  embed::http_response_parser parser;
+  parser.set_header_index(&index);
+  parser.reset();
+  parse(parser,
+        "HTTP/1.1 103 Early Hints\r\nLink: </a.css>\r\n\r\n"
+        "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n",
+        1);
+  check(parser.current_stage() == stage::complete, "complete");
+  check(!index.contains("Link"), "field of the 103 response is gone");
+  check(index.size() == 1 && index.find("content-length") == "0",
+        "field of the final response is kept");
+}
+} // namespace
+
+int main()
+{
+  run("status lines", status_lines);
+  run("Content-Length body in pieces of any size", content_length);
+  run("header lines split across frames", lines_split_across_frames);
+  run("1xx interim responses", interim_responses);
+  run("chunked body with an extension and a trailer", chunked);
+  run("body that ends when the connection closes", until_close);
+  run("over-long header lines", over_long_line);
+  run("header_index finds fields regardless of case", header_index_find);
+  run("header_index with every field taken", header_index_full_table);
+  run("header_index with its buffer full", header_index_full_buffer);
+  run("header_index cleared after a 1xx response",
+      header_index_after_interim);
+  return check_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,346 @@
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "scripted_session.hpp"
+
+// Vectors were made with Python's zlib at level 9, from sample_text() unless
+// noted otherwise.
+
+namespace {
+/// Raw deflate, with a dynamic Huffman block
+constexpr uint8_t raw_stream[] = {
+  0xed, 0xcc, 0xc1, 0x11, 0x80, 0x20, 0x0c, 0x04, 0xc0, 0x56, 0xae, 0xb5,
+  0x13, 0x82, 0x89, 0x04, 0xe3, 0x30, 0xd1, 0xb1, 0x7c, 0xad, 0xc0, 0x0a,
+  0xfc, 0xee, 0x63, 0xe9, 0x87, 0x12, 0x2d, 0xee, 0x9c, 0x91, 0xe8, 0xe6,
+  0x81, 0xa2, 0x9c, 0x6e, 0x02, 0x8d, 0x14, 0xc7, 0xb0, 0x2e, 0x90, 0xa2,
+  0x81, 0xed, 0x7c, 0x35, 0x13, 0xcb, 0xe4, 0x15, 0x58, 0xc3, 0x1b, 0xdc,
+  0x06, 0x51, 0xc5, 0x93, 0xb0, 0xbd, 0x1a, 0xc1, 0xbf, 0xfb, 0xea, 0x1e,
+};
+
+/// Raw deflate in a stored block
+constexpr uint8_t stored_stream[] = {
+  0x01, 0x6e, 0x01, 0x91, 0xfe, 0x61, 0x6c, 0x70, 0x68, 0x61, 0x20, 0x66,
+  0x6f, 0x78, 0x74, 0x72, 0x6f, 0x74, 0x20, 0x6b, 0x69, 0x6c, 0x6f, 0x20,
+  0x63, 0x68, 0x61, 0x72, 0x6c, 0x69, 0x65, 0x20, 0x68, 0x6f, 0x74, 0x65,
+  0x6c, 0x20, 0x6d, 0x69, 0x6b, 0x65, 0x20, 0x65, 0x63, 0x68, 0x6f, 0x20,
+  0x6a, 0x75, 0x6c, 0x69, 0x65, 0x74, 0x74, 0x20, 0x62, 0x72, 0x61, 0x76,
+  0x6f, 0x20, 0x67, 0x6f, 0x6c, 0x66, 0x20, 0x6c, 0x69, 0x6d, 0x61, 0x20,
+  0x64, 0x65, 0x6c, 0x74, 0x61, 0x20, 0x69, 0x6e, 0x64, 0x69, 0x61, 0x20,
+  0x61, 0x6c, 0x70, 0x68, 0x61, 0x20, 0x66, 0x6f, 0x78, 0x74, 0x72, 0x6f,
+  0x74, 0x20, 0x6b, 0x69, 0x6c, 0x6f, 0x20, 0x63, 0x68, 0x61, 0x72, 0x6c,
+  0x69, 0x65, 0x20, 0x68, 0x6f, 0x74, 0x65, 0x6c, 0x20, 0x6d, 0x69, 0x6b,
+  0x65, 0x20, 0x65, 0x63, 0x68, 0x6f, 0x20, 0x6a, 0x75, 0x6c, 0x69, 0x65,
+  0x74, 0x74, 0x20, 0x62, 0x72, 0x61, 0x76, 0x6f, 0x20, 0x67, 0x6f, 0x6c,
+  0x66, 0x20, 0x6c, 0x69, 0x6d, 0x61, 0x20, 0x64, 0x65, 0x6c, 0x74, 0x61,
+  0x20, 0x69, 0x6e, 0x64, 0x69, 0x61, 0x20, 0x61, 0x6c, 0x70, 0x68, 0x61,
+  0x20, 0x66, 0x6f, 0x78, 0x74, 0x72, 0x6f, 0x74, 0x20, 0x6b, 0x69, 0x6c,
+  0x6f, 0x20, 0x63, 0x68, 0x61, 0x72, 0x6c, 0x69, 0x65, 0x20, 0x68, 0x6f,
+  0x74, 0x65, 0x6c, 0x20, 0x6d, 0x69, 0x6b, 0x65, 0x20, 0x65, 0x63, 0x68,
+  0x6f, 0x20, 0x6a, 0x75, 0x6c, 0x69, 0x65, 0x74, 0x74, 0x20, 0x62, 0x72,
+  0x61, 0x76, 0x6f, 0x20, 0x67, 0x6f, 0x6c, 0x66, 0x20, 0x6c, 0x69, 0x6d,
+  0x61, 0x20, 0x64, 0x65, 0x6c, 0x74, 0x61, 0x20, 0x69, 0x6e, 0x64, 0x69,
+  0x61, 0x20, 0x61, 0x6c, 0x70, 0x68, 0x61, 0x20, 0x66, 0x6f, 0x78, 0x74,
+  0x72, 0x6f, 0x74, 0x20, 0x6b, 0x69, 0x6c, 0x6f, 0x20, 0x63, 0x68, 0x61,
+  0x72, 0x6c, 0x69, 0x65, 0x20, 0x68, 0x6f, 0x74, 0x65, 0x6c, 0x20, 0x6d,
+  0x69, 0x6b, 0x65, 0x20, 0x65, 0x63, 0x68, 0x6f, 0x20, 0x6a, 0x75, 0x6c,
+  0x69, 0x65, 0x74, 0x74, 0x20, 0x62, 0x72, 0x61, 0x76, 0x6f, 0x20, 0x67,
+  0x6f, 0x6c, 0x66, 0x20, 0x6c, 0x69, 0x6d, 0x61, 0x20, 0x64, 0x65, 0x6c,
+  0x74, 0x61, 0x20, 0x69, 0x6e, 0x64, 0x69, 0x61, 0x20, 0x61, 0x6c, 0x70,
+  0x68, 0x61, 0x20, 0x66, 0x6f, 0x78, 0x74, 0x72, 0x6f, 0x74, 0x20, 0x6b,
+  0x69, 0x6c, 0x6f, 0x20, 0x63, 0x68, 0x61, 0x72, 0x6c, 0x69, 0x65, 0x20,
+  0x68, 0x6f, 0x74, 0x65, 0x6c, 0x20, 0x6d, 0x69, 0x6b, 0x65, 0x20, 0x65,
+  0x63, 0x68, 0x6f, 0x20, 0x6a, 0x75, 0x6c, 0x69, 0x65, 0x74, 0x74,
+};
+
+/// Raw deflate in a fixed Huffman block
+constexpr uint8_t fixed_stream[] = {
+  0x4b, 0xcc, 0x29, 0xc8, 0x48, 0x54, 0x48, 0xcb, 0xaf, 0x28, 0x29, 0xca,
+  0x2f, 0x51, 0xc8, 0xce, 0xcc, 0xc9, 0x57, 0x48, 0xce, 0x48, 0x2c, 0xca,
+  0xc9, 0x4c, 0x55, 0xc8, 0xc8, 0x2f, 0x49, 0xcd, 0x51, 0xc8, 0xcd, 0xcc,
+  0x4e, 0x55, 0x48, 0x4d, 0xce, 0xc8, 0x57, 0xc8, 0x2a, 0x05, 0x8a, 0x96,
+  0x94, 0x28, 0x24, 0x15, 0x25, 0x96, 0xe5, 0x2b, 0xa4, 0xe7, 0xe7, 0xa4,
+  0x29, 0xe4, 0x64, 0xe6, 0x26, 0x2a, 0xa4, 0xa4, 0xe6, 0x94, 0x24, 0x2a,
+  0x64, 0xe6, 0xa5, 0x64, 0x26, 0x2a, 0x24, 0x8e, 0x1a, 0x87, 0xcf, 0x38,
+  0x00,
+};
+
+/// zlib
+constexpr uint8_t zlib_stream[] = {
+  0x78, 0xda, 0xed, 0xcc, 0xc1, 0x11, 0x80, 0x20, 0x0c, 0x04, 0xc0, 0x56,
+  0xae, 0xb5, 0x13, 0x82, 0x89, 0x04, 0xe3, 0x30, 0xd1, 0xb1, 0x7c, 0xad,
+  0xc0, 0x0a, 0xfc, 0xee, 0x63, 0xe9, 0x87, 0x12, 0x2d, 0xee, 0x9c, 0x91,
+  0xe8, 0xe6, 0x81, 0xa2, 0x9c, 0x6e, 0x02, 0x8d, 0x14, 0xc7, 0xb0, 0x2e,
+  0x90, 0xa2, 0x81, 0xed, 0x7c, 0x35, 0x13, 0xcb, 0xe4, 0x15, 0x58, 0xc3,
+  0x1b, 0xdc, 0x06, 0x51, 0xc5, 0x93, 0xb0, 0xbd, 0x1a, 0xc1, 0xbf, 0xfb,
+  0xea, 0x1e, 0x04, 0x1d, 0x87, 0x4a,
+};
+
+/// gzip
+constexpr uint8_t gzip_stream[] = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xed, 0xcc,
+  0xc1, 0x11, 0x80, 0x20, 0x0c, 0x04, 0xc0, 0x56, 0xae, 0xb5, 0x13, 0x82,
+  0x89, 0x04, 0xe3, 0x30, 0xd1, 0xb1, 0x7c, 0xad, 0xc0, 0x0a, 0xfc, 0xee,
+  0x63, 0xe9, 0x87, 0x12, 0x2d, 0xee, 0x9c, 0x91, 0xe8, 0xe6, 0x81, 0xa2,
+  0x9c, 0x6e, 0x02, 0x8d, 0x14, 0xc7, 0xb0, 0x2e, 0x90, 0xa2, 0x81, 0xed,
+  0x7c, 0x35, 0x13, 0xcb, 0xe4, 0x15, 0x58, 0xc3, 0x1b, 0xdc, 0x06, 0x51,
+  0xc5, 0x93, 0xb0, 0xbd, 0x1a, 0xc1, 0xbf, 0xfb, 0xea, 0x1e, 0x69, 0x44,
+  0x8a, 0xff, 0x6e, 0x01, 0x00, 0x00,
+};
+
+/// Raw deflate of far_text(), which refers back 600 bytes
+constexpr uint8_t far_stream[] = {
+  0xa5, 0x92, 0xc7, 0x95, 0x45, 0x21, 0x0c, 0x43, 0x6b, 0xc5, 0x24, 0x83,
+  0x4d, 0x06, 0x13, 0xaa, 0xff, 0x6f, 0x6a, 0x98, 0x8d, 0x96, 0xba, 0x92,
+  0x8e, 0x5a, 0x7a, 0x1d, 0x59, 0xc5, 0x62, 0x27, 0xd0, 0xe6, 0xf9, 0xa6,
+  0x04, 0x9b, 0xb0, 0xba, 0x0b, 0x75, 0x6c, 0x15, 0xb5, 0x96, 0x58, 0x5c,
+  0xb4, 0xd6, 0x42, 0x7c, 0x97, 0xb3, 0xb5, 0x87, 0xc6, 0xf3, 0x6a, 0x1c,
+  0x27, 0xc7, 0xb9, 0xa5, 0xfb, 0x8d, 0x66, 0x79, 0x9d, 0x88, 0x28, 0x9c,
+  0x68, 0x67, 0x81, 0x4d, 0x62, 0x5c, 0x8b, 0x01, 0x8f, 0x9a, 0x2f, 0x48,
+  0x01, 0x3d, 0x8b, 0x49, 0x86, 0x70, 0xdd, 0xbe, 0x5f, 0x32, 0x9f, 0xed,
+  0xe8, 0x61, 0x78, 0x99, 0x63, 0xe6, 0x8d, 0x35, 0x50, 0x18, 0x6f, 0x53,
+  0xde, 0x47, 0x04, 0xda, 0x29, 0x9d, 0x01, 0x9f, 0x61, 0xb9, 0xf3, 0x18,
+  0x99, 0x0c, 0xb6, 0x44, 0xf2, 0xf7, 0x16, 0x1d, 0x2b, 0x70, 0x48, 0xd0,
+  0xd5, 0x68, 0x8c, 0xf1, 0x69, 0xb4, 0x2c, 0xad, 0xe2, 0x63, 0x9f, 0x13,
+  0xd8, 0xc4, 0x5d, 0xc3, 0x87, 0xf6, 0x2d, 0x93, 0x5a, 0xb6, 0xcb, 0x18,
+  0x42, 0x7e, 0xe3, 0xea, 0xf2, 0xca, 0x32, 0xab, 0x90, 0xb9, 0x62, 0x66,
+  0xf4, 0x64, 0xfb, 0x67, 0x51, 0xe6, 0xe8, 0x1c, 0xc3, 0xbe, 0xb3, 0xa0,
+  0x43, 0xb2, 0xe0, 0xf1, 0x89, 0x69, 0x85, 0x37, 0x5f, 0xea, 0xe4, 0xb0,
+  0x43, 0xfa, 0xf4, 0x2b, 0x4c, 0x12, 0x31, 0x4c, 0x6e, 0xb2, 0xe4, 0xa8,
+  0x70, 0x47, 0x7e, 0xa9, 0xeb, 0xce, 0x04, 0x13, 0xec, 0xb1, 0x21, 0xf2,
+  0x34, 0xf6, 0x66, 0x53, 0x2f, 0x38, 0xd0, 0xcf, 0xbd, 0xeb, 0x8a, 0xaf,
+  0xbe, 0x53, 0xce, 0xf9, 0xdb, 0x52, 0xcf, 0x46, 0x54, 0x93, 0xfa, 0x3a,
+  0x0c, 0x29, 0x78, 0xf2, 0x06, 0x71, 0x57, 0x5d, 0xdc, 0xb6, 0x65, 0xf4,
+  0x3a, 0x8a, 0x6d, 0x57, 0xb7, 0x32, 0x75, 0x3d, 0x24, 0xcd, 0x57, 0x58,
+  0xd1, 0x4c, 0x53, 0xb5, 0xe4, 0xb4, 0x5b, 0xbf, 0xeb, 0x6f, 0x68, 0x95,
+  0x10, 0xe7, 0xdc, 0x02, 0x20, 0x6c, 0x5e, 0x8f, 0xe1, 0xe4, 0xde, 0xdd,
+  0x87, 0x73, 0x37, 0xa4, 0xc5, 0x7b, 0xb9, 0x7c, 0xb7, 0x81, 0xb2, 0x24,
+  0x5e, 0xb4, 0xb7, 0xb3, 0x3f, 0x95, 0xfd, 0x7e, 0x5b, 0xab, 0xc1, 0x70,
+  0xc8, 0x9f, 0x44, 0xca, 0x46, 0x0e, 0xf6, 0xc2, 0x83, 0x17, 0x69, 0x86,
+  0x0f, 0xe6, 0xd7, 0x63, 0xa9, 0xb3, 0x04, 0x73, 0x5e, 0xd0, 0xee, 0x4b,
+  0x19, 0xea, 0x98, 0xb2, 0x2e, 0xc5, 0xeb, 0x13, 0x94, 0x90, 0x6d, 0x2a,
+  0x69, 0xbd, 0xa0, 0x52, 0x44, 0x26, 0xeb, 0x1c, 0xae, 0xc0, 0x74, 0x90,
+  0xa1, 0xa1, 0x29, 0xf9, 0xc5, 0x97, 0x19, 0x02, 0x03, 0xef, 0x20, 0x35,
+  0xb7, 0xfe, 0x54, 0x2a, 0xda, 0x25, 0x6b, 0xf2, 0x6a, 0xff, 0xfc, 0xd5,
+  0x0f,
+};
+
+/// Sixty words from a list of thirteen, separated by spaces
+std::string sample_text()
+{
+  constexpr std::array<std::string_view, 13> words{
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+    "hotel", "india", "juliett", "kilo", "lima", "mike",
+  };
+  std::string text;
+  for (size_t i = 0; i < 60; i++) {
+    if (i != 0) {
+      text += ' ';
+    }
+    text += words[(i * 5) % words.size()];
+  }
+  return text;
+}
+
+/// 600 pseudo random letters followed by the first 64 of them again
+std::string far_text()
+{
+  std::string text;
+  uint32_t seed = 1;
+  for (size_t i = 0; i < 600; i++) {
+    seed = (seed * 1103515245U + 12345U) & 0x7fff'ffffU;
+    text += static_cast<char>('a' + (seed >> 16) % 26);
+  }
+  return text + text.substr(0, 64);
+}
+
+template<size_t N>
+std::span<const std::byte> bytes(const uint8_t (&p_stream)[N])
+{
+  return std::as_bytes(std::span(p_stream));
+}
+
+/// Decoded text and final status of a stream fed p_piece bytes at a time
+struct decoded
+{
+  std::string text;
+  embed::inflater::status status;
+};
+
+decoded inflate(embed::inflater& p_inflater,
+                embed::inflater::format p_format,
+                std::span<const std::byte> p_stream,
+                size_t p_piece)
+{
+  decoded result{ {}, embed::inflater::status::more };
+  p_inflater.reset(p_format);
+  while (!p_stream.empty()) {
+    auto piece = p_stream.first(std::min(p_piece, p_stream.size()));
+    p_stream = p_stream.subspan(piece.size());
+    result.status =
+      p_inflater.feed(piece, [&result](std::span<const std::byte> p_data) {
+        result.text += text(p_data);
+      });
+  }
+  return result;
+}
+
+/// Decode p_stream whole and a byte at a time, both must give sample_text()
+void check_vector(embed::inflater::format p_format,
+                  std::span<const std::byte> p_stream)
+{
+  embed::static_inflater<> inflater;
+  for (size_t piece : { p_stream.size(), size_t{ 1 } }) {
+    auto result = inflate(inflater, p_format, p_stream, piece);
+    check(result.status == embed::inflater::status::finished,
+          piece == 1 ? "byte at a time finishes" : "whole stream finishes");
+    check(result.text == sample_text(),
+          piece == 1 ? "byte at a time decodes" : "whole stream decodes");
+    check(inflater.total_out() == sample_text().size(), "total_out()");
+  }
+}
+
+void raw() { check_vector(embed::inflater::format::raw, bytes(raw_stream)); }
+
+void stored()
+{
+  check_vector(embed::inflater::format::raw, bytes(stored_stream));
+}
+
+void fixed()
+{
+  check_vector(embed::inflater::format::raw, bytes(fixed_stream));
+}
+
+void zlib()
+{
+  check_vector(embed::inflater::format::zlib, bytes(zlib_stream));
+  check_vector(embed::inflater::format::deflate, bytes(zlib_stream));
+}
+
+void gzip() { check_vector(embed::inflater::format::gzip, bytes(gzip_stream)); }
+
+/// "Content-Encoding: deflate" without the zlib header is raw deflate
+void deflate_without_header()
+{
+  check_vector(embed::inflater::format::deflate, bytes(raw_stream));
+}
+
+/// A window smaller than the output is reused as it fills up
+void small_window()
+{
+  embed::static_inflater<128> inflater;
+  auto result =
+    inflate(inflater, embed::inflater::format::raw, bytes(raw_stream), 7);
+  check(result.status == embed::inflater::status::finished, "finishes");
+  check(result.text == sample_text(), "decodes");
+}
+
+/// Flip a bit of the checksum in the trailer of p_stream
+void check_corrupt_trailer(embed::inflater::format p_format,
+                           std::span<const std::byte> p_stream,
+                           size_t p_offset_from_end)
+{
+  std::string corrupt(text(p_stream));
+  corrupt[corrupt.size() - p_offset_from_end] ^= 0x10;
+  embed::static_inflater<> inflater;
+  for (size_t piece : { corrupt.size(), size_t{ 1 } }) {
+    auto result = inflate(inflater, p_format, embed::to_bytes(corrupt), piece);
+    check(result.status == embed::inflater::status::failure,
+          "corrupt checksum fails");
+  }
+}
+
+void corrupt_crc32()
+{
+  // The CRC-32 comes before the length in the gzip trailer
+  check_corrupt_trailer(embed::inflater::format::gzip, bytes(gzip_stream), 6);
+}
+
+void corrupt_adler32()
+{
+  check_corrupt_trailer(embed::inflater::format::zlib, bytes(zlib_stream), 1);
+}
+
+void beyond_window()
+{
+  embed::static_inflater<512> small;
+  auto result =
+    inflate(small, embed::inflater::format::raw, bytes(far_stream), 1);
+  check(result.status == embed::inflater::status::failure,
+        "back reference beyond a 512 byte window fails");
+  check(result.text.size() < far_text().size(), "stops at the reference");
+
+  embed::static_inflater<1024> large;
+  result = inflate(large, embed::inflater::format::raw, bytes(far_stream), 1);
+  check(result.status == embed::inflater::status::finished,
+        "a 1024 byte window reaches back far enough");
+  check(result.text == far_text(), "decodes");
+}
+
+/// A chunked gzip body is inflated on its way into the response
+void chunked_gzip_response()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com",
+                                               .compressed = true };
+  auto length = std::to_string(serialized(request).size());
+  std::string gzip(text(bytes(gzip_stream)));
+  std::string body;
+  for (size_t sent = 0; sent < gzip.size(); sent += 32) {
+    auto chunk = gzip.substr(sent, 32);
+    char size[8];
+    snprintf(size, sizeof(size), "%zx", chunk.size());
+    body += std::string(size) + "\r\n" + chunk + "\r\n";
+  }
+  body += "0\r\n\r\n";
+
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+                  "Transfer-Encoding: chunked\r\n\r\n" +
+                    body,
+                  50)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_esp8266<512> esp(serial, "SSID", "PASSWORD");
+  embed::static_inflater<> inflater;
+  esp.set_inflater(inflater);
+  check(serialized(request).find("Accept-Encoding: gzip, deflate\r\n") !=
+          std::string::npos,
+        "compressed body is asked for");
+  if (!join(esp, serial)) {
+    return;
+  }
+  check(fetch(esp, serial, request) == state::complete, "request completes");
+  check(text(esp.response()) == sample_text(), "body is inflated");
+  idle(esp, serial, 10ms);
+  check(serial.finished(), "connection is closed");
+}
+} // namespace
+
+int main()
+{
+  run("raw deflate with dynamic Huffman codes", raw);
+  run("stored block", stored);
+  run("fixed Huffman codes", fixed);
+  run("zlib", zlib);
+  run("gzip", gzip);
+  run("deflate format without a zlib header", deflate_without_header);
+  run("window smaller than the output", small_window);
+  run("corrupt CRC-32 trailer", corrupt_crc32);
+  run("corrupt Adler-32 trailer", corrupt_adler32);
+  run("back reference beyond the window", beyond_window);
+  run("chunked gzip body through set_inflater()", chunked_gzip_response);
+  return check_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+#include <array>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "scripted_session.hpp"
+
+namespace {
+std::span<const std::byte> bytes(std::string_view p_text)
+{
+  return std::as_bytes(std::span(p_text.data(), p_text.size()));
+}
+
+/// Read everything waiting in p_ring the way the driver does
+std::string drain(embed::receive_ring& p_ring)
+{
+  std::string result;
+  for (auto piece = p_ring.readable(); !piece.empty();
+       piece = p_ring.readable()) {
+    result += text(piece);
+    p_ring.consume(piece.size());
+  }
+  return result;
+}
+
+/// Bytes that continue at the start of the storage are read in two runs
+void wrap_around()
+{
+  embed::static_receive_ring<8> ring;
+  check(ring.push(bytes("abcdef")) == 6, "6 bytes fit");
+  ring.consume(5);
+  check(ring.push(bytes("ghijk")) == 5, "5 more bytes fit after consuming");
+  check(text(ring.readable()) == "fgh", "first run ends with the storage");
+  check(ring.writable().size() == 2, "free space up to the oldest byte");
+  ring.consume(3);
+  check(text(ring.readable()) == "ijk", "second run starts at the front");
+  check(drain(ring) == "ijk" && ring.size() == 0, "read back in order");
+
+  // The counts keep growing past the capacity many times over
+  std::string received;
+  for (int i = 0; i < 100; i++) {
+    ring.push(bytes("01234"));
+    received += drain(ring);
+  }
+  check(received.size() == 500 && received.ends_with("0123401234"),
+        "every byte arrives after many wraps");
+}
+
+void overruns()
+{
+  embed::static_receive_ring<8> ring;
+  check(ring.push(bytes("0123456789")) == 8, "only the capacity fits");
+  check(ring.overruns() == 2, "bytes that do not fit are counted");
+  check(ring.writable().empty(), "no room left");
+  check(ring.push(bytes("x")) == 0 && ring.overruns() == 3,
+        "full ring counts every byte");
+  check(drain(ring) == "01234567", "kept bytes are the oldest");
+  check(ring.push(bytes("ab")) == 2 && ring.overruns() == 3,
+        "room again once read");
+  ring.clear();
+  check(ring.size() == 0 && ring.readable().empty(), "clear() drops bytes");
+}
+
+/// The driver reads a response through a ring much smaller than the body,
+/// filled as the bytes arrive the way a receive interrupt would
+void driver_reads_ring()
+{
+  constexpr embed::esp8266::request_t request{ .domain = "example.com" };
+  auto body = make_body(1000);
+  auto length = std::to_string(serialized(request).size());
+  scripted_serial serial;
+  serial.load(startup);
+  serial.expect("AT+CIPSTART=\"TCP\",\"example.com\",80\r\n")
+    .reply("CONNECT\r\n\r\nOK\r\n")
+    .expect("AT+CIPSEND=" + length + "\r\n")
+    .reply("\r\nOK\r\n> ")
+    .expect(serialized(request))
+    .reply("\r\nRecv " + length + " bytes\r\n\r\nSEND OK\r\n")
+    .reply_frames("HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n" + body,
+                  256)
+    .expect("AT+CIPCLOSE\r\n")
+    .reply("CLOSED\r\n\r\nOK\r\n");
+
+  embed::static_receive_ring<64> ring;
+  embed::static_esp8266<1024> esp(serial, "SSID", "PASSWORD");
+  esp.set_receive_ring(ring);
+  // Fills the ring before each call to get_status()
+  auto poll_until = [&](auto p_done, std::chrono::microseconds p_limit) {
+    auto limit = serial.now() + p_limit;
+    auto status = esp.get_status();
+    while (!p_done(status) && serial.now() < limit) {
+      serial.advance(call_period);
+      std::array<std::byte, 64> arrived;
+      while (serial.bytes_available() != 0) {
+        ring.push(serial.read(arrived));
+      }
+      status = esp.get_status();
+    }
+    return status;
+  };
+
+  check(esp.initialize(), "initialize");
+  poll_until([&esp](state) { return esp.connected(); }, 20s);
+  if (!check(esp.connected(), "join the access point")) {
+    return;
+  }
+  esp.request(request);
+  check(poll_until(finished, 20s) == state::complete, "request completes");
+  check(text(esp.response()) == body, "body is read across the ring's end");
+  poll_until([](state) { return false; }, 10ms);
+  check(serial.finished(), "connection is closed");
+  check(ring.overruns() == 0, "the driver keeps up with the bytes");
+}
+} // namespace
+
+int main()
+{
+  run("bytes wrap around the end of the storage", wrap_around);
+  run("bytes that do not fit are overruns", overruns);
+  run("driver reads received bytes from the ring", driver_reads_ring);
+  return check_failures == 0 ? 0 : 1;
+}
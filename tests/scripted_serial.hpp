@@ -0,0 +1,504 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "../include/libesp8266/esp8266.hpp"
+#include "check.hpp"
+
+/**
+ * @brief Serial port that plays the part of an esp8266 by following a script.
+ * The script alternates between bytes the driver is expected to write and the
+ * bytes the esp8266 sends back, optionally with pauses in between, so captured
+ * transcripts can be replayed against the driver.
+ *
+ * Time is simulated and only moves forward with advance(). Bytes travel at the
+ * baud rate in the serial settings (10 bits per byte), both ways, so replies
+ * arrive a few bytes at a time and +IPD frames are split up the way they are
+ * on a real serial port. It is also the clock given to the driver.
+ *
+ */
+class scripted_serial
+  : public embed::serial
+  , public embed::uptime_clock
+{
+public:
+  /**
+   * @brief Expect the driver to write p_text. The rest of the script waits
+   * until it has been written. Writing anything else fails a check, see
+   * unexpected().
+   */
+  scripted_serial& expect(std::string_view p_text)
+  {
+    m_script.push_back({ event::kind::expect, std::string(p_text), {} });
+    return *this;
+  }
+
+  /// Send p_text to the driver
+  scripted_serial& reply(std::string_view p_text)
+  {
+    m_script.push_back({ event::kind::reply, std::string(p_text), {} });
+    return *this;
+  }
+
+  /// Wait p_duration after everything before it has been sent
+  scripted_serial& pause(std::chrono::microseconds p_duration)
+  {
+    m_script.push_back({ event::kind::pause, {}, p_duration });
+    return *this;
+  }
+
+  /**
+   * @brief Send p_payload in +IPD frames of at most p_frame_size bytes, the
+   * way the esp8266 passes on data received from a server
+   *
+   * @param p_payload data from the server
+   * @param p_frame_size largest frame payload, 1460 on real hardware
+   * @param p_link link ID to put in each frame, negative when not multiplexing
+   * @param p_gap pause between frames, as the data trickles in from the server
+   */
+  scripted_serial& reply_frames(std::string_view p_payload,
+                                size_t p_frame_size,
+                                int p_link = -1,
+                                std::chrono::microseconds p_gap = {})
+  {
+    while (!p_payload.empty()) {
+      auto part = p_payload.substr(0, p_frame_size);
+      p_payload.remove_prefix(part.size());
+      std::string frame = "+IPD,";
+      if (p_link >= 0) {
+        frame += std::to_string(p_link) + ",";
+      }
+      frame += std::to_string(part.size()) + ":";
+      frame += part;
+      reply(frame);
+      if (p_gap.count() != 0 && !p_payload.empty()) {
+        pause(p_gap);
+      }
+    }
+    return *this;
+  }
+
+  /**
+   * @brief Append a transcript to the script. Each line starts with a marker:
+   *
+   *   `> text`  the driver writes text
+   *   `< text`  the esp8266 sends text
+   *   `~ ms`    nothing happens for this many milliseconds
+   *   `#`       comment
+   *
+   * Line breaks of the transcript itself are not part of the text, write them
+   * as `\r` and `\n`. `\\` and `\xHH` are also understood.
+   *
+   * @return false if a line is not understood, lines before it are kept
+   */
+  bool load(std::string_view p_transcript)
+  {
+    while (!p_transcript.empty()) {
+      auto end = p_transcript.find('\n');
+      auto line = p_transcript.substr(0, end);
+      p_transcript.remove_prefix(
+        std::min(line.size() + 1, p_transcript.size()));
+
+      if (line.ends_with('\r')) {
+        line.remove_suffix(1);
+      }
+      if (line.empty() || line.starts_with('#')) {
+        continue;
+      }
+      if (line.size() < 2 || line[1] != ' ') {
+        return false;
+      }
+
+      auto text = unescape(line.substr(2));
+      uint32_t milliseconds = 0;
+      switch (line[0]) {
+        case '>':
+          expect(text);
+          break;
+        case '<':
+          reply(text);
+          break;
+        case '~':
+          if (!embed::from_decimal(text, milliseconds)) {
+            return false;
+          }
+          pause(std::chrono::milliseconds(milliseconds));
+          break;
+        default:
+          return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Ways for the esp8266 and the serial port to misbehave, each the
+   * chance in percent of it happening
+   *
+   */
+  struct disturbances
+  {
+    /// A reply is cut in two at a random byte with a pause of up to
+    /// chop_pause in between
+    uint8_t chop = 0;
+    std::chrono::microseconds chop_pause{ 2000 };
+    /// Garbage bytes, such as line noise, arrive before a reply. They are
+    /// never part of a reply, so an +IPD frame is not corrupted.
+    uint8_t garbage = 0;
+    /// bytes_available() returns 0 although bytes have arrived
+    uint8_t withhold = 0;
+    /// bytes_available() and read() only hand over some of the bytes that
+    /// have arrived
+    uint8_t partial = 0;
+  };
+
+  /**
+   * @brief Misbehave as given by p_disturbances from now on, at random but
+   * the same way for the same seed, so a failing run can be replayed. Call
+   * this once the script is complete, as it cuts up and adds to the replies.
+   */
+  void disturb(const disturbances& p_disturbances, uint32_t p_seed)
+  {
+    m_disturbances = p_disturbances;
+    m_random.seed(p_seed);
+
+    std::vector<event> script;
+    for (size_t i = 0; i < m_script.size(); i++) {
+      auto next = m_script[i];
+      if (i < m_position || next.type != event::kind::reply) {
+        script.push_back(next);
+        continue;
+      }
+      if (chance(p_disturbances.garbage)) {
+        std::string noise(random(1, 8), '\x80');
+        for (auto& byte : noise) {
+          byte = static_cast<char>(random(0x80, 0xff));
+        }
+        script.push_back({ event::kind::reply, noise, {} });
+      }
+      if (next.text.size() > 1 && chance(p_disturbances.chop)) {
+        size_t cut = random(1, next.text.size() - 1);
+        auto pause = std::chrono::microseconds(
+          random(0, static_cast<size_t>(p_disturbances.chop_pause.count())));
+        script.push_back({ event::kind::reply, next.text.substr(0, cut), {} });
+        script.push_back({ event::kind::pause, {}, pause });
+        next.text.erase(0, cut);
+      }
+      script.push_back(next);
+    }
+    m_script = script;
+  }
+
+  /// Let p_duration of simulated time pass
+  void advance(std::chrono::microseconds p_duration)
+  {
+    m_now += p_duration;
+    m_busy_polls = 0;
+    play();
+  }
+
+  /// @return true once the whole script has played and been read, and
+  /// nothing was written that the script did not expect
+  bool finished() const
+  {
+    return m_unexpected.empty() && m_position == m_script.size() &&
+           m_rx_read == m_rx.size();
+  }
+
+  /**
+   * @brief The bytes the driver wrote that the script did not expect, from
+   * the expect they part from. The script stops playing at a mismatch, so the
+   * driver hears nothing more from the esp8266.
+   *
+   * @return std::string_view empty as long as every write was expected
+   */
+  std::string_view unexpected() const { return m_unexpected; }
+
+  /// @return everything the driver has written
+  std::string_view written() const { return m_written; }
+
+  /**
+   * @brief When the driver started the write that holds occurrence number
+   * p_occurrence (counting from 0) of p_text, to check how long the driver
+   * waited between commands
+   *
+   * @return std::chrono::microseconds simulated time, negative if p_text has
+   * not been written that often
+   */
+  std::chrono::microseconds written_at(std::string_view p_text,
+                                       size_t p_occurrence = 0) const
+  {
+    size_t found = m_written.find(p_text);
+    for (size_t i = 0; i < p_occurrence && found != std::string::npos; i++) {
+      found = m_written.find(p_text, found + 1);
+    }
+    if (found == std::string::npos) {
+      return std::chrono::microseconds{ -1 };
+    }
+    auto write = std::upper_bound(
+      m_write_times.begin(),
+      m_write_times.end(),
+      found,
+      [](size_t p_offset, const auto& p_write) {
+        return p_offset < p_write.first;
+      });
+    return std::prev(write)->second;
+  }
+
+  /// @return total bytes that arrived at the driver
+  size_t bytes_delivered() const { return m_rx_arrived; }
+
+  /// @return times the driver kept asking busy() until the transmission was
+  /// over, rather than coming back later
+  size_t blocked_waits() const { return m_blocked_waits; }
+
+  std::chrono::microseconds now() const { return m_now; }
+
+  // embed::uptime_clock
+  std::chrono::milliseconds uptime() override
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(m_now);
+  }
+
+  // embed::serial
+  bool busy() override
+  {
+    if (m_now >= m_tx_done) {
+      return false;
+    }
+    // A driver that keeps asking without time moving on is blocked waiting
+    // for the transmission, which takes as long as it takes.
+    if (++m_busy_polls == busy_polls_before_waiting) {
+      m_blocked_waits++;
+      m_now = m_tx_done;
+      play();
+      return false;
+    }
+    return true;
+  }
+
+  void write(std::span<const std::byte> p_data) override
+  {
+    m_write_times.emplace_back(m_written.size(), m_now);
+    for (auto byte : p_data) {
+      m_written += std::to_integer<char>(byte);
+    }
+    m_tx_done = std::max(m_tx_done, m_now) + byte_time() * p_data.size();
+    if (m_unexpected.empty()) {
+      compare_written();
+    }
+    play();
+  }
+
+  size_t bytes_available() override
+  {
+    play();
+    size_t available = m_rx_arrived - m_rx_read;
+    if (available != 0 && chance(m_disturbances.withhold)) {
+      return 0;
+    }
+    if (available > 1 && chance(m_disturbances.partial)) {
+      return random(1, available);
+    }
+    return available;
+  }
+
+  std::span<const std::byte> read(std::span<std::byte> p_data) override
+  {
+    play();
+    size_t count = std::min(p_data.size(), m_rx_arrived - m_rx_read);
+    if (count > 1 && chance(m_disturbances.partial)) {
+      count = random(1, count);
+    }
+    for (size_t i = 0; i < count; i++) {
+      p_data[i] = static_cast<std::byte>(m_rx[m_rx_read + i]);
+    }
+    m_rx_read += count;
+    return p_data.first(count);
+  }
+
+  void flush() override
+  {
+    play();
+    m_rx_read = m_rx_arrived;
+  }
+
+private:
+  static constexpr size_t busy_polls_before_waiting = 1000;
+
+  struct event
+  {
+    enum class kind : uint8_t
+    {
+      expect,
+      reply,
+      pause,
+    };
+
+    kind type;
+    std::string text;
+    std::chrono::microseconds duration;
+  };
+
+  bool driver_initialize() override { return true; }
+
+  bool chance(uint8_t p_percent)
+  {
+    return p_percent != 0 && random(1, 100) <= p_percent;
+  }
+
+  size_t random(size_t p_minimum, size_t p_maximum)
+  {
+    return std::uniform_int_distribution<size_t>(p_minimum,
+                                                 p_maximum)(m_random);
+  }
+
+  std::chrono::microseconds byte_time()
+  {
+    return std::chrono::microseconds(10'000'000 / settings().baud_rate);
+  }
+
+  /// @return when the last byte sent to the driver so far will have arrived
+  std::chrono::microseconds line_idle() const
+  {
+    return m_next_arrival +
+           m_byte_time * (m_rx.size() - m_rx_arrived) - m_byte_time;
+  }
+
+  /**
+   * @brief Check that what has been written since the last expect matched
+   * continues the expects still to come. The driver may write ahead of
+   * replies it has no need to wait for, so the replies and pauses in between
+   * are not taken into account.
+   */
+  void compare_written()
+  {
+    std::string_view written = m_written;
+    written.remove_prefix(m_written_matched);
+    for (size_t i = m_position; i < m_script.size() && !written.empty(); i++) {
+      const auto& next = m_script[i];
+      if (next.type != event::kind::expect) {
+        continue;
+      }
+      auto length = std::min(written.size(), next.text.size());
+      if (written.substr(0, length) != next.text.substr(0, length)) {
+        break;
+      }
+      written.remove_prefix(length);
+    }
+    m_unexpected = written;
+    check(m_unexpected.empty(),
+          "the script did not expect the driver to write " +
+            escape(std::string_view(m_unexpected).substr(0, 64)));
+  }
+
+  /// Move the script and the bytes in flight along to the current time
+  void play()
+  {
+    m_byte_time = byte_time();
+
+    while (m_unexpected.empty() && m_position < m_script.size() &&
+           m_now >= m_release) {
+      auto& next = m_script[m_position];
+      if (next.type == event::kind::expect) {
+        if (m_written.compare(
+              m_written_matched, next.text.size(), next.text) != 0) {
+          break;
+        }
+        m_written_matched += next.text.size();
+        // The esp8266 only acts once the command has fully arrived
+        m_release = std::max(m_release, m_tx_done);
+      } else if (next.type == event::kind::reply) {
+        if (m_rx_arrived == m_rx.size()) {
+          m_next_arrival = std::max(m_now, m_release) + m_byte_time;
+        }
+        m_rx += next.text;
+      } else {
+        m_release = std::max(m_now, line_idle()) + next.duration;
+      }
+      m_position++;
+    }
+
+    while (m_rx_arrived < m_rx.size() && m_next_arrival <= m_now) {
+      m_rx_arrived++;
+      m_next_arrival += m_byte_time;
+    }
+  }
+
+  /// @return p_text the way it would be written in a transcript
+  static std::string escape(std::string_view p_text)
+  {
+    std::string result;
+    for (char character : p_text) {
+      if (character == '\r') {
+        result += "\\r";
+      } else if (character == '\n') {
+        result += "\\n";
+      } else if (character == '\\') {
+        result += "\\\\";
+      } else if (character < ' ' || character > '~') {
+        constexpr std::string_view digits = "0123456789abcdef";
+        auto value = static_cast<uint8_t>(character);
+        result += "\\x";
+        result += digits[value >> 4];
+        result += digits[value & 0xf];
+      } else {
+        result += character;
+      }
+    }
+    return result;
+  }
+
+  static std::string unescape(std::string_view p_text)
+  {
+    std::string result;
+    for (size_t i = 0; i < p_text.size(); i++) {
+      if (p_text[i] != '\\' || i + 1 == p_text.size()) {
+        result += p_text[i];
+        continue;
+      }
+      char code = p_text[++i];
+      uint8_t value = 0;
+      if (code == 'r') {
+        result += '\r';
+      } else if (code == 'n') {
+        result += '\n';
+      } else if (code == 'x' &&
+                 embed::from_hex(p_text.substr(i + 1, 2), value)) {
+        result += static_cast<char>(value);
+        i += 2;
+      } else {
+        result += code;
+      }
+    }
+    return result;
+  }
+
+  std::vector<event> m_script;
+  size_t m_position = 0;
+  std::string m_written;
+  /// Offset in m_written and time of each write
+  std::vector<std::pair<size_t, std::chrono::microseconds>> m_write_times;
+  size_t m_written_matched = 0;
+  std::string m_unexpected;
+  std::string m_rx;
+  size_t m_rx_arrived = 0;
+  size_t m_rx_read = 0;
+  std::chrono::microseconds m_now{ 0 };
+  std::chrono::microseconds m_release{ 0 };
+  std::chrono::microseconds m_next_arrival{ 0 };
+  std::chrono::microseconds m_tx_done{ 0 };
+  /// Calls to busy() that found the port busy since time last moved on
+  size_t m_busy_polls = 0;
+  size_t m_blocked_waits = 0;
+  std::chrono::microseconds m_byte_time{ 87 };
+  disturbances m_disturbances{};
+  std::mt19937 m_random;
+};
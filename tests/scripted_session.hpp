@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "check.hpp"
+#include "scripted_serial.hpp"
+
+using state = embed::esp8266::state;
+using namespace std::chrono_literals;
+
+/// How often the application loop calls get_status()
+inline constexpr auto call_period = 100us;
+
+/// Initialization of a driver that is not multiplexing, up to joining the
+/// access point
+inline constexpr std::string_view startup = R"(> ATE0\r\n
+< \r\nOK\r\n
+> AT+CWMODE=1\r\n
+< \r\nOK\r\n
+> AT+CWJAP_CUR="SSID","PASSWORD"\r\n
+< WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n
+)";
+
+inline bool finished(state p_state)
+{
+  return p_state == state::complete || p_state == state::failure ||
+         p_state == state::timeout;
+}
+
+inline std::string_view text(std::span<const std::byte> p_bytes)
+{
+  return std::string_view(reinterpret_cast<const char*>(p_bytes.data()),
+                          p_bytes.size());
+}
+
+/// @return the request line and header the driver sends for p_request
+inline std::string serialized(const embed::esp8266::request_t& p_request)
+{
+  std::array<std::byte, 512> buffer;
+  return std::string(
+    text(embed::esp8266::serialize_request(p_request, buffer)));
+}
+
+/**
+ * @brief Call get_status() until p_done returns true for the state it returns,
+ * or until p_limit of simulated time has passed
+ *
+ * @return the last state returned by get_status()
+ */
+template<typename Done>
+state drive(embed::esp8266& p_esp,
+            scripted_serial& p_serial,
+            Done p_done,
+            std::chrono::microseconds p_limit = 20s)
+{
+  auto limit = p_serial.now() + p_limit;
+  auto status = p_esp.get_status();
+  while (!p_done(status) && p_serial.now() < limit) {
+    p_serial.advance(call_period);
+    status = p_esp.get_status();
+  }
+  return status;
+}
+
+/// Keep calling get_status() for p_duration of simulated time
+inline void idle(embed::esp8266& p_esp,
+                 scripted_serial& p_serial,
+                 std::chrono::microseconds p_duration)
+{
+  drive(p_esp, p_serial, [](state) { return false; }, p_duration);
+}
+
+/// Initialize p_esp and join the access point
+inline bool join(embed::esp8266& p_esp, scripted_serial& p_serial)
+{
+  return check(p_esp.initialize(), "initialize") &&
+         check(drive(p_esp,
+                     p_serial,
+                     [&p_esp](state) { return p_esp.connected(); }) ==
+                 state::connected_to_ap,
+               "join the access point");
+}
+
+/// Make p_request and wait for it to finish
+inline state fetch(embed::esp8266& p_esp,
+                   scripted_serial& p_serial,
+                   const embed::esp8266::request_t& p_request)
+{
+  p_esp.request(p_request);
+  return drive(p_esp, p_serial, finished);
+}
+
+/// Collects the body it is given
+class string_sink : public embed::body_sink
+{
+public:
+  void write(std::span<const std::byte> p_data) override
+  {
+    body += text(p_data);
+    writes++;
+  }
+
+  std::string body;
+  size_t writes = 0;
+};
+
+inline std::string make_body(size_t p_size)
+{
+  std::string body(p_size, ' ');
+  for (size_t i = 0; i < body.size(); i++) {
+    body[i] = static_cast<char>('a' + i % 26);
+  }
+  return body;
+}